@@ -0,0 +1,51 @@
+#include "benchutil.h"
+#include "rt.h"
+
+#include <stdlib.h>
+
+/* keeps the sums from being optimized away */
+static volatile i64 sink;
+
+/* building, walking and collecting lists of integers, where the size of an any
+   decides how many conses fit in a cache line */
+void cons_bench_suite(void) {
+    printf("running benchmark suite cons_bench_suite...\n");
+    printf("    %-32s %10lu bytes\n", "any size", (unsigned long)sizeof(struct rt_any));
+    printf("    %-32s %10lu bytes\n", "cons box size", (unsigned long)(sizeof(struct rt_cons) + RT_BOX_HEADER_SIZE));
+    rt_init();
+    for (u32 length = 10000; length <= 1000000; length *= 10) {
+        struct rt_task task = {0,};
+        struct rt_type *types[2] = { rt_types.any, NULL };
+        struct rt_any list = rt_nil;
+        void *roots[3] = { task.roots, types, &list };
+        task.roots = roots;
+
+        double start = bench_now();
+        for (u32 i = 0; i < length; ++i) {
+            list = rt_new_cons(&task, rt_new_i64(&task, i), list);
+        }
+        BENCH_REPORT("cons list build", length, bench_now() - start, length);
+
+        start = bench_now();
+        i64 sum = 0;
+        for (struct rt_any it = list; !rt_any_is_nil(it); it = rt_cdr(it)) {
+            sum += rt_any_to_i64(rt_car(it));
+        }
+        sink = sum;
+        BENCH_REPORT("cons list sum", length, bench_now() - start, length);
+
+        /* everything survives, so this is all marking */
+        start = bench_now();
+        rt_gc_run(&task);
+        BENCH_REPORT("cons list mark", length, bench_now() - start, length);
+
+        list = rt_nil;
+        start = bench_now();
+        rt_gc_run(&task);
+        BENCH_REPORT("cons list sweep", length, bench_now() - start, length);
+
+        task.roots = roots[0];
+        rt_task_cleanup(&task);
+    }
+    rt_cleanup();
+}
@@ -0,0 +1,65 @@
+#include "benchutil.h"
+#include "rt.h"
+
+#include <stdlib.h>
+
+static const char *bench_source =
+    "((def count-down (fn (n) (while (< 0 n) (set n (- n 1))))) "
+    " (def count-down-by-global (fn (n) (while (< zero n) (set n (- n one))))) "
+    " (def zero 0) "
+    " (def one 1) "
+    " (def fib (fn (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))) "
+    " (def typed-count-down (fn (n:i64) (while (< 0 n) (set n (- n 1))))) "
+    " (def tail-count-down (fn (n:i64) (if (< 0 n) (tail-count-down (- n 1)) n))) "
+    " (def typed-fib (fn (n:i64):i64 (if (< n 2) n (+ (typed-fib (- n 1)) (typed-fib (- n 2)))))))";
+
+static struct rt_any get_global(struct rt_module *mod, const char *name) {
+    struct rt_any value = rt_nil;
+    rt_module_get_global(mod, rt_get_symbol(name).u.symbol, &value);
+    return value;
+}
+
+static void bench_call(const char *name, struct rt_any func, i64 arg, u64 ops,
+                       struct rt_any (*call)(struct rt_task *, struct rt_any, u32, struct rt_any *),
+                       struct rt_task *task) {
+    struct rt_any args[1] = { rt_new_i64(task, arg) };
+    double start = bench_now();
+    call(task, func, 1, args);
+    BENCH_REPORT(name, arg, bench_now() - start, ops);
+}
+
+/* the tree walker against the VM, on a tight loop and on recursive calls */
+void eval_bench_suite(void) {
+    printf("running benchmark suite eval_bench_suite...\n");
+    rt_init();
+    struct rt_task task = {0,};
+    struct rt_module mod = {0,};
+    task.current_module = &mod;
+    mod.root_block = rt_parse_module(&task, rt_read(&task, bench_source));
+
+    struct rt_any count_down = get_global(&mod, "count-down");
+    struct rt_any count_down_by_global = get_global(&mod, "count-down-by-global");
+    struct rt_any fib = get_global(&mod, "fib");
+    struct rt_any typed_count_down = get_global(&mod, "typed-count-down");
+    struct rt_any typed_fib = get_global(&mod, "typed-fib");
+    struct rt_any tail_count_down = get_global(&mod, "tail-count-down");
+    bench_call("loop iteration (ast)", count_down, 1000000, 1000000, rt_ast_call, &task);
+    bench_call("loop iteration (vm)", count_down, 1000000, 1000000, rt_vm_call, &task);
+    /* as above, with the constants in globals, which are inlined */
+    bench_call("global loop iteration (ast)", count_down_by_global, 1000000, 1000000, rt_ast_call, &task);
+    bench_call("global loop iteration (vm)", count_down_by_global, 1000000, 1000000, rt_vm_call, &task);
+    /* fib(25) makes 242785 calls */
+    bench_call("fib call (ast)", fib, 25, 242785, rt_ast_call, &task);
+    bench_call("fib call (vm)", fib, 25, 242785, rt_vm_call, &task);
+    /* the same with i64 parameters, for the specialized nodes */
+    bench_call("typed loop iteration (ast)", typed_count_down, 1000000, 1000000, rt_ast_call, &task);
+    bench_call("typed loop iteration (vm)", typed_count_down, 1000000, 1000000, rt_vm_call, &task);
+    bench_call("typed fib call (ast)", typed_fib, 25, 242785, rt_ast_call, &task);
+    bench_call("typed fib call (vm)", typed_fib, 25, 242785, rt_vm_call, &task);
+    /* a loop written as tail recursion */
+    bench_call("tail call iteration (ast)", tail_count_down, 1000000, 1000000, rt_ast_call, &task);
+    bench_call("tail call iteration (vm)", tail_count_down, 1000000, 1000000, rt_vm_call, &task);
+
+    rt_task_cleanup(&task);
+    rt_cleanup();
+}
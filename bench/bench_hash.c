@@ -0,0 +1,84 @@
+#include "benchutil.h"
+#include "rt.h"
+
+#include <stdlib.h>
+
+/* the same map of addresses, in the robin-hood table and in the group table */
+DECL_HASH_TABLE(bench_robinmap, void *, u32)
+IMPL_HASH_TABLE(bench_robinmap, void *, u32, hashutil_ptr_hash, hashutil_ptr_equals)
+DECL_GROUP_HASH_TABLE(bench_groupmap, void *, u32)
+IMPL_GROUP_HASH_TABLE(bench_groupmap, void *, u32, hashutil_ptr_hash, hashutil_ptr_equals)
+
+/* keeps the lookups from being optimized away */
+static volatile u32 sink;
+
+/* keys are addresses of cons-sized boxes, as in the sourcemap. the misses are
+   the addresses in between */
+#define BENCH_HASH(Name, Map, Keys, Misses, Count)                             \
+    do {                                                                        \
+        struct Map map = {0,};                                                  \
+        double start = bench_now();                                             \
+        for (u32 i = 0; i < (Count); ++i) {                                     \
+            Map##_put(&map, (Keys)[i], i);                                      \
+        }                                                                       \
+        BENCH_REPORT(Name " insert", (Count), bench_now() - start, (Count));    \
+        u32 sum = 0, value;                                                     \
+        start = bench_now();                                                    \
+        for (u32 i = 0; i < (Count); ++i) {                                     \
+            if (Map##_get(&map, (Keys)[i], &value)) {                           \
+                sum += value;                                                   \
+            }                                                                   \
+        }                                                                       \
+        BENCH_REPORT(Name " hit", (Count), bench_now() - start, (Count));       \
+        start = bench_now();                                                    \
+        for (u32 i = 0; i < (Count); ++i) {                                     \
+            sum += Map##_get(&map, (Misses)[i], &value);                        \
+        }                                                                       \
+        BENCH_REPORT(Name " miss", (Count), bench_now() - start, (Count));      \
+        sink = sum;                                                             \
+        Map##_free(&map);                                                       \
+    } while (0)
+
+/* the longest any single put takes while the map is filled */
+#define BENCH_HASH_MAX_PUT(Name, Map, Keys, Count)                              \
+    do {                                                                        \
+        struct Map map = {0,};                                                  \
+        double worst = 0;                                                       \
+        for (u32 i = 0; i < (Count); ++i) {                                     \
+            double start = bench_now();                                         \
+            Map##_put(&map, (Keys)[i], i);                                      \
+            double t = bench_now() - start;                                     \
+            worst = t > worst ? t : worst;                                      \
+        }                                                                       \
+        BENCH_REPORT(Name " worst insert", (Count), worst, 1);                  \
+        Map##_free(&map);                                                       \
+    } while (0)
+
+/* insert, and hit and miss lookups, of the robin-hood tables against the group
+   tables, at sizes from cache resident to well beyond */
+void hash_bench_suite(void) {
+    printf("running benchmark suite hash_bench_suite...\n");
+    u32 max_count = 1 << 20;
+    char *boxes = malloc((rt_size_t)max_count * 32);
+    void **keys = malloc(sizeof(void *) * max_count);
+    void **misses = malloc(sizeof(void *) * max_count);
+    for (u32 i = 0; i < max_count; ++i) {
+        keys[i] = boxes + (rt_size_t)i * 32;
+        misses[i] = boxes + (rt_size_t)i * 32 + 16;
+    }
+    /* lookups in an order unrelated to the inserts */
+    for (u32 i = max_count - 1; i > 0; --i) {
+        u32 j = (u32)rand() % (i + 1);
+        void *t = keys[i]; keys[i] = keys[j]; keys[j] = t;
+    }
+    for (u32 count = 1 << 10; count <= max_count; count <<= 5) {
+        BENCH_HASH("robin-hood", bench_robinmap, keys, misses, count);
+        BENCH_HASH("group", bench_groupmap, keys, misses, count);
+    }
+    /* the group tables grow incrementally, the robin-hood ones all at once */
+    BENCH_HASH_MAX_PUT("robin-hood", bench_robinmap, keys, max_count);
+    BENCH_HASH_MAX_PUT("group", bench_groupmap, keys, max_count);
+    free(misses);
+    free(keys);
+    free(boxes);
+}
@@ -0,0 +1,69 @@
+#include "benchutil.h"
+#include "rt.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* source shaped like real code: indentation, comments, long names and
+   strings, repeated until the text has the given size */
+static char *make_source(size_t size) {
+    static const char *chunk =
+        ";; computes the thing, for every element of the list given to it\n"
+        "(def compute-the-thing-for-each-element\n"
+        "    (fn (list-of-elements accumulated-result:i64)\n"
+        "        (if (nil? list-of-elements)\n"
+        "            accumulated-result\n"
+        "            (compute-the-thing-for-each-element (cdr list-of-elements)\n"
+        "                                                (+ accumulated-result 1)))))\n"
+        "\n"
+        "(print \"a message which is printed when the thing has been computed\")\n";
+    size_t chunk_len = strlen(chunk);
+    char *text = malloc(size);
+    size_t len = 0;
+    for (; len + chunk_len <= size; len += chunk_len) {
+        memcpy(text + len, chunk, chunk_len);
+    }
+    memset(text + len, ' ', size - len);
+    return text;
+}
+
+/* with a module, the locations of conses and lines are recorded in it */
+static void bench_read(const char *name, const struct rt_scanner *scanner, const char *text, size_t len,
+                       struct rt_module *mod) {
+    struct rt_task task = {0,};
+    task.current_module = mod;
+    struct rt_reader reader;
+    struct rt_any form;
+    rt_reader_init_string(&reader, &task, text, len);
+    reader.scanner = scanner;
+    double start = bench_now();
+    while (rt_reader_next(&reader, &form)) {
+    }
+    BENCH_REPORT_RATE(name, len >> 20, bench_now() - start, len);
+    rt_reader_close(&reader);
+    if (mod) {
+        /* the first lookup moves the recorded locations into the sourcemap */
+        u32 offset;
+        start = bench_now();
+        rt_module_find_location(mod, form.u.cons, &offset);
+        BENCH_REPORT("sourcemap build per cons", mod->sourcemap.used, bench_now() - start, mod->sourcemap.used);
+        printf("    %-32s %10lu bytes\n", "sourcemap size per cons",
+               (unsigned long)(mod->sourcemap.size * (sizeof(struct rt_sourcemap_entry) + 1) / mod->sourcemap.used));
+    }
+    rt_task_cleanup(&task);
+}
+
+/* reader throughput, with the scalar scanner and the one picked for the CPU */
+void read_bench_suite(void) {
+    printf("running benchmark suite read_bench_suite...\n");
+    rt_init();
+    size_t len = 32 << 20;
+    char *text = make_source(len);
+    bench_read("read (scalar)", &rt_scanner_scalar, text, len, NULL);
+    bench_read("read (rt_get_scanner)", rt_get_scanner(), text, len, NULL);
+    struct rt_module mod = {0,};
+    bench_read("read with locations", rt_get_scanner(), text, len, &mod);
+    printf("    scanner picked: %s\n", rt_get_scanner()->name);
+    free(text);
+    rt_cleanup();
+}
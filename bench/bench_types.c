@@ -0,0 +1,45 @@
+#include "benchutil.h"
+#include "rt.h"
+
+#include <stdlib.h>
+
+#define LOOKUPS 1000000
+
+/* keeps the lookups from being optimized away */
+static struct rt_type *volatile sink;
+
+/* a distinct struct type for each i, with a single field at a different offset */
+static struct rt_type *get_struct_type(u32 i) {
+    struct rt_struct_field field = { rt_types.u64, "x", (rt_size_t)i * 8 };
+    return rt_gettype_struct("bench", (rt_size_t)i * 8 + 8, 1, &field);
+}
+
+/* lookups of existing types should cost the same however many types there are */
+void type_bench_suite(void) {
+    printf("running benchmark suite type_bench_suite...\n");
+    for (u32 count = 100; count <= 100000; count *= 10) {
+        rt_init();
+
+        double start = bench_now();
+        for (u32 i = 0; i < count; ++i) {
+            get_struct_type(i);
+        }
+        BENCH_REPORT("struct type creation", count, bench_now() - start, count);
+
+        u32 seed = 1;
+        start = bench_now();
+        for (u32 i = 0; i < LOOKUPS; ++i) {
+            seed = seed * 1103515245 + 12345;
+            sink = get_struct_type(seed % count);
+        }
+        BENCH_REPORT("struct type lookup", count, bench_now() - start, LOOKUPS);
+
+        start = bench_now();
+        for (u32 i = 0; i < LOOKUPS; ++i) {
+            sink = rt_gettype_boxed(get_struct_type(i % count));
+        }
+        BENCH_REPORT("boxed struct type lookup", count, bench_now() - start, LOOKUPS);
+
+        rt_cleanup();
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef BENCHUTIL_H
+#define BENCHUTIL_H
+
+#include <stdio.h>
+#include <time.h>
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#define BENCH_REPORT(Name, Param, Seconds, Ops) \
+    printf("    %-32s %10lu: %10.1f ns/op\n", (Name), (unsigned long)(Param), (Seconds) * 1e9 / (Ops))
+
+#define BENCH_REPORT_RATE(Name, Param, Seconds, Bytes) \
+    printf("    %-32s %10lu: %10.1f MB/s\n", (Name), (unsigned long)(Param), (Bytes) / (Seconds) * 1e-6)
+
+#endif
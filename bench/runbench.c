@@ -0,0 +1,14 @@
+void type_bench_suite(void);
+void eval_bench_suite(void);
+void read_bench_suite(void);
+void cons_bench_suite(void);
+void hash_bench_suite(void);
+
+int main(int argc, char *argv[]) {
+    type_bench_suite();
+    eval_bench_suite();
+    read_bench_suite();
+    cons_bench_suite();
+    hash_bench_suite();
+    return 0;
+}
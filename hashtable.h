@@ -59,8 +59,11 @@ static uint32_t hashutil_dist_to_start(uint32_t table_size, uint32_t hash, uint3
     };                                                          \
     void name##_clear(struct name *table);                      \
     int name##_remove(struct name *table, key_type key);        \
+    uint32_t name##_remove_if(struct name *table, int (*pred)(struct name##_entry *entry, void *userdata), void *userdata); \
     int name##_get(struct name *table, key_type key, value_type *value_out); \
     void name##_put(struct name *table, key_type key, value_type value); \
+    void name##_reserve(struct name *table, uint32_t count);    \
+    void name##_finish_resize(struct name *table);              \
     void name##_init(struct name *table, uint32_t initial_size); \
     void name##_free(struct name *table);
 
@@ -122,12 +125,11 @@ static uint32_t hashutil_dist_to_start(uint32_t table_size, uint32_t hash, uint3
             }                                                           \
         }                                                               \
     }                                                                   \
-    int name##_remove(struct name *table, key_type key) {               \
+    static int name##_slot_used(struct name *table, uint32_t index) {  \
+        return table->entries[index].hash != 0;                         \
+    }                                                                   \
+    static void name##_remove_at(struct name *table, uint32_t index) {  \
         struct name##_entry temp;                                       \
-        uint32_t index;                                                 \
-        if (!name##_find(table, key, &index)) {                         \
-            return 0;                                                   \
-        }                                                               \
         for (uint32_t i = 0; i < table->size; ++i) {                    \
             uint32_t curr_index = (index + i) & (table->size - 1);      \
             uint32_t next_index = (index + i + 1) & (table->size - 1);  \
@@ -135,14 +137,37 @@ static uint32_t hashutil_dist_to_start(uint32_t table_size, uint32_t hash, uint3
             if (next_hash == 0 || hashutil_dist_to_start(table->size, next_hash, next_index) == 0) { \
                 table->entries[curr_index].hash = 0;                    \
                 --table->used;                                          \
-                return 1;                                               \
+                return;                                                 \
             }                                                           \
             temp = table->entries[curr_index];                          \
             table->entries[curr_index] = table->entries[next_index];    \
             table->entries[next_index] = temp;                          \
         }                                                               \
         assert(0 && "control flow should not get here");                \
-        return 0;                                                       \
+    }                                                                   \
+    int name##_remove(struct name *table, key_type key) {               \
+        uint32_t index;                                                 \
+        if (!name##_find(table, key, &index)) {                         \
+            return 0;                                                   \
+        }                                                               \
+        name##_remove_at(table, index);                                 \
+        return 1;                                                       \
+    }                                                                   \
+    /* removing shifts the following entries back into the slot, so it is \
+       looked at again. an entry shifted around the end of the table has \
+       been looked at already, and is kept again */                     \
+    uint32_t name##_remove_if(struct name *table, int (*pred)(struct name##_entry *entry, void *userdata), void *userdata) { \
+        uint32_t removed = 0;                                           \
+        for (uint32_t i = 0; i < table->size && table->used; ) {        \
+            struct name##_entry *slot = table->entries + i;             \
+            if (slot->hash && pred(slot, userdata)) {                   \
+                name##_remove_at(table, i);                             \
+                ++removed;                                              \
+            } else {                                                    \
+                ++i;                                                    \
+            }                                                           \
+        }                                                               \
+        return removed;                                                 \
     }                                                                   \
     static void name##_resize(struct name *table, uint32_t new_size) {  \
         uint32_t old_used = table->used;                                \
@@ -180,6 +205,15 @@ static uint32_t hashutil_dist_to_start(uint32_t table_size, uint32_t hash, uint3
         entry.value = value;                                            \
         name##_put_entry(table, entry);                                 \
     }                                                                   \
+    /* grows right away, so that puts of up to count entries in all never have to */ \
+    void name##_reserve(struct name *table, uint32_t count) {           \
+        if ((float)count > table->size * 0.85f) {                       \
+            name##_resize(table, hashutil_next_pow2(count + count / 4)); \
+        }                                                               \
+    }                                                                   \
+    /* these tables always resize in one go */                          \
+    void name##_finish_resize(struct name *table) {                     \
+    }                                                                   \
     void name##_init(struct name *table, uint32_t initial_size) {       \
         table->used = 0;                                                \
         table->size = 0;                                                \
@@ -193,4 +227,331 @@ static uint32_t hashutil_dist_to_start(uint32_t table_size, uint32_t hash, uint3
         table->entries = 0;                                             \
     }
 
+
+/* group tables keep a control byte per slot in an array of their own: the low 7
+   bits of the hash of the key in it with the top bit set, or one of the two
+   markers below, which have it clear. empty slots are zero, so zeroed memory is
+   an empty table, and a big one costs nothing to set up. a probe looks at the control bytes of 16 slots at once, and
+   only compares the keys whose 7 bits match, so the entries need not hold the
+   hash. groups are unaligned windows of 16 slots, and the first 16 control bytes
+   are repeated after the last, so a window starting near the end wraps around.
+   removed entries leave a marker behind unless no probe can have gone past the
+   slot, and are purged when the table is rebuilt */
+#define HASHUTIL_GROUP_WIDTH 16
+#define HASHUTIL_CTRL_EMPTY 0x00
+#define HASHUTIL_CTRL_DELETED 0x01
+#define HASHUTIL_CTRL_FULL 0x80
+
+/* the control byte of a slot holding a key with the hash */
+static uint8_t hashutil_ctrl_of(uint32_t hash) {
+    return (uint8_t)((hash & 0x7f) | HASHUTIL_CTRL_FULL);
+}
+
+#if defined(__SSE2__) && !defined(RT_HASH_NO_SIMD)
+#include <emmintrin.h>
+
+/* bit i is set if the control byte of slot i of the group matches */
+static uint32_t hashutil_group_match(const uint8_t *ctrl, uint8_t h2) {
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)h2)));
+}
+static uint32_t hashutil_group_match_empty(const uint8_t *ctrl) {
+    return hashutil_group_match(ctrl, HASHUTIL_CTRL_EMPTY);
+}
+/* slots which are empty or deleted, the only control bytes with the top bit clear */
+static uint32_t hashutil_group_match_free(const uint8_t *ctrl) {
+    return ~(uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl)) & 0xffff;
+}
+#else
+static uint32_t hashutil_group_match(const uint8_t *ctrl, uint8_t h2) {
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < HASHUTIL_GROUP_WIDTH; ++i) {
+        mask |= (uint32_t)(ctrl[i] == h2) << i;
+    }
+    return mask;
+}
+static uint32_t hashutil_group_match_empty(const uint8_t *ctrl) {
+    return hashutil_group_match(ctrl, HASHUTIL_CTRL_EMPTY);
+}
+static uint32_t hashutil_group_match_free(const uint8_t *ctrl) {
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < HASHUTIL_GROUP_WIDTH; ++i) {
+        mask |= (uint32_t)!(ctrl[i] & HASHUTIL_CTRL_FULL) << i;
+    }
+    return mask;
+}
+#endif
+
+/* sets the control byte of a slot, and its copy past the end */
+static void hashutil_set_ctrl(uint8_t *ctrl, uint32_t size, uint32_t index, uint8_t value) {
+    ctrl[index] = value;
+    if (index < HASHUTIL_GROUP_WIDTH) {
+        ctrl[size + index] = value;
+    }
+}
+
+/* group tables of at least this many slots grow incrementally: the new slots
+   are allocated, and the entries are moved over from the old ones a batch at a
+   time, by each get, put and remove that follows. the old slots are looked in
+   as well until all are moved, so no single call rehashes the whole table */
+#define HASHUTIL_INCREMENTAL_MIN_SIZE 1024
+/* old slots moved per call while growing incrementally. the new slots fill up
+   slower than this empties the old ones, so one growth finishes before the next.
+   smaller batches cost throughput, as more calls have to look in both */
+#define HASHUTIL_MIGRATE_SLOTS 256
+
+/* same functions as DECL_HASH_TABLE, but entries only hold the key and value,
+   and are used while the control byte of their slot has HASHUTIL_CTRL_FULL set.
+   code walking the entries must call name##_finish_resize first */
+#define DECL_GROUP_HASH_TABLE(name, key_type, value_type)       \
+    struct name##_entry {                                       \
+        key_type key;                                           \
+        value_type value;                                       \
+    };                                                          \
+    struct name {                                               \
+        /* used counts the entries not moved yet, too */       \
+        uint32_t used, size;                                    \
+        /* slots holding the removed marker */                  \
+        uint32_t deleted;                                       \
+        /* size + HASHUTIL_GROUP_WIDTH bytes, after the entries, in the same allocation */ \
+        uint8_t *ctrl;                                          \
+        struct name##_entry *entries;                           \
+        /* while growing incrementally, the slots being moved out of. those \
+           below old_moved are done, and old_used are still to be moved */ \
+        uint32_t old_size, old_used, old_moved;                 \
+        uint8_t *old_ctrl;                                      \
+        struct name##_entry *old_entries;                       \
+    };                                                          \
+    void name##_clear(struct name *table);                      \
+    int name##_remove(struct name *table, key_type key);        \
+    uint32_t name##_remove_if(struct name *table, int (*pred)(struct name##_entry *entry, void *userdata), void *userdata); \
+    int name##_get(struct name *table, key_type key, value_type *value_out); \
+    void name##_put(struct name *table, key_type key, value_type value); \
+    void name##_reserve(struct name *table, uint32_t count);    \
+    void name##_finish_resize(struct name *table);              \
+    void name##_init(struct name *table, uint32_t initial_size); \
+    void name##_free(struct name *table);
+
+#define IMPL_GROUP_HASH_TABLE(name, key_type, value_type, key_hasher, key_equals) \
+    static int name##_slot_used(struct name *table, uint32_t index) {  \
+        return table->ctrl[index] & HASHUTIL_CTRL_FULL;                \
+    }                                                                   \
+    static void name##_free_old(struct name *table) {                   \
+        free(table->old_entries);                                       \
+        table->old_size = 0;                                            \
+        table->old_used = 0;                                            \
+        table->old_moved = 0;                                           \
+        table->old_ctrl = 0;                                            \
+        table->old_entries = 0;                                         \
+    }                                                                   \
+    void name##_clear(struct name *table) {                             \
+        name##_free_old(table);                                         \
+        if (table->size) {                                              \
+            memset(table->ctrl, HASHUTIL_CTRL_EMPTY, table->size + HASHUTIL_GROUP_WIDTH); \
+        }                                                               \
+        table->used = 0;                                                \
+        table->deleted = 0;                                             \
+    }                                                                   \
+    /* groups are visited at triangular offsets, which reaches each of them once. \
+       slots below skip_below are ignored, for the old slots already moved */ \
+    static int name##_find_in(uint8_t *ctrl, struct name##_entry *entries, uint32_t size, uint32_t skip_below, \
+                              key_type key, uint32_t hash, uint32_t *index_out) { \
+        uint32_t mask = size - 1;                                       \
+        uint32_t pos = (hash >> 7) & mask;                              \
+        for (uint32_t stride = 0; stride <= mask; ) {                   \
+            const uint8_t *group = ctrl + pos;                          \
+            for (uint32_t m = hashutil_group_match(group, hashutil_ctrl_of(hash)); m; m &= m - 1) { \
+                uint32_t index = (pos + __builtin_ctz(m)) & mask;       \
+                if (index >= skip_below && key_equals(entries[index].key, key)) { \
+                    *index_out = index;                                 \
+                    return 1;                                           \
+                }                                                       \
+            }                                                           \
+            if (hashutil_group_match_empty(group)) {                    \
+                break;                                                  \
+            }                                                           \
+            stride += HASHUTIL_GROUP_WIDTH;                             \
+            pos = (pos + stride) & mask;                                \
+        }                                                               \
+        return 0;                                                       \
+    }                                                                   \
+    static int name##_find(struct name *table, key_type key, uint32_t hash, uint32_t *index_out) { \
+        if (table->used == table->old_used) {                           \
+            return 0;                                                   \
+        }                                                               \
+        return name##_find_in(table->ctrl, table->entries, table->size, 0, key, hash, index_out); \
+    }                                                                   \
+    static int name##_find_old(struct name *table, key_type key, uint32_t hash, uint32_t *index_out) { \
+        if (!table->old_used) {                                         \
+            return 0;                                                   \
+        }                                                               \
+        return name##_find_in(table->old_ctrl, table->old_entries, table->old_size, table->old_moved, key, hash, index_out); \
+    }                                                                   \
+    /* for a key which is not in the table, which has room for it */   \
+    static void name##_put_new(struct name *table, uint32_t hash, struct name##_entry entry) { \
+        uint32_t mask = table->size - 1;                                \
+        uint32_t pos = (hash >> 7) & mask;                              \
+        for (uint32_t stride = 0; ; ) {                                 \
+            uint32_t m = hashutil_group_match_free(table->ctrl + pos);  \
+            if (m) {                                                    \
+                uint32_t index = (pos + __builtin_ctz(m)) & mask;       \
+                if (table->ctrl[index] == HASHUTIL_CTRL_DELETED) {      \
+                    --table->deleted;                                   \
+                }                                                       \
+                hashutil_set_ctrl(table->ctrl, table->size, index, hashutil_ctrl_of(hash)); \
+                table->entries[index] = entry;                          \
+                ++table->used;                                          \
+                return;                                                 \
+            }                                                           \
+            stride += HASHUTIL_GROUP_WIDTH;                             \
+            pos = (pos + stride) & mask;                                \
+        }                                                               \
+    }                                                                   \
+    /* move the entries of up to count old slots into the new ones */  \
+    static void name##_move_old(struct name *table, uint32_t count) {  \
+        uint32_t end = table->old_moved + count;                        \
+        if (end > table->old_size) {                                    \
+            end = table->old_size;                                      \
+        }                                                               \
+        for (uint32_t i = table->old_moved; i < end && table->old_used; ++i) { \
+            if (table->old_ctrl[i] & HASHUTIL_CTRL_FULL) {             \
+                --table->used;                                          \
+                --table->old_used;                                      \
+                name##_put_new(table, key_hasher(table->old_entries[i].key), table->old_entries[i]); \
+            }                                                           \
+        }                                                               \
+        table->old_moved = end;                                         \
+        if (!table->old_used) {                                         \
+            name##_free_old(table);                                     \
+        }                                                               \
+    }                                                                   \
+    void name##_finish_resize(struct name *table) {                     \
+        if (table->old_entries) {                                       \
+            name##_move_old(table, table->old_size);                    \
+        }                                                               \
+    }                                                                   \
+    /* the entries of a big enough table are left in the old slots, to be \
+       moved by the calls that follow. otherwise they are moved right away */ \
+    static void name##_resize(struct name *table, uint32_t new_size) {  \
+        name##_finish_resize(table);                                    \
+        if (new_size < HASHUTIL_GROUP_WIDTH) {                          \
+            new_size = HASHUTIL_GROUP_WIDTH;                            \
+        }                                                               \
+        assert(!(new_size & (new_size - 1)));                           \
+        table->old_size = table->size;                                  \
+        table->old_used = table->used;                                  \
+        table->old_moved = 0;                                           \
+        table->old_ctrl = table->ctrl;                                  \
+        table->old_entries = table->entries;                            \
+        table->size = new_size;                                         \
+        table->deleted = 0;                                             \
+        table->entries = (struct name##_entry *)calloc(1, (sizeof(struct name##_entry) + 1) * new_size + HASHUTIL_GROUP_WIDTH); \
+        table->ctrl = (uint8_t *)(table->entries + new_size);           \
+        if (table->old_size < HASHUTIL_INCREMENTAL_MIN_SIZE || !table->old_used) { \
+            name##_move_old(table, table->old_size);                    \
+        }                                                               \
+    }                                                                   \
+    /* the slot can be made empty again if it is not in a window of 16 slots \
+       which have all been in use, as any probe would have stopped there */ \
+    static void name##_remove_at(uint8_t *ctrl, uint32_t size, uint32_t index, uint32_t *deleted) { \
+        uint32_t mask = size - 1;                                       \
+        uint32_t empty_before = hashutil_group_match_empty(ctrl + ((index - HASHUTIL_GROUP_WIDTH) & mask)); \
+        uint32_t empty_after = hashutil_group_match_empty(ctrl + index); \
+        if (empty_before && empty_after &&                              \
+            __builtin_ctz(empty_after) + (__builtin_clz(empty_before) - 16) < HASHUTIL_GROUP_WIDTH) { \
+            hashutil_set_ctrl(ctrl, size, index, HASHUTIL_CTRL_EMPTY);  \
+        } else {                                                        \
+            hashutil_set_ctrl(ctrl, size, index, HASHUTIL_CTRL_DELETED); \
+            ++*deleted;                                                 \
+        }                                                               \
+    }                                                                   \
+    int name##_remove(struct name *table, key_type key) {               \
+        uint32_t hash = key_hasher(key);                                \
+        uint32_t index, old_deleted = 0;                                \
+        if (table->old_entries) {                                       \
+            name##_move_old(table, HASHUTIL_MIGRATE_SLOTS);             \
+        }                                                               \
+        if (name##_find(table, key, hash, &index)) {                    \
+            name##_remove_at(table->ctrl, table->size, index, &table->deleted); \
+        } else if (name##_find_old(table, key, hash, &index)) {         \
+            /* the old slots are never put into again, so their markers are not counted */ \
+            name##_remove_at(table->old_ctrl, table->old_size, index, &old_deleted); \
+            if (!--table->old_used) {                                   \
+                name##_free_old(table);                                 \
+            }                                                           \
+        } else {                                                        \
+            return 0;                                                   \
+        }                                                               \
+        --table->used;                                                  \
+        return 1;                                                       \
+    }                                                                   \
+    uint32_t name##_remove_if(struct name *table, int (*pred)(struct name##_entry *entry, void *userdata), void *userdata) { \
+        uint32_t removed = 0;                                           \
+        name##_finish_resize(table);                                    \
+        for (uint32_t i = 0; i < table->size && table->used; ++i) {     \
+            if ((table->ctrl[i] & HASHUTIL_CTRL_FULL) && pred(table->entries + i, userdata)) { \
+                name##_remove_at(table->ctrl, table->size, i, &table->deleted); \
+                --table->used;                                          \
+                ++removed;                                              \
+            }                                                           \
+        }                                                               \
+        return removed;                                                 \
+    }                                                                   \
+    int name##_get(struct name *table, key_type key, value_type *value_out) { \
+        uint32_t hash = key_hasher(key);                                \
+        uint32_t index;                                                 \
+        if (table->old_entries) {                                       \
+            name##_move_old(table, HASHUTIL_MIGRATE_SLOTS);             \
+            if (name##_find_old(table, key, hash, &index)) {            \
+                *value_out = table->old_entries[index].value;           \
+                return 1;                                               \
+            }                                                           \
+        }                                                               \
+        if (name##_find(table, key, hash, &index)) {                    \
+            *value_out = table->entries[index].value;                   \
+            return 1;                                                   \
+        }                                                               \
+        return 0;                                                       \
+    }                                                                   \
+    /* grows past 7/8 of the slots in use or removed. if it is mostly      \
+       removed ones, it is rebuilt at the same size instead */          \
+    void name##_put(struct name *table, key_type key, value_type value) { \
+        uint32_t hash = key_hasher(key);                                \
+        uint32_t index;                                                 \
+        if (table->old_entries) {                                       \
+            name##_move_old(table, HASHUTIL_MIGRATE_SLOTS);             \
+            if (name##_find_old(table, key, hash, &index)) {            \
+                table->old_entries[index].value = value;                \
+                return;                                                 \
+            }                                                           \
+        }                                                               \
+        if (name##_find(table, key, hash, &index)) {                    \
+            table->entries[index].value = value;                        \
+            return;                                                     \
+        }                                                               \
+        if (table->used + table->deleted + 1 > table->size / 8 * 7) {   \
+            name##_resize(table, table->used + 1 > table->size / 16 * 7 ? table->size * 2 : table->size); \
+        }                                                               \
+        struct name##_entry entry;                                      \
+        entry.key = key;                                                \
+        entry.value = value;                                            \
+        name##_put_new(table, hash, entry);                             \
+    }                                                                   \
+    /* grows right away, so that puts of up to count entries in all never have to */ \
+    void name##_reserve(struct name *table, uint32_t count) {           \
+        if (count > table->size / 8 * 7) {                              \
+            name##_resize(table, hashutil_next_pow2(count + count / 4)); \
+            name##_finish_resize(table);                                \
+        }                                                               \
+    }                                                                   \
+    void name##_init(struct name *table, uint32_t initial_size) {       \
+        memset(table, 0, sizeof(struct name));                          \
+        name##_resize(table, initial_size);                             \
+    }                                                                   \
+    void name##_free(struct name *table) {                              \
+        name##_free_old(table);                                         \
+        free(table->entries);                                           \
+        memset(table, 0, sizeof(struct name));                          \
+    }
+
 #endif
@@ -17,7 +17,7 @@ static void print_ast(struct rt_astnode *node, u32 indent) {
     switch (node->node_type) {
     case RT_ASTNODE_LITERAL: {
         print_header("literal", node, indent);
-        if (rt_any_is_ptr(node->const_value) && node->const_value._type->u.ptr.target_type->kind == RT_KIND_FUNC) {
+        if (rt_any_is_func(node->const_value)) {
             print_ast(node->const_value.u.func->body_expr, indent + 4);
         } else {
             print_indent(indent + 4); rt_print(node->const_value); printf("\n");
@@ -52,21 +52,27 @@ static void print_ast(struct rt_astnode *node, u32 indent) {
     case RT_ASTNODE_CALL:
         print_header("call", node, indent);
         break;
+    case RT_ASTNODE_I64_OP:
+        print_header("i64_op", node, indent);
+        break;
+    case RT_ASTNODE_CHECK_TYPE:
+        print_header("check_type", node, indent);
+        print_ast(node->u.check_type.expr, indent + 4);
+        break;
     }
 }
 
 
 
-struct rt_astnode *rt_parse_module(struct rt_task *task, struct rt_any toplevel_module_list);
-
 int main(int argc, char *argv[]) {
     struct rt_task task = {0,};
     struct rt_module mod = {0,};
+    task.current_module = &mod;
 
     rt_init();
 
     assert(rt_get_symbol("sym").u.ptr == rt_get_symbol("sym").u.ptr);
-    assert(rt_any_equals(rt_new_u8(23), rt_new_i64(23)));
+    assert(rt_any_equals(rt_new_u8(23), rt_new_i64(&task, 23)));
     assert(rt_any_equals(rt_get_symbol("sym"), rt_get_symbol("sym")));
     assert(!rt_any_equals(rt_get_symbol("sym"), rt_get_symbol("sym2")));
     assert(rt_lookup_simple_type(rt_get_symbol("u32")) == rt_types.u32);
@@ -123,8 +129,6 @@ int main(int argc, char *argv[]) {
 
     printf("-\n");
 
-    rt_sourcemap_clear(&mod.location_before_car);
-    rt_sourcemap_clear(&mod.location_after_car);
     rt_gc_run(&task);
 
     rt_task_cleanup(&task);
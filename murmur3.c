@@ -9,6 +9,9 @@
 
 #include "murmur3.h"
 
+#include <stddef.h>
+#include <string.h>
+
 //-----------------------------------------------------------------------------
 // Platform-specific functions and macros
 
@@ -49,17 +52,22 @@ FORCE_INLINE uint64_t rotl64 ( uint64_t x, int8_t r )
 #endif // !defined(_MSC_VER)
 
 //-----------------------------------------------------------------------------
-// Block read - if your platform needs to do endian-swapping or can only
-// handle aligned reads, do the conversion here
+// Block read - if your platform needs to do endian-swapping, do the
+// conversion here. Keys may start at any offset, so blocks are read with
+// memcpy, which compiles to a plain load where unaligned loads are allowed
 
 FORCE_INLINE uint32_t getblock32 ( const uint32_t * p, int i )
 {
-  return p[i];
+  uint32_t block;
+  memcpy(&block, (const uint8_t *)p + (ptrdiff_t)i * (ptrdiff_t)sizeof(block), sizeof(block));
+  return block;
 }
 
 FORCE_INLINE uint64_t getblock64 ( const uint64_t * p, int i )
 {
-  return p[i];
+  uint64_t block;
+  memcpy(&block, (const uint8_t *)p + (ptrdiff_t)i * (ptrdiff_t)sizeof(block), sizeof(block));
+  return block;
 }
 
 //-----------------------------------------------------------------------------
@@ -14,15 +14,31 @@ struct rt_type_index rt_types;
 struct rt_any rt_nil;
 
 
-DECL_HASH_TABLE(typemap, struct rt_symbol *, struct rt_type *)
-IMPL_HASH_TABLE(typemap, struct rt_symbol *, struct rt_type *, hashutil_ptr_hash, hashutil_ptr_equals)
+DECL_GROUP_HASH_TABLE(typemap, struct rt_symbol *, struct rt_type *)
+IMPL_GROUP_HASH_TABLE(typemap, struct rt_symbol *, struct rt_type *, rt_symbol_hash, hashutil_ptr_equals)
 
 /* TODO: add locking around typemap access if threading becomes a thing */
 static struct typemap typemap;
 
 
-DECL_HASH_TABLE(symtab, const char *, struct rt_symbol *)
-IMPL_HASH_TABLE(symtab, const char *, struct rt_symbol *, hashutil_str_hash, hashutil_str_equals)
+/* symbols are looked up by slices of the input, which are not NUL terminated.
+   the hash is computed once, by the caller, and kept in the symbol */
+struct symtab_key {
+    const char *data;
+    rt_size_t length;
+    u32 hash;
+};
+
+static u32 symtab_key_hash(struct symtab_key key) {
+    return key.hash;
+}
+
+static bool symtab_key_equals(struct symtab_key a, struct symtab_key b) {
+    return a.length == b.length && memcmp(a.data, b.data, a.length) == 0;
+}
+
+DECL_GROUP_HASH_TABLE(symtab, struct symtab_key, struct rt_symbol *)
+IMPL_GROUP_HASH_TABLE(symtab, struct symtab_key, struct rt_symbol *, symtab_key_hash, symtab_key_equals)
 
 /* TODO: add locking around symtab access if threading becomes a thing */
 static struct symtab symtab;
@@ -34,6 +50,9 @@ static struct symtab symtab;
     rt_types.VarName->flags = Flags; \
     typemap_put(&typemap, rt_symbols.VarName.u.symbol, rt_types.VarName);
 
+#define RT_INIT_SCALAR_INDEX(Type, VarName, ProperName, Kind, Flags) \
+    rt_types.scalars[RT_SCALAR_##VarName] = rt_types.VarName;
+
 #define RT_INIT_SYMBOL_SHORTCUT(VarName, ProperName) \
     rt_symbols.VarName = rt_get_symbol(#ProperName);
 
@@ -49,6 +68,7 @@ void rt_init(void) {
     rt_types.ptr_symbol = rt_gettype_ptr(rt_types.symbol);
 
     RT_FOREACH_SIMPLE_TYPE(RT_INIT_TYPE)
+    RT_FOREACH_SCALAR_TYPE(RT_INIT_SCALAR_INDEX)
     RT_FOREACH_SYMBOL_SHORTCUT(RT_INIT_SYMBOL_SHORTCUT)
 
     struct rt_struct_field cons_fields[2] = {
@@ -64,10 +84,10 @@ void rt_cleanup(void) {
 
     typemap_free(&typemap);
     
+    symtab_finish_resize(&symtab);
     for (u32 i = 0; i < symtab.size; ++i) {
-        struct symtab_entry *e = symtab.entries + i;
-        if (e->hash) {
-            free(e->value);
+        if (symtab_slot_used(&symtab, i)) {
+            free((char *)symtab.entries[i].value - RT_BOX_HEADER_SIZE);
         }
     }
     symtab_free(&symtab);
@@ -75,16 +95,62 @@ void rt_cleanup(void) {
 
 void rt_task_cleanup(struct rt_task *task) {
     if (task->current_module) {
-        rt_sourcemap_free(&task->current_module->location_before_car);
-        rt_sourcemap_free(&task->current_module->location_after_car);
+        rt_module_free_locations(task->current_module);
         rt_symbolmap_free(&task->current_module->symbolmap);
+        rt_vm_free_code(task->current_module);
+        rt_module_free_globals(task->current_module);
+        rt_arena_free(&task->current_module->ast_arena);
     }
-    free(task->weakptrs);
     rt_gc_free_all(task);
     *task = (struct rt_task) {0,};
 }
 
 
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+struct rt_arena_chunk {
+    struct rt_arena_chunk *next;
+};
+
+/* the chunk header is padded so the memory after it stays aligned */
+#define ARENA_CHUNK_HEADER ((sizeof(struct rt_arena_chunk) + ARENA_ALIGN - 1) & ~(rt_size_t)(ARENA_ALIGN - 1))
+
+void *rt_arena_alloc(struct rt_arena *arena, rt_size_t size) {
+    /* never NULL, even for nothing */
+    size = size ? size : 1;
+    size = (size + ARENA_ALIGN - 1) & ~(rt_size_t)(ARENA_ALIGN - 1);
+    if ((rt_size_t)(arena->end - arena->next) < size) {
+        /* big objects get a chunk of their own, leaving the current one in use */
+        rt_size_t chunk_size = size > ARENA_CHUNK_SIZE / 4 ? ARENA_CHUNK_HEADER + size : ARENA_CHUNK_SIZE;
+        struct rt_arena_chunk *chunk = malloc(chunk_size);
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        char *start = (char *)chunk + ARENA_CHUNK_HEADER;
+        if (chunk_size != ARENA_CHUNK_SIZE) {
+            memset(start, 0, size);
+            return start;
+        }
+        arena->next = start;
+        arena->end = (char *)chunk + chunk_size;
+    }
+    void *result = arena->next;
+    arena->next += size;
+    memset(result, 0, size);
+    return result;
+}
+
+void rt_arena_free(struct rt_arena *arena) {
+    struct rt_arena_chunk *chunk = arena->chunks;
+    while (chunk) {
+        struct rt_arena_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    *arena = (struct rt_arena) {0,};
+}
+
+
 struct rt_type *rt_lookup_simple_type(struct rt_any sym) {
     assert(rt_any_is_symbol(sym));
     struct rt_type *result;
@@ -121,21 +187,34 @@ struct rt_any rt_new_array(struct rt_task *task, rt_size_t length, struct rt_typ
 }
 
 struct rt_any rt_new_string(struct rt_task *task, const char *str) {
-    rt_size_t length = strlen(str);
+    return rt_new_string_n(task, str, strlen(str));
+}
+
+struct rt_any rt_new_string_n(struct rt_task *task, const char *str, rt_size_t length) {
     struct rt_string *string = rt_gc_alloc(task, sizeof(struct rt_string) + length + 1);
     string->length = length;
-    memcpy(string->data, str, length + 1);
+    memcpy(string->data, str, length);
+    string->data[length] = '\0';
     return rt_any_from_string(string);
 }
 
 struct rt_any rt_get_symbol(const char *str) {
+    return rt_get_symbol_n(str, strlen(str));
+}
+
+struct rt_any rt_get_symbol_n(const char *str, rt_size_t length) {
+    struct symtab_key key = { str, length, 0 };
+    MurmurHash3_x86_32(str, (int)length, 0, &key.hash);
     struct rt_symbol *sym;
-    if (!symtab_get(&symtab, str, &sym)) {
-        rt_size_t length = strlen(str);
-        sym = calloc(1, sizeof(struct rt_symbol) + length + 1);
+    if (!symtab_get(&symtab, key, &sym)) {
+        /* with room for a box header, as anys point to symbols */
+        sym = (struct rt_symbol *)((char *)calloc(1, RT_BOX_HEADER_SIZE + sizeof(struct rt_symbol) + length + 1) + RT_BOX_HEADER_SIZE);
         sym->length = length;
-        memcpy(sym->data, str, length + 1);
-        symtab_put(&symtab, (char *)sym->data, sym);
+        sym->hash = key.hash;
+        memcpy(sym->data, str, length);
+        /* the key points at the symbol's own copy of the name */
+        key.data = sym->data;
+        symtab_put(&symtab, key, sym);
     }
     return rt_any_from_symbol(sym);
 }
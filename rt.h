@@ -39,22 +39,30 @@ enum {
     RT_TYPE_FLAG_NEED_GC_MARK = 1 << 1,
 };
 
-#define RT_FOREACH_SCALAR_TYPE(X) \
+/* the 64-bit integers are kept apart, as their makers take the task. in the
+   compact representation, values too wide to be immediate are boxed */
+#define RT_FOREACH_IMMEDIATE_SCALAR_TYPE(X) \
     X(u8, u8, u8, RT_KIND_UNSIGNED, 0) \
     X(u16, u16, u16, RT_KIND_UNSIGNED, 0) \
     X(u32, u32, u32, RT_KIND_UNSIGNED, 0) \
-    X(u64, u64, u64, RT_KIND_UNSIGNED, 0) \
     \
     X(i8, i8, i8, RT_KIND_SIGNED, 0) \
     X(i16, i16, i16, RT_KIND_SIGNED, 0) \
     X(i32, i32, i32, RT_KIND_SIGNED, 0) \
-    X(i64, i64, i64, RT_KIND_SIGNED, 0) \
     \
     X(f32, f32, f32, RT_KIND_REAL, 0) \
     X(f64, f64, f64, RT_KIND_REAL, 0) \
     \
     X(bool, _bool, bool, RT_KIND_BOOL, 0)
 
+#define RT_FOREACH_WIDE_SCALAR_TYPE(X) \
+    X(u64, u64, u64, RT_KIND_UNSIGNED, 0) \
+    X(i64, i64, i64, RT_KIND_SIGNED, 0)
+
+#define RT_FOREACH_SCALAR_TYPE(X) \
+    RT_FOREACH_IMMEDIATE_SCALAR_TYPE(X) \
+    RT_FOREACH_WIDE_SCALAR_TYPE(X)
+
 #define RT_FOREACH_SIMPLE_TYPE(X) \
     X(struct rt_any, any, any, RT_KIND_ANY, RT_TYPE_FLAG_NEED_GC_MARK) \
     X(void *, nil, nil, RT_KIND_NIL, 0) \
@@ -72,10 +80,14 @@ struct rt_type {
        in that case in needs to be boxed. */
     rt_size_t size;
 
-    /* for chaining types in type tables */
-    struct rt_type *next;
+    /* for chaining all types, to be able to free them */
     struct rt_type *all_list_next;
 
+    /* for struct types the slots the GC has to scan, flattened through nested
+       structs and small arrays. for array types the slots of each element */
+    u32 gc_slot_count;
+    struct rt_gc_slot *gc_slots;
+
     union {
         struct {
             struct rt_type *target_type;
@@ -109,6 +121,12 @@ struct rt_struct_field {
     rt_size_t offset;
 };
 
+struct rt_gc_slot {
+    rt_size_t offset;
+    /* any, pointer, or an array too big to flatten */
+    struct rt_type *type;
+};
+
 struct rt_func_param {
     struct rt_type *type;
     struct rt_symbol *name;
@@ -118,37 +136,80 @@ struct rt_func_param {
 #define RT_DEF_SCALAR_ANY_MEMBER(Type, VarName, ProperName, Kind, Flags) \
     Type VarName;
 
-struct rt_any {
-    /* don't use directly as it can be NULL which should mean the type is rt_types.nil */
-    struct rt_type *_type;
+/* the value of an any, laid out as its type describes it */
+union rt_value {
+    uintptr_t data;
+
+    void *ptr;
+    struct rt_cons *cons;
+    struct rt_string *string;
+    struct rt_symbol *symbol;
+    struct rt_func *func;
+
+    RT_FOREACH_SCALAR_TYPE(RT_DEF_SCALAR_ANY_MEMBER)
+};
 
+#ifdef RT_COMPACT_ANY
+/* a single tagged word. the top 16 bits tell what the rest is:
+
+   0x0000       a pointer, or nil if all bits are 0. the type of what is
+                pointed to is kept in the word before it, see rt_box_type
+   0x0001       a weak pointer
+   0x0002-fff2  an f64, with 2^49 added to its bits. NaNs are made canonical
+   0xfffb       a pointer to a boxed u64 too wide to be immediate
+   0xfffc       a pointer to a boxed i64 too wide to be immediate
+   0xfffd       a scalar of at most 32 bits, whose index in
+                RT_FOREACH_SCALAR_TYPE is in bits 32-39
+   0xfffe       a u64 below 2^48
+   0xffff       an i64 which fits in 48 bits
+
+   pointers are stored as they are, so the pointer members of u can be read
+   directly for anything but weak pointers */
+struct rt_any {
     union {
         uintptr_t data;
-        
+
         void *ptr;
         struct rt_cons *cons;
         struct rt_string *string;
         struct rt_symbol *symbol;
         struct rt_func *func;
-        
-        RT_FOREACH_SCALAR_TYPE(RT_DEF_SCALAR_ANY_MEMBER)
     } u;
 };
 
-struct rt_box {
-    /* pointer used to chain all allocated boxes so the GC can run a sweep.
-       bit 0 is the GC mark bit, so the box pointers must be 2-byte aligned */
-    uintptr_t header;
-
-    /* the actual data for the boxed value will follow after the box header */
+#define RT_ANY_TAG_PTR 0x0000
+#define RT_ANY_TAG_WEAK 0x0001
+#define RT_ANY_TAG_MAX_F64 0xfff2
+#define RT_ANY_TAG_BOXED_U64 0xfffb
+#define RT_ANY_TAG_BOXED_I64 0xfffc
+#define RT_ANY_TAG_SMALL 0xfffd
+#define RT_ANY_TAG_U48 0xfffe
+#define RT_ANY_TAG_I48 0xffff
+
+#define RT_ANY_PAYLOAD_MASK (((uintptr_t)1 << 48) - 1)
+#define RT_ANY_F64_OFFSET ((uintptr_t)1 << 49)
+#define rt_any_tag(any) ((u32)((any).u.data >> 48))
+
+/* everything an any can point to starts with the pointer type of the any,
+   just before the pointer. GC boxes get room for it from rt_gc_alloc */
+#define RT_BOX_HEADER_SIZE sizeof(struct rt_type *)
+#define rt_box_type(ptr) (((struct rt_type **)(ptr))[-1])
+#else
+struct rt_any {
+    /* don't use directly as it can be NULL which should mean the type is rt_types.nil */
+    struct rt_type *_type;
+    union rt_value u;
 };
 
-struct rt_weakptr_entry {
-    void **ptr;
-    /* if ptr is in a struct rt_any then any_type will point to its type pointer,
-       so the type can be cleared when the pointer is */
-    struct rt_type **any_type;
-    struct rt_type *type;
+#define RT_BOX_HEADER_SIZE 0
+#endif
+
+#define RT_DEF_SCALAR_INDEX(Type, VarName, ProperName, Kind, Flags) \
+    RT_SCALAR_##VarName,
+
+enum rt_scalar_index {
+    RT_FOREACH_SCALAR_TYPE(RT_DEF_SCALAR_INDEX)
+    RT_SCALAR_COUNT
 };
 
 struct rt_task {
@@ -161,17 +222,30 @@ struct rt_task {
        from the roots array will be scanned */
     void **roots;
 
-    /* linked list of all allocated boxes. used for GC sweep phase. */
-    struct rt_box *boxes;
-
-    /* for keeping track of weak pointers encountered during GC mark phase */
-    u32 num_weakptrs;
-    u32 max_weakptrs;
-    struct rt_weakptr_entry *weakptrs;
+    /* pages backing rt_gc_alloc, with side bitmaps of allocated and marked boxes.
+       used for GC sweep phase. created on first allocation */
+    struct rt_gc_heap *heap;
 
+    /* if set, called with each box that is found to be unreachable, just before
+       its memory is given back to the allocator */
     void (*free_func)(void *userdata, void *ptr);
     void *free_func_userdata;
 
+    /* while an incremental collection is in progress, each rt_gc_alloc scans up to
+       this many boxes. 0 leaves all marking work to rt_gc_step */
+    u32 gc_alloc_step_budget;
+
+    /* if greater than 1, rt_gc_run marks using this many threads.
+       needs the runtime to be built with RT_GC_PARALLEL */
+    u32 gc_mark_threads;
+
+    /* if set, full collections leave the small pages to be swept by later
+       allocations instead of sweeping them before returning */
+    bool gc_lazy_sweep;
+
+    /* hash tables whose keys are held weakly. see rt_gc_add_weak_table */
+    struct rt_gc_weak_table *weak_tables;
+
     /* will be set when compiling a module */
     struct rt_module *current_module;
 };
@@ -185,6 +259,8 @@ struct rt_task {
     X(fn, fn) \
     X(_if, if) \
     X(_do, do) \
+    X(set, set) \
+    X(_while, while) \
     X(ascribe, :)
 
 #define RT_DEF_SYMBOL_SHORTCUT(VarName, ProperName) \
@@ -203,18 +279,10 @@ struct rt_symbol_index {
     struct rt_type *VarName;
 
 struct rt_type_index {
-    /* just to be able to free the all */
+    /* just to be able to free the all. lookup and "uniquification" is done
+       through a hash table in rt_gettype.c */
     struct rt_type *types_all;
 
-    /* for lookup and "uniquification" */
-    struct rt_type *types_simple;
-    struct rt_type *types_ptr;
-    struct rt_type *types_boxptr;
-    struct rt_type *types_weakptr;
-    struct rt_type *types_array;
-    struct rt_type *types_struct;
-    struct rt_type *types_func;
-
     /* type shorthands */
 
     RT_FOREACH_SIMPLE_TYPE(RT_DEF_TYPE_VAR)
@@ -227,6 +295,9 @@ struct rt_type_index {
     
     struct rt_type *symbol;
     struct rt_type *ptr_symbol;
+
+    /* the scalar types by enum rt_scalar_index */
+    struct rt_type *scalars[RT_SCALAR_COUNT];
 };
 
 /* global value indexes . TODO: protect with locks if threading becomes a thing */
@@ -257,49 +328,257 @@ f64 rt_any_to_f64(struct rt_any a);
 u64 rt_any_to_u64(struct rt_any a);
 i64 rt_any_to_i64(struct rt_any a);
 struct rt_any rt_weak_any(struct rt_any any);
-struct rt_any rt_any_to_signed(struct rt_any a);
-struct rt_any rt_any_to_unsigned(struct rt_any a);
+struct rt_any rt_any_to_signed(struct rt_task *task, struct rt_any a);
+struct rt_any rt_any_to_unsigned(struct rt_task *task, struct rt_any a);
 bool rt_any_equals(struct rt_any a, struct rt_any b);
 
+#ifdef RT_COMPACT_ANY
+#define rt_any_is_nil(any) (!(any).u.data)
+#define rt_any_is_i64(any) (rt_any_tag(any) == RT_ANY_TAG_I48 || rt_any_tag(any) == RT_ANY_TAG_BOXED_I64)
+#define rt_any_ptr(any) ((void *)((any).u.data & RT_ANY_PAYLOAD_MASK))
+#else
 #define rt_any_get_type(any) ((any)._type ? (any)._type : rt_types.nil)
 #define rt_any_is_nil(any) (!(any)._type || (any)._type == rt_types.nil)
-#define rt_any_is_bool(any) ((any)._type && (any)._type->kind == RT_KIND_BOOL)
-#define rt_any_is_unsigned(any) ((any)._type && (any)._type->kind == RT_KIND_UNSIGNED)
-#define rt_any_is_signed(any) ((any)._type && (any)._type->kind == RT_KIND_SIGNED)
-#define rt_any_is_real(any) ((any)._type && (any)._type->kind == RT_KIND_REAL)
-#define rt_any_is_func(any) ((any)._type && (any)._type->kind == RT_KIND_FUNC)
-#define rt_any_is_ptr(any) ((any)._type && (any)._type->kind == RT_KIND_PTR)
+#define rt_any_is_i64(any) ((any)._type == rt_types.i64)
+/* also for weak pointers */
+#define rt_any_ptr(any) ((any).u.ptr)
+/* the value as its type lays it out */
+#define rt_any_value(any) ((any).u)
+/* for values known to be i64s */
+#define rt_any_as_i64(any) ((any).u.i64)
+#endif
+#define rt_any_is_bool(any) (rt_any_get_type(any)->kind == RT_KIND_BOOL)
+#define rt_any_is_unsigned(any) (rt_any_get_type(any)->kind == RT_KIND_UNSIGNED)
+#define rt_any_is_signed(any) (rt_any_get_type(any)->kind == RT_KIND_SIGNED)
+#define rt_any_is_real(any) (rt_any_get_type(any)->kind == RT_KIND_REAL)
+/* functions are always referred to by pointer */
+#define rt_any_is_func(any) (rt_any_is_ptr(any) && rt_any_get_type(any)->u.ptr.target_type->kind == RT_KIND_FUNC)
+#define rt_any_func_type(any) (rt_any_get_type(any)->u.ptr.target_type)
+#define rt_any_is_ptr(any) (rt_any_get_type(any)->kind == RT_KIND_PTR)
 #define rt_any_is_cons(any) (rt_any_get_type(any) == rt_types.boxed_cons)
 #define rt_any_is_symbol(any) (rt_any_get_type(any) == rt_types.ptr_symbol)
 
+#ifndef RT_COMPACT_ANY
 #define rt_any_from_ptr(type, pointer) ((struct rt_any) { type, { .ptr = (pointer) } })
 #define rt_any_from_cons(Cons) ((struct rt_any) { rt_types.boxed_cons, { .cons = (Cons) } })
 #define rt_any_from_string(str) ((struct rt_any) { rt_types.boxed_string, { .string = (str) } })
 #define rt_any_from_symbol(sym) ((struct rt_any) { rt_types.ptr_symbol, { .symbol = (sym) } })
+#endif
 
-/* allocate a boxed chunk of memory which will be managed by the GC.
-   the box header precedes the location pointed to by the returned pointer */
+/* allocate a zeroed, boxed chunk of memory which will be managed by the GC.
+   the GC finds the page of a box by its address. boxes have no header,
+   except under RT_COMPACT_ANY, where RT_BOX_HEADER_SIZE bytes for the type
+   of the box come just before the pointer returned (see rt_box_type) */
 void *rt_gc_alloc(struct rt_task *task, rt_size_t size);
+/* full collection of the whole heap */
 void rt_gc_run(struct rt_task *task);
+/* collect only boxes allocated since the last collection */
+void rt_gc_run_minor(struct rt_task *task);
+/* do a slice of an incremental full collection, starting one if none is in progress.
+   at most budget boxes are scanned, unless the slice finishes the collection.
+   returns true when the collection is done */
+bool rt_gc_step(struct rt_task *task, u32 budget);
+/* record that a value has been stored into a slot of the given type inside a box
+   which already existed. use rt_gc_write_barrier or the setters below */
+void rt_gc_remember_slot(struct rt_task *task, void *slot, struct rt_type *slot_type);
+/* sweep the pages a lazily swept collection has left, calling free_func for the
+   remaining unreachable boxes */
+void rt_gc_finish_sweep(struct rt_task *task);
+/* the number of pages, small and large, the heap holds */
+u32 rt_gc_page_count(struct rt_task *task);
+
+/* a hash table whose keys are boxes held weakly: once a collection finds a key
+   unreachable its entry is removed, before the key's memory can be reused. the
+   values are ephemerons, only marked while their key is reachable, so a value
+   referring to its own key does not keep the entry alive. IMPL_GC_WEAK_TABLE
+   makes these for a DECL_HASH_TABLE table */
+struct rt_gc_weak_table {
+    struct rt_gc_weak_table *next;
+    void *table;
+    /* type of the values, or NULL if they hold nothing for the GC to mark */
+    struct rt_type *value_type;
+    /* calls fn with the key and the address of the value of each entry */
+    void (*each)(void *table, void (*fn)(void *ctx, void *key, void *value), void *ctx);
+    /* removes the entries whose keys rt_gc_is_live reports dead */
+    void (*prune)(void *table);
+};
+
+/* the table takes part in the task's collections until it is removed again */
+void rt_gc_add_weak_table(struct rt_task *task, struct rt_gc_weak_table *weak);
+void rt_gc_remove_weak_table(struct rt_task *task, struct rt_gc_weak_table *weak);
+/* whether a box survives the collection in progress. only meaningful while
+   weak tables are pruned, after all marking is done */
+bool rt_gc_is_live(void *box);
+
+#define DECL_GC_WEAK_TABLE(name)                                        \
+    uint32_t name##_prune(struct name *table);                          \
+    void name##_init_weak(struct name *table, struct rt_gc_weak_table *weak, struct rt_type *value_type);
+
+#define IMPL_GC_WEAK_TABLE(name)                                        \
+    static int name##_entry_is_dead(struct name##_entry *entry, void *userdata) { \
+        return !rt_gc_is_live(entry->key);                              \
+    }                                                                   \
+    uint32_t name##_prune(struct name *table) {                         \
+        return name##_remove_if(table, name##_entry_is_dead, NULL);     \
+    }                                                                   \
+    static void name##_gc_each(void *table, void (*fn)(void *ctx, void *key, void *value), void *ctx) { \
+        struct name *t = table;                                         \
+        name##_finish_resize(t);                                        \
+        for (uint32_t i = 0; i < t->size; ++i) {                        \
+            if (name##_slot_used(t, i)) {                               \
+                fn(ctx, t->entries[i].key, &t->entries[i].value);       \
+            }                                                           \
+        }                                                               \
+    }                                                                   \
+    static void name##_gc_prune(void *table) {                          \
+        name##_prune(table);                                            \
+    }                                                                   \
+    void name##_init_weak(struct name *table, struct rt_gc_weak_table *weak, struct rt_type *value_type) { \
+        *weak = (struct rt_gc_weak_table) { NULL, table, value_type, name##_gc_each, name##_gc_prune }; \
+    }
 
+/* map from any box to any value, with weak keys, for the runtime to hand out */
+DECL_HASH_TABLE(rt_weakmap, void *, struct rt_any)
+DECL_GC_WEAK_TABLE(rt_weakmap)
+
+/* read the first form of a string */
 struct rt_any rt_read(struct rt_task *task, const char *text);
 
 void rt_print(struct rt_any any);
 
 
+#ifdef RT_COMPACT_ANY
+static struct rt_type *rt_any_get_type(struct rt_any any) {
+    u32 tag = rt_any_tag(any);
+    if (tag == RT_ANY_TAG_PTR) {
+        return any.u.data ? rt_box_type(any.u.ptr) : rt_types.nil;
+    }
+    if (tag == RT_ANY_TAG_WEAK) {
+        return rt_gettype_weak(rt_box_type(rt_any_ptr(any)));
+    }
+    if (tag <= RT_ANY_TAG_MAX_F64) {
+        return rt_types.f64;
+    }
+    switch (tag) {
+    case RT_ANY_TAG_SMALL: return rt_types.scalars[(any.u.data >> 32) & 0xff];
+    case RT_ANY_TAG_U48:
+    case RT_ANY_TAG_BOXED_U64: return rt_types.u64;
+    default: return rt_types.i64;
+    }
+}
+
+static union rt_value rt_any_value(struct rt_any any) {
+    union rt_value value;
+    u32 tag = rt_any_tag(any);
+    if (tag == RT_ANY_TAG_PTR) {
+        value.data = any.u.data;
+    } else if (tag == RT_ANY_TAG_WEAK) {
+        value.data = any.u.data & RT_ANY_PAYLOAD_MASK;
+    } else if (tag <= RT_ANY_TAG_MAX_F64) {
+        value.data = any.u.data - RT_ANY_F64_OFFSET;
+    } else if (tag == RT_ANY_TAG_SMALL) {
+        /* the smaller members all start at the lowest byte */
+        value.data = (u32)any.u.data;
+    } else if (tag == RT_ANY_TAG_I48) {
+        value.i64 = (i64)(any.u.data << 16) >> 16;
+    } else if (tag == RT_ANY_TAG_U48) {
+        value.u64 = any.u.data & RT_ANY_PAYLOAD_MASK;
+    } else {
+        value.u64 = *(u64 *)rt_any_ptr(any);
+    }
+    return value;
+}
+
+static i64 rt_any_as_i64(struct rt_any any) {
+    if (rt_any_tag(any) == RT_ANY_TAG_I48) {
+        return (i64)(any.u.data << 16) >> 16;
+    }
+    return *(i64 *)rt_any_ptr(any);
+}
+
+static struct rt_any rt_any_from_ptr(struct rt_type *type, void *ptr) {
+    /* weak pointers are made by rt_weak_any */
+    assert(!(type->flags & RT_TYPE_FLAG_WEAK_PTR));
+    struct rt_any any;
+    any.u.ptr = ptr;
+    if (ptr) {
+        rt_box_type(ptr) = type;
+    }
+    return any;
+}
+
+#define rt_any_from_cons(Cons) rt_any_from_ptr(rt_types.boxed_cons, Cons)
+#define rt_any_from_string(str) rt_any_from_ptr(rt_types.boxed_string, str)
+#define rt_any_from_symbol(sym) rt_any_from_ptr(rt_types.ptr_symbol, sym)
+
+static struct rt_any rt_any_from_scalar(enum rt_scalar_index index, union rt_value value) {
+    struct rt_any any;
+    if (index == RT_SCALAR_f64) {
+        if (value.f64 != value.f64) {
+            value.data = (uintptr_t)0x7ff8 << 48;
+        }
+        any.u.data = value.data + RT_ANY_F64_OFFSET;
+    } else {
+        any.u.data = ((uintptr_t)RT_ANY_TAG_SMALL << 48) | ((uintptr_t)index << 32) | (u32)value.data;
+    }
+    return any;
+}
+
+#define RT_DEF_SCALAR_MAKER(Type, VarName, ProperName, Kind, Flags) \
+    static struct rt_any rt_new_##ProperName(Type value) { \
+        union rt_value v = { 0 }; \
+        v.VarName = value; \
+        return rt_any_from_scalar(RT_SCALAR_##VarName, v); \
+    }
+
+static struct rt_any rt_new_i64(struct rt_task *task, i64 value) {
+    struct rt_any any;
+    if ((i64)((u64)value << 16) >> 16 == value) {
+        any.u.data = ((uintptr_t)RT_ANY_TAG_I48 << 48) | ((uintptr_t)value & RT_ANY_PAYLOAD_MASK);
+    } else {
+        i64 *box = rt_gc_alloc(task, sizeof(i64));
+        *box = value;
+        any.u.data = ((uintptr_t)RT_ANY_TAG_BOXED_I64 << 48) | (uintptr_t)box;
+    }
+    return any;
+}
+
+static struct rt_any rt_new_u64(struct rt_task *task, u64 value) {
+    struct rt_any any;
+    if (value <= RT_ANY_PAYLOAD_MASK) {
+        any.u.data = ((uintptr_t)RT_ANY_TAG_U48 << 48) | (uintptr_t)value;
+    } else {
+        u64 *box = rt_gc_alloc(task, sizeof(u64));
+        *box = value;
+        any.u.data = ((uintptr_t)RT_ANY_TAG_BOXED_U64 << 48) | (uintptr_t)box;
+    }
+    return any;
+}
+#else
 #define RT_DEF_SCALAR_MAKER(Type, VarName, ProperName, Kind, Flags) \
     static struct rt_any rt_new_##ProperName(Type value) { \
         return (struct rt_any) { rt_types.VarName, { .VarName = value } }; \
     }
 
-RT_FOREACH_SCALAR_TYPE(RT_DEF_SCALAR_MAKER)
+#define RT_DEF_WIDE_SCALAR_MAKER(Type, VarName, ProperName, Kind, Flags) \
+    static struct rt_any rt_new_##ProperName(struct rt_task *task, Type value) { \
+        return (struct rt_any) { rt_types.VarName, { .VarName = value } }; \
+    }
+
+RT_FOREACH_WIDE_SCALAR_TYPE(RT_DEF_WIDE_SCALAR_MAKER)
+#endif
+
+RT_FOREACH_IMMEDIATE_SCALAR_TYPE(RT_DEF_SCALAR_MAKER)
 
 
 struct rt_type *rt_lookup_simple_type(struct rt_any sym);
 struct rt_any rt_new_cons(struct rt_task *task, struct rt_any car, struct rt_any cdr);
 struct rt_any rt_new_array(struct rt_task *task, rt_size_t length, struct rt_type *ptr_type);
 struct rt_any rt_new_string(struct rt_task *task, const char *str);
+/* from length characters at str, which need not be NUL terminated */
+struct rt_any rt_new_string_n(struct rt_task *task, const char *str, rt_size_t length);
 struct rt_any rt_get_symbol(const char *str);
+struct rt_any rt_get_symbol_n(const char *str, rt_size_t length);
 
 struct rt_cons {
     struct rt_any car;
@@ -313,20 +592,48 @@ struct rt_string {
 
 struct rt_symbol {
     rt_size_t length;
+    /* of the name, computed once when interned. as symbols are unique, it
+       also serves tables keyed by symbol pointers */
+    u32 hash;
     char data[];
 };
 
+#define rt_symbol_hash(sym) ((sym)->hash)
+
 #define rt_box_array_ref(ptr, type, index) (((type *)((char *)(ptr) + sizeof(rt_size_t)))[index])
 
 #define rt_car(any) (((any).u.cons)->car)
 #define rt_cdr(any) (((any).u.cons)->cdr)
 
+/* must follow every store of a value that may point to a box into an existing box,
+   so minor collections can find the pointers from old boxes to young ones.
+   stores into a box which was just allocated need no barrier */
+#define rt_gc_write_barrier(task, slot, slot_type) rt_gc_remember_slot((task), (slot), (slot_type))
+
+#define rt_set_car(task, Cons, value) \
+    do { rt_car(Cons) = (value); rt_gc_write_barrier((task), &rt_car(Cons), rt_types.any); } while (0)
+#define rt_set_cdr(task, Cons, value) \
+    do { rt_cdr(Cons) = (value); rt_gc_write_barrier((task), &rt_cdr(Cons), rt_types.any); } while (0)
+#define rt_box_array_set(task, ptr, type, index, value, elem_type) \
+    do { \
+        rt_box_array_ref(ptr, type, index) = (value); \
+        rt_gc_write_barrier((task), &rt_box_array_ref(ptr, type, index), (elem_type)); \
+    } while (0)
+
+
 
 
 
+typedef struct rt_any (*rt_native_func)(struct rt_task *task, struct rt_any *args);
 
 struct rt_func {
     struct rt_astnode *body_expr;
+    /* set instead of body_expr for functions implemented in C */
+    rt_native_func native;
+    /* body_expr compiled for the VM, on the first call through rt_vm_call */
+    struct rt_code *code;
+    /* body_expr flattened for the tree walker, on the first call through rt_ast_call */
+    struct rt_flat_body *flat;
 };
 
 struct rt_sourceloc {
@@ -334,18 +641,229 @@ struct rt_sourceloc {
     u32 col;
 };
 
-/* map from cons address to source location (of car element) */
-DECL_HASH_TABLE(rt_sourcemap, struct rt_cons *, struct rt_sourceloc)
+/* map from cons address to the offset of its car in the input read into a module.
+   the conses are held weakly, see rt_module_prune_locations */
+DECL_GROUP_HASH_TABLE(rt_sourcemap, struct rt_cons *, u32)
+DECL_GC_WEAK_TABLE(rt_sourcemap)
+
+/* the reader appends these in the order it allocates conses, which is cheaper
+   than hashing each as it is read. they are moved into the sourcemap when a
+   location is first looked up */
+struct rt_sourceoffset {
+    struct rt_cons *cons;
+    u32 offset;
+};
+
+DECL_GROUP_HASH_TABLE(rt_symbolmap, struct rt_symbol *, struct rt_astnode *)
 
-DECL_HASH_TABLE(rt_symbolmap, struct rt_symbol *, struct rt_astnode *)
+/* map from global name to its index in rt_module.globals */
+DECL_HASH_TABLE(rt_globalmap, struct rt_symbol *, u32)
+
+struct rt_global {
+    struct rt_any value;
+    struct rt_symbol *name;
+    /* false while only referred to, before the def form has been seen */
+    bool defined;
+    /* the value form of the def, kept while other globals are folded into its
+       code, so it can be parsed again when they are redefined. nil otherwise */
+    struct rt_any form;
+    /* indices of the globals whose code has this value folded in */
+    u32 dependent_count;
+    u32 dependent_capacity;
+    u32 *dependents;
+};
+
+/* a bump allocator, for many small objects which are all freed at once */
+struct rt_arena_chunk;
+struct rt_arena {
+    struct rt_arena_chunk *chunks;
+    char *next;
+    char *end;
+};
+
+/* returns zeroed memory, aligned for any of the runtime's types */
+void *rt_arena_alloc(struct rt_arena *arena, rt_size_t size);
+void rt_arena_free(struct rt_arena *arena);
 
 struct rt_module {
-    struct rt_sourcemap location_before_car;
-    struct rt_sourcemap location_after_car;
+    /* where the car of each cons read into the module starts, as a byte offset
+       into all the input read into it. see rt_module_find_location */
+    struct rt_sourcemap sourcemap;
+    u32 pending_offset_count;
+    u32 pending_offset_capacity;
+    struct rt_sourceoffset *pending_offsets;
+    /* the offsets at which the second and later lines start, in order. lines
+       are counted across all the input */
+    u32 line_count;
+    u32 line_capacity;
+    u32 *line_starts;
+    /* the length of all the input read so far, where the next one starts */
+    u32 source_length;
+
     struct rt_symbolmap symbolmap;
     struct rt_astnode *root_block;
+
+    /* global reads are resolved to an index in here when parsed. a def of
+       a name which is already defined replaces the value */
+    struct rt_globalmap globalmap;
+    u32 global_count;
+    u32 global_capacity;
+    struct rt_global *globals;
+
+    /* the values of all literals in the code of the module. the GC marks
+       these, as it does not trace into code. see rt_module_add_literal */
+    u32 literal_count;
+    u32 literal_capacity;
+    struct rt_any *literals;
+
+    /* all bytecode compiled for functions of the module */
+    struct rt_code *code_list;
+
+    /* owns the AST nodes of the module, with their expression and variable
+       arrays. functions keep pointing into it, so it lives as long as the module */
+    struct rt_arena ast_arena;
 };
 
+/* finds where runs of characters end, for the reader. each function returns
+   the length of the run at the start of the n characters at p. versions using
+   SIMD instructions are picked at run time, if the CPU has them */
+struct rt_space_run {
+    u32 newlines;
+    /* offset of the character after the last newline */
+    rt_size_t line_start;
+};
+
+struct rt_scanner {
+    const char *name;
+    /* space, tab, form feed, vertical tab and \n. \r is left for the caller,
+       which needs to look at the next character */
+    rt_size_t (*space)(const char *p, rt_size_t n, struct rt_space_run *run);
+    /* letters, digits and the other characters allowed in symbols */
+    rt_size_t (*symbol)(const char *p, rt_size_t n);
+    /* anything but a quote, a backslash, \r, \n or NUL */
+    rt_size_t (*string)(const char *p, rt_size_t n);
+    /* anything but \r, \n or NUL */
+    rt_size_t (*comment)(const char *p, rt_size_t n);
+};
+
+extern const struct rt_scanner rt_scanner_scalar;
+/* the fastest scanner the CPU supports */
+const struct rt_scanner *rt_get_scanner(void);
+
+/* reads forms from a string, a file or a pipe. regular files are mapped into
+   memory, anything else is read through a buffer which is refilled as the
+   reader gets to its end, so input of any size is read in bounded memory */
+struct rt_reader {
+    struct rt_task *task;
+    /* the locations of conses and the line starts are recorded in here, if
+       set. the init functions set it to the task's current module. clear it to
+       skip location tracking, for data which will not be parsed */
+    struct rt_module *mod;
+
+    /* the input read so far, or all of it */
+    const char *text;
+    rt_size_t pos;
+    rt_size_t len;
+    /* no more input after len */
+    bool at_end;
+
+    /* -1 when reading from memory */
+    int fd;
+    bool owns_fd;
+    char *buffer;
+    rt_size_t buffer_capacity;
+    void *map;
+    rt_size_t map_len;
+
+    const struct rt_scanner *scanner;
+    /* the offset in the whole input of text[0], which moves on refills */
+    rt_size_t base;
+    /* the current line, from 0, and the offset at which it starts. columns
+       are worked out from these when needed */
+    u32 line;
+    rt_size_t line_start;
+    /* strings with escapes and tokens split by a refill are put together
+       here. it grows as needed */
+    char *scratch;
+    rt_size_t scratch_capacity;
+};
+
+/* read from memory, which need not be NUL terminated */
+void rt_reader_init_string(struct rt_reader *reader, struct rt_task *task, const char *text, rt_size_t len);
+
+/* read from a file descriptor, which is mapped if it is a regular file */
+void rt_reader_init_fd(struct rt_reader *reader, struct rt_task *task, int fd);
+/* false if the file can not be opened */
+bool rt_reader_init_file(struct rt_reader *reader, struct rt_task *task, const char *path);
+/* reads the next top-level form. false at the end of the input */
+bool rt_reader_next(struct rt_reader *reader, struct rt_any *form_out);
+void rt_reader_close(struct rt_reader *reader);
+
+/* the offset of the car of a cons read into the module. false if the cons was
+   not read with location tracking */
+bool rt_module_find_location(struct rt_module *mod, struct rt_cons *cons, u32 *offset_out);
+/* the line and column of an offset, from the line starts */
+struct rt_sourceloc rt_module_sourceloc(struct rt_module *mod, u32 offset);
+/* drops the locations of conses which the collection in progress frees. called
+   by the GC for the current module of the task, as for rt_gc_weak_table.prune */
+void rt_module_prune_locations(struct rt_module *mod);
+void rt_module_free_locations(struct rt_module *mod);
+
+/* read all the top-level forms of a file or file descriptor into a list */
+bool rt_read_file(struct rt_task *task, const char *path, struct rt_any *forms_out);
+struct rt_any rt_read_fd(struct rt_task *task, int fd);
+
+/* parse the top-level forms of a module into task->current_module */
+struct rt_astnode *rt_parse_module(struct rt_task *task, struct rt_any toplevel_module_list);
+/* returns the index of a global in mod->globals, adding an undefined one if needed */
+u32 rt_module_global_index(struct rt_module *mod, struct rt_symbol *name);
+/* gets the value of a defined global */
+bool rt_module_get_global(struct rt_module *mod, struct rt_symbol *name, struct rt_any *value_out);
+/* records that the value of a global has been folded into the code of another */
+void rt_module_add_dependent(struct rt_module *mod, u32 index, u32 dependent_index);
+/* keeps the value of a literal made for code of the module alive for as long
+   as the module. the read forms the literal came from are not kept */
+void rt_module_add_literal(struct rt_module *mod, struct rt_any value);
+/* frees the globals and the literals */
+void rt_module_free_globals(struct rt_module *mod);
+
+/* call a function by walking the AST of its body. globals are looked up in
+   task->current_module */
+struct rt_any rt_ast_call(struct rt_task *task, struct rt_any func, u32 arg_count, struct rt_any *args);
+/* call a function on the bytecode VM, compiling functions as they are first called.
+   same semantics as rt_ast_call */
+struct rt_any rt_vm_call(struct rt_task *task, struct rt_any func, u32 arg_count, struct rt_any *args);
+void rt_vm_free_code(struct rt_module *mod);
+
+/* returns a function value for a primitive operation, or nil */
+struct rt_any rt_lookup_primop(struct rt_symbol *name);
+
+/* primops with a variant on two i64 values, which skips all type dispatch */
+enum rt_i64_op {
+    RT_I64_ADD,
+    RT_I64_SUB,
+    RT_I64_MUL,
+    RT_I64_LT,
+    RT_I64_LE,
+    RT_I64_EQ,
+};
+
+/* whether func is a primop. they have no side effects, and can be run at
+   parse time on numbers */
+bool rt_is_primop(struct rt_func *func);
+/* whether func is a primop with an i64 variant, and which */
+bool rt_primop_i64_op(struct rt_func *func, enum rt_i64_op *op_out);
+
+/* propagate types through a newly parsed AST, starting from literals and the
+   parameter types of functions, and specialize the nodes whose operand types
+   are proven. done by rt_parse_module */
+void rt_infer_types(struct rt_module *mod, struct rt_astnode *node);
+/* evaluate what can be at parse time in the bodies of the functions in a newly
+   parsed AST, so fewer nodes are visited when running them. def_indices holds
+   the global each expression of the top-level block is the value of. done by
+   rt_parse_module, before inference */
+void rt_fold_constants(struct rt_task *task, struct rt_astnode *node, u32 *def_indices);
+
 
 enum rt_astnode_type {
     RT_ASTNODE_LITERAL,
@@ -357,6 +875,8 @@ enum rt_astnode_type {
     RT_ASTNODE_COND,
     RT_ASTNODE_LOOP,
     RT_ASTNODE_CALL,
+    RT_ASTNODE_I64_OP,
+    RT_ASTNODE_CHECK_TYPE,
 };
 
 struct rt_scope_var {
@@ -386,6 +906,8 @@ struct rt_astnode {
 
         struct {
             struct rt_symbol *name;
+            /* index in rt_module.globals */
+            u32 index;
         } get_global;
 
         struct {
@@ -414,9 +936,75 @@ struct rt_astnode {
             struct rt_astnode *func_expr;
             struct rt_astnode **arg_exprs;
             u32 arg_count;
+            /* the callee and argument types are proven to match, so the
+               call needs no run time checks */
+            bool checked;
+            /* the value is returned by the function the call is in, so the
+               callee can reuse its frame */
+            bool tail;
         } call;
+
+        struct {
+            enum rt_i64_op op;
+            struct rt_astnode *lhs;
+            struct rt_astnode *rhs;
+        } i64_op;
+
+        /* fails at run time unless the value of expr is of the node's
+           result_type. made by inference where a declared type is not proven */
+        struct {
+            struct rt_astnode *expr;
+        } check_type;
     } u;
 };
 
 
+/* a function body as one array of nodes in post-order, so a node's children
+   come before it and the root is last. children are referred to by index.
+   the fields evaluation needs are kept apart from the rest.
+
+   the operands of each node type:
+       LITERAL     a: index in consts
+       SCOPE       a: variable count, b: expression
+       BLOCK       a: expression count, b: index of the first in extra
+       GET_GLOBAL  a: index in rt_module.globals
+       GET_LOCAL   a: stack index
+       SET_LOCAL   a: stack index, b: expression
+       COND        a: predicate, b: then, c: else
+       LOOP        a: predicate, b: body
+       CALL        a: function, b: argument count, c: index of the first in extra
+       I64_OP      a: left, b: right, op: the enum rt_i64_op */
+#define RT_FLAT_CALL_CHECKED 0x1
+#define RT_FLAT_CALL_TAIL 0x2
+
+struct rt_flat_node {
+    u8 node_type;
+    /* RT_FLAT_CALL_* for calls */
+    u8 flags;
+    u16 op;
+    u32 a, b, c;
+};
+
+struct rt_flat_cold {
+    struct rt_sourceloc sourceloc;
+    struct rt_type *result_type;
+};
+
+struct rt_flat_body {
+    u32 node_count;
+    struct rt_flat_node *nodes;
+    /* parallel to nodes */
+    struct rt_flat_cold *cold;
+
+    /* child lists of blocks and calls */
+    u32 extra_count;
+    u32 *extra;
+
+    u32 const_count;
+    struct rt_any *consts;
+};
+
+/* flatten the AST of a function body, allocating in the arena */
+struct rt_flat_body *rt_flatten(struct rt_arena *arena, struct rt_astnode *body);
+
 #endif
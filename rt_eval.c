@@ -7,19 +7,100 @@
 
 #include "hashtable.h"
 
-IMPL_HASH_TABLE(rt_symbolmap, struct rt_symbol *, struct rt_astnode *, hashutil_ptr_hash, hashutil_ptr_equals)
+IMPL_GROUP_HASH_TABLE(rt_symbolmap, struct rt_symbol *, struct rt_astnode *, rt_symbol_hash, hashutil_ptr_equals)
+IMPL_HASH_TABLE(rt_globalmap, struct rt_symbol *, u32, rt_symbol_hash, hashutil_ptr_equals)
 
 
+u32 rt_module_global_index(struct rt_module *mod, struct rt_symbol *name) {
+    u32 index;
+    if (rt_globalmap_get(&mod->globalmap, name, &index)) {
+        return index;
+    }
+    if (mod->global_count == mod->global_capacity) {
+        mod->global_capacity = mod->global_capacity ? mod->global_capacity * 2 : 16;
+        mod->globals = realloc(mod->globals, sizeof(struct rt_global) * mod->global_capacity);
+    }
+    index = mod->global_count++;
+    mod->globals[index].value = rt_nil;
+    mod->globals[index].name = name;
+    mod->globals[index].defined = false;
+    mod->globals[index].form = rt_nil;
+    mod->globals[index].dependent_count = 0;
+    mod->globals[index].dependent_capacity = 0;
+    mod->globals[index].dependents = NULL;
+    rt_globalmap_put(&mod->globalmap, name, index);
+    return index;
+}
+
+bool rt_module_get_global(struct rt_module *mod, struct rt_symbol *name, struct rt_any *value_out) {
+    u32 index;
+    if (!rt_globalmap_get(&mod->globalmap, name, &index) || !mod->globals[index].defined) {
+        return false;
+    }
+    *value_out = mod->globals[index].value;
+    return true;
+}
+
+void rt_module_add_dependent(struct rt_module *mod, u32 index, u32 dependent_index) {
+    struct rt_global *global = mod->globals + index;
+    for (u32 i = 0; i < global->dependent_count; ++i) {
+        if (global->dependents[i] == dependent_index) {
+            return;
+        }
+    }
+    if (global->dependent_count == global->dependent_capacity) {
+        global->dependent_capacity = global->dependent_capacity ? global->dependent_capacity * 2 : 4;
+        global->dependents = realloc(global->dependents, sizeof(u32) * global->dependent_capacity);
+    }
+    global->dependents[global->dependent_count++] = dependent_index;
+}
+
+void rt_module_add_literal(struct rt_module *mod, struct rt_any value) {
+    if (mod->literal_count == mod->literal_capacity) {
+        mod->literal_capacity = mod->literal_capacity ? mod->literal_capacity * 2 : 16;
+        mod->literals = realloc(mod->literals, sizeof(struct rt_any) * mod->literal_capacity);
+    }
+    mod->literals[mod->literal_count++] = value;
+}
+
+void rt_module_free_globals(struct rt_module *mod) {
+    for (u32 i = 0; i < mod->global_count; ++i) {
+        free(mod->globals[i].dependents);
+    }
+    rt_globalmap_free(&mod->globalmap);
+    free(mod->globals);
+    mod->globals = NULL;
+    mod->global_count = 0;
+    mod->global_capacity = 0;
+    free(mod->literals);
+    mod->literals = NULL;
+    mod->literal_count = 0;
+    mod->literal_capacity = 0;
+}
+
+
+#define STACK_SIZE 65536
+
 struct eval_state {
     struct rt_task *task;
     struct rt_module *mod;
 
-    struct rt_any stack[65536];
+    /* function bodies are walked in their flattened form, see rt_flatten.
+       locals are at stack[stack_top - stack_index]. call arguments are
+       evaluated into the slots from temp_top upwards */
+    struct rt_any stack[STACK_SIZE];
     u32 stack_top;
+    u32 temp_top;
+
+    /* set by a tail call, which leaves its arguments on top of the temps and
+       returns to rt_ast_eval_body to make the call in place of the current one */
+    bool tail_call;
+    struct rt_any tail_func;
 };
 
-static void eval_error(struct rt_astnode *node, const char *fmt, ...) {
-    printf("line %d, col %d: ", node->sourceloc.line + 1, node->sourceloc.col + 1);
+static void eval_error(struct rt_flat_body *body, u32 index, const char *fmt, ...) {
+    struct rt_sourceloc loc = body->cold[index].sourceloc;
+    printf("line %d, col %d: ", loc.line + 1, loc.col + 1);
     va_list args;
     va_start(args, fmt);
     vprintf(fmt, args);
@@ -28,94 +109,203 @@ static void eval_error(struct rt_astnode *node, const char *fmt, ...) {
     exit(1);
 }
 
-static struct rt_any rt_ast_eval_expr(struct eval_state *state, struct rt_astnode *node) {
+static struct rt_any rt_ast_eval_expr(struct eval_state *state, struct rt_flat_body *body, u32 index);
+
+/* the arguments are at stack[temp_top - arg_count] and up. they become the
+   variables of the outermost scope of the body. tail calls made by the body
+   are run here, reusing the same stack slots */
+static struct rt_any rt_ast_eval_body(struct eval_state *state, struct rt_any func, u32 arg_count) {
+    u32 base = state->temp_top - arg_count;
+    for (;;) {
+        struct rt_func *f = func.u.func;
+        if (f->native) {
+            struct rt_any result = f->native(state->task, state->stack + base);
+            state->temp_top = base;
+            return result;
+        }
+
+        if (!f->flat) {
+            f->flat = rt_flatten(&state->mod->ast_arena, f->body_expr);
+        }
+        struct rt_flat_body *body = f->flat;
+        u32 root = body->node_count - 1;
+        if (arg_count > 0) {
+            assert(body->nodes[root].node_type == RT_ASTNODE_SCOPE);
+            assert(body->nodes[root].a == arg_count);
+            root = body->nodes[root].b;
+        }
+
+        u32 saved_top = state->stack_top;
+        state->stack_top = state->temp_top;
+        struct rt_any result = rt_ast_eval_expr(state, body, root);
+        state->stack_top = saved_top;
+        if (!state->tail_call) {
+            state->temp_top = base;
+            return result;
+        }
+
+        state->tail_call = false;
+        func = state->tail_func;
+        arg_count = rt_any_func_type(func)->u.func.param_count;
+        memmove(state->stack + base, state->stack + state->temp_top - arg_count, sizeof(struct rt_any) * arg_count);
+        state->temp_top = base + arg_count;
+    }
+}
+
+static struct rt_any rt_ast_eval_expr(struct eval_state *state, struct rt_flat_body *body, u32 index) {
+    struct rt_flat_node *node = body->nodes + index;
     struct rt_any result = rt_nil;
-    switch (node->node_type) {
+    switch ((enum rt_astnode_type)node->node_type) {
     case RT_ASTNODE_LITERAL:
-        result = node->const_value;
+        result = body->consts[node->a];
         break;
-    case RT_ASTNODE_SCOPE:
-        state->stack_top += node->u.scope.var_count;
-        result = rt_ast_eval_expr(state, node->u.scope.expr);
-        state->stack_top -= node->u.scope.var_count;
+    case RT_ASTNODE_SCOPE: {
+        u32 var_count = node->a;
+        if (state->temp_top + var_count > STACK_SIZE) {
+            eval_error(body, index, "stack overflow");
+        }
+        u32 saved_top = state->stack_top;
+        for (u32 i = 0; i < var_count; ++i) {
+            state->stack[state->temp_top++] = rt_nil;
+        }
+        state->stack_top = state->temp_top;
+        result = rt_ast_eval_expr(state, body, node->b);
+        state->stack_top = saved_top;
+        state->temp_top -= var_count;
         break;
+    }
     case RT_ASTNODE_BLOCK:
-        for (u32 i = 0; i < node->u.block.expr_count; ++i) {
-            result = rt_ast_eval_expr(state, node->u.block.exprs[i]);
+        for (u32 i = 0; i < node->a; ++i) {
+            result = rt_ast_eval_expr(state, body, body->extra[node->b + i]);
         }
         break;
     case RT_ASTNODE_GET_GLOBAL: {
-        struct rt_astnode *temp;
-        if (!rt_symbolmap_get(&state->mod->symbolmap, node->u.get_global.name, &temp)) {
-            eval_error(node, "no toplevel item with name '%s' found", node->u.get_global.name);
+        struct rt_global *global = state->mod->globals + node->a;
+        if (!global->defined) {
+            eval_error(body, index, "no toplevel item with name '%s' found", global->name->data);
         }
-        result = temp->const_value;
+        result = global->value;
         break;
     }
     case RT_ASTNODE_GET_LOCAL:
-        result = state->stack[state->stack_top - node->u.get_local.stack_index];
+        result = state->stack[state->stack_top - node->a];
         break;
     case RT_ASTNODE_SET_LOCAL:
-        result = rt_ast_eval_expr(state, node->u.set_local.expr);
-        state->stack[state->stack_top - node->u.set_local.stack_index] = result;
+        result = rt_ast_eval_expr(state, body, node->b);
+        state->stack[state->stack_top - node->a] = result;
         break;
     case RT_ASTNODE_COND: {
-        struct rt_any pred_result = rt_ast_eval_expr(state, node->u.cond.pred_expr);
+        struct rt_any pred_result = rt_ast_eval_expr(state, body, node->a);
         if (!rt_any_is_bool(pred_result)) {
-            eval_error(node, "boolean value required for conditional predicate");
+            eval_error(body, index, "boolean value required for conditional predicate");
             break;
         }
         bool val = rt_any_to_bool(pred_result);
         if (!val) {
-            result = rt_ast_eval_expr(state, node->u.cond.else_expr);
+            result = rt_ast_eval_expr(state, body, node->c);
         } else {
-            result = rt_ast_eval_expr(state, node->u.cond.then_expr);
+            result = rt_ast_eval_expr(state, body, node->b);
         }
         break;
     }
     case RT_ASTNODE_LOOP: {
         for (;;) {
-            struct rt_any pred_result = rt_ast_eval_expr(state, node->u.loop.pred_expr);
+            struct rt_any pred_result = rt_ast_eval_expr(state, body, node->a);
             if (!rt_any_is_bool(pred_result)) {
-                eval_error(node, "boolean value required for loop predicate");
+                eval_error(body, index, "boolean value required for loop predicate");
                 break;
             }
             bool val = rt_any_to_bool(pred_result);
             if (!val) {
                 break;
             }
-            result = rt_ast_eval_expr(state, node->u.loop.body_expr);
+            result = rt_ast_eval_expr(state, body, node->b);
         }
+        break;
     }
     case RT_ASTNODE_CALL: {
-        struct rt_any func_result = rt_ast_eval_expr(state, node->u.call.func_expr);
-        if (!rt_any_is_func(func_result)) {
-            eval_error(node, "expected a function value");
-            break;
-        }
-
-        u32 arg_count = node->u.call.arg_count;
-        struct rt_astnode *body = func_result.u.func->body_expr;
-
-        assert(func_result._type->u.func.param_count == arg_count);
-        if (arg_count > 0) {
-            assert(body->node_type == RT_ASTNODE_SCOPE);
-            assert(body->u.scope.var_count == arg_count);
+        struct rt_any func_result = rt_ast_eval_expr(state, body, node->a);
+        u32 arg_count = node->b;
+        u32 *arg_exprs = body->extra + node->c;
+        if (state->temp_top + arg_count > STACK_SIZE) {
+            eval_error(body, index, "stack overflow");
         }
-
-        u32 top = state->stack_top;
-        for (u32 i = 0; i < arg_count; ++i) {
-            struct rt_func_param *param = func_result._type->u.func.params + i;
-            struct rt_any arg_result = rt_ast_eval_expr(state, node->u.call.arg_exprs[i]);
-            if (rt_any_get_type(arg_result) != param->type) {
-                eval_error(node, "type mismatch");
+        if (node->flags & RT_FLAT_CALL_CHECKED) {
+            for (u32 i = 0; i < arg_count; ++i) {
+                struct rt_any arg_result = rt_ast_eval_expr(state, body, arg_exprs[i]);
+                state->stack[state->temp_top++] = arg_result;
+            }
+        } else {
+            if (!rt_any_is_func(func_result)) {
+                eval_error(body, index, "expected a function value");
                 break;
             }
-            state->stack[top++] = arg_result;
+            struct rt_type *func_type = rt_any_func_type(func_result);
+            if (func_type->u.func.param_count != arg_count) {
+                eval_error(body, index, "expected %u arguments, got %u", func_type->u.func.param_count, arg_count);
+            }
+
+            for (u32 i = 0; i < arg_count; ++i) {
+                struct rt_func_param *param = func_type->u.func.params + i;
+                struct rt_any arg_result = rt_ast_eval_expr(state, body, arg_exprs[i]);
+                if (param->type != rt_types.any && rt_any_get_type(arg_result) != param->type) {
+                    eval_error(body, index, "type mismatch");
+                    break;
+                }
+                state->stack[state->temp_top++] = arg_result;
+            }
         }
 
-        result = rt_ast_eval_expr(state, body);
+        if (node->flags & RT_FLAT_CALL_TAIL) {
+            /* nothing is evaluated on the way back out to rt_ast_eval_body */
+            state->tail_call = true;
+            state->tail_func = func_result;
+            break;
+        }
+        result = rt_ast_eval_body(state, func_result, arg_count);
+        break;
+    }
+    case RT_ASTNODE_I64_OP: {
+        /* both operands are proven to be i64 */
+        i64 a = rt_any_as_i64(rt_ast_eval_expr(state, body, node->a));
+        i64 b = rt_any_as_i64(rt_ast_eval_expr(state, body, node->b));
+        switch ((enum rt_i64_op)node->op) {
+        case RT_I64_ADD: result = rt_new_i64(state->task, (i64)((u64)a + (u64)b)); break;
+        case RT_I64_SUB: result = rt_new_i64(state->task, (i64)((u64)a - (u64)b)); break;
+        case RT_I64_MUL: result = rt_new_i64(state->task, (i64)((u64)a * (u64)b)); break;
+        case RT_I64_LT: result = rt_new_bool(a < b); break;
+        case RT_I64_LE: result = rt_new_bool(a <= b); break;
+        case RT_I64_EQ: result = rt_new_bool(a == b); break;
+        }
+        break;
     }
+    case RT_ASTNODE_CHECK_TYPE: {
+        result = rt_ast_eval_expr(state, body, node->a);
+        struct rt_type *type = body->cold[index].result_type;
+        if (rt_any_get_type(result) != type) {
+            eval_error(body, index, "expected a %s, got a %s", type->desc, rt_any_get_type(result)->desc);
+        }
+        break;
     }
+    }
+    return result;
+}
+
+struct rt_any rt_ast_call(struct rt_task *task, struct rt_any func, u32 arg_count, struct rt_any *args) {
+    assert(rt_any_is_func(func));
+    assert(rt_any_func_type(func)->u.func.param_count == arg_count);
+
+    struct eval_state *state = malloc(sizeof(struct eval_state));
+    state->task = task;
+    state->mod = task->current_module;
+    state->stack_top = 0;
+    state->temp_top = arg_count;
+    state->tail_call = false;
+    if (arg_count) {
+        memcpy(state->stack, args, sizeof(struct rt_any) * arg_count);
+    }
+
+    struct rt_any result = rt_ast_eval_body(state, func, arg_count);
+    free(state);
     return result;
 }
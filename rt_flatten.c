@@ -0,0 +1,152 @@
+#include "rt.h"
+
+/* flattening is done in two passes: one counting what is needed, so all the
+   arrays can be allocated at their final size, and one filling them in */
+
+struct flatten_state {
+    struct rt_flat_body *body;
+    u32 node_count;
+    u32 extra_count;
+    u32 const_count;
+};
+
+static void count_expr(struct flatten_state *state, struct rt_astnode *node) {
+    ++state->node_count;
+    switch (node->node_type) {
+    case RT_ASTNODE_LITERAL:
+        ++state->const_count;
+        break;
+    case RT_ASTNODE_SCOPE:
+        count_expr(state, node->u.scope.expr);
+        break;
+    case RT_ASTNODE_BLOCK:
+        state->extra_count += node->u.block.expr_count;
+        for (u32 i = 0; i < node->u.block.expr_count; ++i) {
+            count_expr(state, node->u.block.exprs[i]);
+        }
+        break;
+    case RT_ASTNODE_GET_GLOBAL:
+    case RT_ASTNODE_GET_LOCAL:
+        break;
+    case RT_ASTNODE_SET_LOCAL:
+        count_expr(state, node->u.set_local.expr);
+        break;
+    case RT_ASTNODE_COND:
+        count_expr(state, node->u.cond.pred_expr);
+        count_expr(state, node->u.cond.then_expr);
+        count_expr(state, node->u.cond.else_expr);
+        break;
+    case RT_ASTNODE_LOOP:
+        count_expr(state, node->u.loop.pred_expr);
+        count_expr(state, node->u.loop.body_expr);
+        break;
+    case RT_ASTNODE_CALL:
+        state->extra_count += node->u.call.arg_count;
+        count_expr(state, node->u.call.func_expr);
+        for (u32 i = 0; i < node->u.call.arg_count; ++i) {
+            count_expr(state, node->u.call.arg_exprs[i]);
+        }
+        break;
+    case RT_ASTNODE_I64_OP:
+        count_expr(state, node->u.i64_op.lhs);
+        count_expr(state, node->u.i64_op.rhs);
+        break;
+    case RT_ASTNODE_CHECK_TYPE:
+        count_expr(state, node->u.check_type.expr);
+        break;
+    }
+}
+
+/* the extra slots of a node are taken before its children are flattened, as
+   they may need extra slots of their own */
+static u32 take_extra(struct flatten_state *state, u32 count) {
+    u32 first = state->extra_count;
+    state->extra_count += count;
+    return first;
+}
+
+static u32 flatten_expr(struct flatten_state *state, struct rt_astnode *node) {
+    struct rt_flat_body *body = state->body;
+    struct rt_flat_node flat = { (u8)node->node_type, 0, 0, 0, 0, 0 };
+    switch (node->node_type) {
+    case RT_ASTNODE_LITERAL:
+        flat.a = state->const_count++;
+        body->consts[flat.a] = node->const_value;
+        break;
+    case RT_ASTNODE_SCOPE:
+        flat.a = node->u.scope.var_count;
+        flat.b = flatten_expr(state, node->u.scope.expr);
+        break;
+    case RT_ASTNODE_BLOCK:
+        flat.a = node->u.block.expr_count;
+        flat.b = take_extra(state, flat.a);
+        for (u32 i = 0; i < flat.a; ++i) {
+            body->extra[flat.b + i] = flatten_expr(state, node->u.block.exprs[i]);
+        }
+        break;
+    case RT_ASTNODE_GET_GLOBAL:
+        flat.a = node->u.get_global.index;
+        break;
+    case RT_ASTNODE_GET_LOCAL:
+        flat.a = node->u.get_local.stack_index;
+        break;
+    case RT_ASTNODE_SET_LOCAL:
+        flat.a = node->u.set_local.stack_index;
+        flat.b = flatten_expr(state, node->u.set_local.expr);
+        break;
+    case RT_ASTNODE_COND:
+        flat.a = flatten_expr(state, node->u.cond.pred_expr);
+        flat.b = flatten_expr(state, node->u.cond.then_expr);
+        flat.c = flatten_expr(state, node->u.cond.else_expr);
+        break;
+    case RT_ASTNODE_LOOP:
+        flat.a = flatten_expr(state, node->u.loop.pred_expr);
+        flat.b = flatten_expr(state, node->u.loop.body_expr);
+        break;
+    case RT_ASTNODE_CALL:
+        flat.flags = (node->u.call.checked ? RT_FLAT_CALL_CHECKED : 0) | (node->u.call.tail ? RT_FLAT_CALL_TAIL : 0);
+        flat.a = flatten_expr(state, node->u.call.func_expr);
+        flat.b = node->u.call.arg_count;
+        flat.c = take_extra(state, flat.b);
+        for (u32 i = 0; i < flat.b; ++i) {
+            body->extra[flat.c + i] = flatten_expr(state, node->u.call.arg_exprs[i]);
+        }
+        break;
+    case RT_ASTNODE_I64_OP:
+        flat.op = (u16)node->u.i64_op.op;
+        flat.a = flatten_expr(state, node->u.i64_op.lhs);
+        flat.b = flatten_expr(state, node->u.i64_op.rhs);
+        break;
+    case RT_ASTNODE_CHECK_TYPE:
+        flat.a = flatten_expr(state, node->u.check_type.expr);
+        break;
+    }
+
+    u32 index = state->node_count++;
+    body->nodes[index] = flat;
+    body->cold[index].sourceloc = node->sourceloc;
+    body->cold[index].result_type = node->result_type;
+    return index;
+}
+
+struct rt_flat_body *rt_flatten(struct rt_arena *arena, struct rt_astnode *expr) {
+    struct flatten_state state = {0,};
+    count_expr(&state, expr);
+
+    struct rt_flat_body *body = rt_arena_alloc(arena, sizeof(struct rt_flat_body));
+    body->node_count = state.node_count;
+    body->nodes = rt_arena_alloc(arena, sizeof(struct rt_flat_node) * state.node_count);
+    body->cold = rt_arena_alloc(arena, sizeof(struct rt_flat_cold) * state.node_count);
+    body->extra_count = state.extra_count;
+    body->extra = rt_arena_alloc(arena, sizeof(u32) * state.extra_count);
+    body->const_count = state.const_count;
+    body->consts = rt_arena_alloc(arena, sizeof(struct rt_any) * state.const_count);
+
+    state.body = body;
+    state.node_count = 0;
+    state.extra_count = 0;
+    state.const_count = 0;
+    flatten_expr(&state, expr);
+    assert(state.node_count == body->node_count && state.extra_count == body->extra_count);
+    return body;
+}
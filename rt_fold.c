@@ -0,0 +1,162 @@
+#include "rt.h"
+
+/* constant folding over function bodies. each fold returns the node to use in
+   place of the one given, which is either that node, changed in place into a
+   literal, or one of its children.
+
+   the values of defined globals which are not functions are inlined. each such
+   global records the def its value went into, and keeps the form of that def,
+   so rt_parse_module can parse and fold it again when the global is redefined.
+   functions stay global reads, so they can be redefined without that */
+
+struct fold_state {
+    struct rt_task *task;
+    struct rt_module *mod;
+    /* the global whose def is being folded */
+    u32 def_index;
+    bool inlined;
+};
+
+static struct rt_astnode *fold_expr(struct fold_state *state, struct rt_astnode *node);
+
+static void make_literal(struct fold_state *state, struct rt_astnode *node, struct rt_any value) {
+    node->node_type = RT_ASTNODE_LITERAL;
+    node->result_type = rt_any_get_type(value);
+    node->is_const = true;
+    node->const_value = value;
+    rt_module_add_literal(state->mod, value);
+}
+
+static bool is_const_number(struct rt_astnode *node) {
+    return node->is_const && (rt_any_is_signed(node->const_value) || rt_any_is_unsigned(node->const_value) ||
+                              rt_any_is_real(node->const_value));
+}
+
+/* whether dropping an expression, when its value is not used, changes nothing */
+static bool is_pure(struct rt_astnode *node) {
+    return node->is_const || node->node_type == RT_ASTNODE_GET_LOCAL;
+}
+
+static void fold_func(struct fold_state *state, struct rt_func *func) {
+    if (!func->native) {
+        func->body_expr = fold_expr(state, func->body_expr);
+    }
+}
+
+static struct rt_astnode *fold_block(struct fold_state *state, struct rt_astnode *node) {
+    u32 expr_count = node->u.block.expr_count;
+    u32 kept = 0;
+    for (u32 i = 0; i < expr_count; ++i) {
+        struct rt_astnode *expr = fold_expr(state, node->u.block.exprs[i]);
+        if (i + 1 < expr_count && is_pure(expr)) {
+            continue;
+        }
+        node->u.block.exprs[kept++] = expr;
+    }
+    node->u.block.expr_count = kept;
+    if (kept == 1) {
+        return node->u.block.exprs[0];
+    }
+    return node;
+}
+
+/* primops on numbers are run now */
+static struct rt_astnode *fold_call(struct fold_state *state, struct rt_astnode *node) {
+    struct rt_astnode *func_expr = fold_expr(state, node->u.call.func_expr);
+    u32 arg_count = node->u.call.arg_count;
+    bool all_numbers = true;
+    node->u.call.func_expr = func_expr;
+    for (u32 i = 0; i < arg_count; ++i) {
+        node->u.call.arg_exprs[i] = fold_expr(state, node->u.call.arg_exprs[i]);
+        all_numbers &= is_const_number(node->u.call.arg_exprs[i]);
+    }
+
+    if (!all_numbers || !func_expr->is_const || !rt_any_is_func(func_expr->const_value) ||
+        !rt_is_primop(func_expr->const_value.u.func) ||
+        rt_any_func_type(func_expr->const_value)->u.func.param_count != arg_count) {
+        return node;
+    }
+    struct rt_any args[2];
+    assert(arg_count <= 2);
+    for (u32 i = 0; i < arg_count; ++i) {
+        args[i] = node->u.call.arg_exprs[i]->const_value;
+    }
+    /* primops only use the task to box wide integers */
+    struct rt_any result = func_expr->const_value.u.func->native(state->task, args);
+    make_literal(state, node, result);
+    return node;
+}
+
+static struct rt_astnode *fold_expr(struct fold_state *state, struct rt_astnode *node) {
+    switch (node->node_type) {
+    case RT_ASTNODE_LITERAL:
+        if (rt_any_is_func(node->const_value)) {
+            fold_func(state, node->const_value.u.func);
+        }
+        break;
+    case RT_ASTNODE_SCOPE:
+        /* kept even when the expression is constant, as it holds the parameters */
+        node->u.scope.expr = fold_expr(state, node->u.scope.expr);
+        break;
+    case RT_ASTNODE_BLOCK:
+        return fold_block(state, node);
+    case RT_ASTNODE_GET_GLOBAL: {
+        struct rt_global *global = state->mod->globals + node->u.get_global.index;
+        if (global->defined && !rt_any_is_func(global->value)) {
+            rt_module_add_dependent(state->mod, node->u.get_global.index, state->def_index);
+            state->inlined = true;
+            make_literal(state, node, global->value);
+        }
+        break;
+    }
+    case RT_ASTNODE_GET_LOCAL:
+        break;
+    case RT_ASTNODE_SET_LOCAL:
+        node->u.set_local.expr = fold_expr(state, node->u.set_local.expr);
+        break;
+    case RT_ASTNODE_COND: {
+        struct rt_astnode *pred_expr = fold_expr(state, node->u.cond.pred_expr);
+        node->u.cond.pred_expr = pred_expr;
+        node->u.cond.then_expr = fold_expr(state, node->u.cond.then_expr);
+        node->u.cond.else_expr = fold_expr(state, node->u.cond.else_expr);
+        /* anything but a bool is left for the error at run time */
+        if (pred_expr->is_const && rt_any_is_bool(pred_expr->const_value)) {
+            return rt_any_to_bool(pred_expr->const_value) ? node->u.cond.then_expr : node->u.cond.else_expr;
+        }
+        break;
+    }
+    case RT_ASTNODE_LOOP: {
+        struct rt_astnode *pred_expr = fold_expr(state, node->u.loop.pred_expr);
+        node->u.loop.pred_expr = pred_expr;
+        node->u.loop.body_expr = fold_expr(state, node->u.loop.body_expr);
+        if (pred_expr->is_const && rt_any_is_bool(pred_expr->const_value) && !rt_any_to_bool(pred_expr->const_value)) {
+            make_literal(state, node, rt_nil);
+        }
+        break;
+    }
+    case RT_ASTNODE_CALL:
+        return fold_call(state, node);
+    case RT_ASTNODE_I64_OP:
+    case RT_ASTNODE_CHECK_TYPE:
+        /* made by inference, which runs after this */
+        break;
+    }
+    return node;
+}
+
+void rt_fold_constants(struct rt_task *task, struct rt_astnode *node, u32 *def_indices) {
+    /* the top-level block is left as it is, as it holds the defs */
+    assert(node->node_type == RT_ASTNODE_BLOCK);
+    struct fold_state state = { task, task->current_module, 0, false };
+    for (u32 i = 0; i < node->u.block.expr_count; ++i) {
+        state.def_index = def_indices[i];
+        state.inlined = false;
+        fold_expr(&state, node->u.block.exprs[i]);
+        /* the form is only needed to fold the def again. a def replaced by a
+           later one of the same load leaves it to that one */
+        struct rt_global *global = state.mod->globals + state.def_index;
+        if (!state.inlined && rt_any_equals(node->u.block.exprs[i]->const_value, global->value)) {
+            global->form = rt_nil;
+        }
+    }
+}
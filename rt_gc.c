@@ -2,55 +2,462 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
-#define rt_boxheader_get_next(h) ((struct rt_box *)((h) & ~(uintptr_t)1))
-#define rt_boxheader_set_next(h, next) do { (h) = (uintptr_t)(next) | ((h) & (uintptr_t)1); } while(0)
-#define rt_boxheader_is_marked(h) ((h) & 1)
-#define rt_boxheader_set_mark(h) do { (h) |= 1; } while(0)
-#define rt_boxheader_clear_mark(h) do { (h) &= ~(uintptr_t)1; } while(0)
+#ifdef RT_GC_PARALLEL
+#include <pthread.h>
+#include <sched.h>
+#endif
 
-void *rt_gc_alloc(struct rt_task *task, rt_size_t size) {
-    struct rt_box *box = (struct rt_box *)calloc(1, sizeof(struct rt_box) + size);
-    rt_boxheader_set_next(box->header, task->boxes);
-    task->boxes = box;
-    return box + 1;
+IMPL_HASH_TABLE(rt_weakmap, void *, struct rt_any, hashutil_ptr_hash, hashutil_ptr_equals)
+IMPL_GC_WEAK_TABLE(rt_weakmap)
+
+/* boxes are carved out of pages which are aligned to their size, so the page owning
+   a box can be found by masking the box address. each small page only holds boxes of
+   a single size class, and boxes larger than the biggest size class get a page of
+   their own. boxes have no header: the mark and allocation bits of a box are kept
+   in bitmaps in the page header, indexed by the position of the box in the page.
+
+   the heap is generational using sticky mark bits: mark bits are left set after a
+   collection, so a marked box is an old one, and boxes allocated since the last
+   collection (the nursery) are the allocated but unmarked ones. a minor collection
+   marks from the roots and the remembered set without clearing marks, so tracing
+   stops at old boxes, and only sweeps the pages allocated into since the last
+   collection. a major collection clears all marks first and sweeps everything.
+
+   a major collection can also be done incrementally with rt_gc_step. marking then
+   proceeds in bounded slices between which the mutator runs. boxes allocated while
+   marking start out white. the write barrier records every store into an existing
+   box, so when the mark stack runs dry the cycle is finished by rescanning the
+   roots and the recorded slots, which finds anything the mutator has moved behind
+   the marker's back, before weak pointers are cleared and the heap is swept.
+
+   with task->gc_lazy_sweep set, a major collection only sweeps the large pages.
+   small pages are queued on their size class instead, and each is swept (calling
+   free_func for its dead boxes) when the allocator next needs a page of that class.
+   whatever is left is swept before the next collection starts.
+
+   when built with RT_GC_PARALLEL and task->gc_mark_threads > 1, rt_gc_run marks on
+   a pool of threads. mark bits are then set atomically, every thread has its own
+   mark stack, and a thread with plenty of work moves some of it to a locked shared
+   stack, from which threads that have run out of work steal. once all marking is
+   done (weak tables are then marked through on the calling thread), the pool is
+   started again, and every thread clears the weak pointers it found.
+
+   weak tables (see struct rt_gc_weak_table) are not traced from. once the mark
+   stack has run dry, the values of entries whose keys are marked are marked in
+   turn, until no more keys are found. entries whose keys are still unmarked are
+   then removed, before the sweep frees the keys. */
+#define RT_GC_PAGE_SIZE ((uintptr_t)64 * 1024)
+#define RT_GC_MAX_SMALL_SIZE 2048
+#define RT_GC_MIN_BOX_SIZE 16
+#define RT_GC_BITMAP_WORDS (RT_GC_PAGE_SIZE / RT_GC_MIN_BOX_SIZE / 64)
+
+static const u32 rt_gc_size_classes[] = {
+    16, 24, 32, 40, 48, 64, 80, 96, 128, 160, 192, 256, 320, 384, 512, 640, 768, 1024, 1536, 2048
+};
+
+#define RT_GC_SIZE_CLASS_COUNT (sizeof(rt_gc_size_classes) / sizeof(rt_gc_size_classes[0]))
+#define RT_GC_LARGE_CLASS RT_GC_SIZE_CLASS_COUNT
+
+/* maps (size + 7) / 8 to the index of the smallest size class which fits */
+static u8 rt_gc_size_class_lookup[RT_GC_MAX_SMALL_SIZE / 8 + 1];
+
+struct rt_gc_page {
+    /* chains all pages of the heap (small or large) */
+    struct rt_gc_page *next;
+    /* chains the pages of a size class which have free slots */
+    struct rt_gc_page *next_partial;
+    /* chains the small pages allocated into since the last collection */
+    struct rt_gc_page *next_young;
+
+    /* set if boxes have been allocated in this page since the last collection */
+    bool young;
+    /* set when rt_gc_finish_sweep has found the page empty, until it is freed */
+    bool empty;
+
+    u32 size_class;
+    u32 box_size;
+    u32 box_count;
+    u32 word_count;
+
+    /* box index is (offset * box_size_recip) >> 32, which is exact for the offsets
+       of box starts within a page. 0 for large pages, where the box index is 0 */
+    u64 box_size_recip;
+
+    char *boxes;
+
+    /* bit set for each slot holding a box */
+    u64 *alloc_bits;
+    /* bit set for each box found reachable by the last GC (or the current one, while marking) */
+    u64 *mark_bits;
+    u64 bits[];
+};
+
+#define RT_GC_SMALL_PAGE_HEADER_SIZE \
+    ((sizeof(struct rt_gc_page) + sizeof(u64) * 2 * RT_GC_BITMAP_WORDS + 15) & ~(uintptr_t)15)
+#define RT_GC_LARGE_PAGE_HEADER_SIZE \
+    ((sizeof(struct rt_gc_page) + sizeof(u64) * 2 + 15) & ~(uintptr_t)15)
+
+#define rt_gc_page_of(ptr) ((struct rt_gc_page *)((uintptr_t)(ptr) & ~(RT_GC_PAGE_SIZE - 1)))
+/* pointers to boxes point past their header, see RT_BOX_HEADER_SIZE */
+#define rt_gc_page_index(page, ptr) ((u32)(((u64)((char *)(ptr) - RT_BOX_HEADER_SIZE - (page)->boxes) * (page)->box_size_recip) >> 32))
+#define rt_gc_page_box(page, index) ((page)->boxes + (rt_size_t)(index) * (page)->box_size)
+
+/* mask of the bits in a bitmap word which correspond to actual slots in the page */
+#define rt_gc_page_word_mask(page, word) \
+    ((word) + 1 < (page)->word_count || !((page)->box_count & 63) ? ~(u64)0 : (((u64)1 << ((page)->box_count & 63)) - 1))
+
+struct rt_gc_size_class {
+    /* page currently allocated from, and the bitmap word to continue searching at */
+    struct rt_gc_page *current;
+    u32 current_word;
+
+    /* other pages of this size class which have free slots */
+    struct rt_gc_page *partial;
+    /* pages still holding the dead boxes of the last major collection, chained with
+       next_partial. see rt_gc_finish_sweep */
+    struct rt_gc_page *unswept;
+};
+
+struct rt_gc_mark_entry {
+    char *ptr;
+    struct rt_type *type;
+};
+
+struct rt_gc_mark_stack {
+    u32 count;
+    u32 capacity;
+    struct rt_gc_mark_entry *entries;
+};
+
+struct rt_weakptr_entry {
+    void **ptr;
+#ifdef RT_COMPACT_ANY
+    /* if ptr is in a struct rt_any then any_data is the tagged word found there,
+       so the slot is only cleared if it still holds it */
+    uintptr_t any_data;
+#else
+    /* if ptr is in a struct rt_any then any_type will point to its type pointer,
+       so the type can be cleared when the pointer is */
+    struct rt_type **any_type;
+#endif
+    struct rt_type *type;
+};
+
+struct rt_gc_marker {
+    /* boxes which have been marked but whose contents have not been scanned yet.
+       marking is iterative, so native stack use only depends on how deeply types
+       nest inline, not on the shape of the object graph */
+    struct rt_gc_mark_stack stack;
+
+    /* for keeping track of weak pointers encountered during GC mark phase */
+    u32 num_weakptrs;
+    u32 max_weakptrs;
+    struct rt_weakptr_entry *weakptrs;
+
+    /* the value type of the weak table being scanned by rt_gc_mark_weak_tables */
+    struct rt_type *ephemeron_type;
+
+#ifdef RT_GC_PARALLEL
+    /* set if this is one of several markers working in parallel */
+    struct rt_gc_workers *workers;
+
+    /* work which other markers may steal. count is read without the lock */
+    pthread_mutex_t shared_lock;
+    struct rt_gc_mark_stack shared;
+#endif
+};
+
+#ifdef RT_GC_PARALLEL
+/* when a marker has more than this many boxes on its stack and nothing shared,
+   it shares half of them */
+#define RT_GC_SHARE_THRESHOLD 64
+
+/* what the threads of the pool are started to do */
+enum rt_gc_phase {
+    RT_GC_PHASE_MARK,
+    RT_GC_PHASE_CLEAR_WEAKPTRS,
+};
+
+struct rt_gc_workers {
+    /* the markers in use, one per thread which could be started */
+    u32 count;
+    /* gc_mark_threads when the pool was started, which there are markers for.
+       more than count if some threads could not be started */
+    u32 requested;
+    /* markers[0] belongs to the thread running the collection, and the others to threads[i - 1] */
+    struct rt_gc_marker *markers;
+    pthread_t *threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+    /* incremented to start the threads on the phase */
+    u32 generation;
+    enum rt_gc_phase phase;
+    u32 done_count;
+    bool quit;
+
+    /* number of markers that have run out of work. marking is done when all have */
+    u32 idle_count;
+};
+#endif
+
+struct rt_gc_heap {
+    struct rt_gc_page *small_pages;
+    /* young large pages are always at the front, as new pages are prepended */
+    struct rt_gc_page *large_pages;
+    struct rt_gc_page *young_pages;
+
+    /* false until the first collection, when there are no old boxes to remember slots of */
+    bool has_old;
+
+    /* set while an incremental major collection is in progress */
+    bool marking;
+
+    /* set while some size class has unswept pages */
+    bool sweeping;
+
+    /* used when marking on the calling thread only */
+    struct rt_gc_marker marker;
+
+#ifdef RT_GC_PARALLEL
+    /* started when first needed, and kept for as long as gc_mark_threads is unchanged */
+    struct rt_gc_workers *workers;
+#endif
+
+    /* slots (and their types) which pointers have been stored into since the last
+       collection. see rt_gc_remember_slot */
+    struct rt_gc_mark_stack remembered;
+
+    struct rt_gc_size_class classes[RT_GC_SIZE_CLASS_COUNT];
+};
+
+static void rt_gc_init_size_class_lookup(void) {
+    u32 c = 0;
+    for (u32 i = 0; i <= RT_GC_MAX_SMALL_SIZE / 8; ++i) {
+        while (rt_gc_size_classes[c] < i * 8) {
+            ++c;
+        }
+        rt_gc_size_class_lookup[i] = (u8)c;
+    }
 }
 
-static void rt_gc_mark_value(struct rt_task *task, char *ptr, struct rt_type *type);
+static struct rt_gc_heap *rt_gc_get_heap(struct rt_task *task) {
+    if (!task->heap) {
+        if (!rt_gc_size_class_lookup[RT_GC_MAX_SMALL_SIZE / 8]) {
+            rt_gc_init_size_class_lookup();
+        }
+        task->heap = calloc(1, sizeof(struct rt_gc_heap));
+    }
+    return task->heap;
+}
 
-static void rt_gc_mark_box(struct rt_task *task, struct rt_box *box, struct rt_type *boxed_type) {
-    if (!rt_boxheader_is_marked(box->header)) {
-        rt_boxheader_set_mark(box->header);
-        rt_gc_mark_value(task, (char *)(box + 1), boxed_type);
+static struct rt_gc_page *rt_gc_new_page(rt_size_t size, rt_size_t header_size, u32 word_count) {
+    void *mem;
+    if (posix_memalign(&mem, RT_GC_PAGE_SIZE, size)) {
+        fprintf(stderr, "out of memory\n");
+        abort();
     }
+    struct rt_gc_page *page = mem;
+    memset(page, 0, header_size);
+    page->word_count = word_count;
+    page->boxes = (char *)page + header_size;
+    page->alloc_bits = page->bits;
+    page->mark_bits = page->bits + word_count;
+    return page;
 }
 
-static void rt_gc_mark_struct(struct rt_task *task, char *ptr, struct rt_type *type) {
-    u32 field_count = type->u._struct.field_count;
-    struct rt_struct_field *fields = type->u._struct.fields;
-    
-    for (u32 i = 0; i < field_count; ++i) {
-        struct rt_struct_field *field = fields + i;
-        rt_gc_mark_value(task, ptr + field->offset, field->type);
+static bool rt_gc_drain_mark_stack_bounded(struct rt_gc_marker *m, u32 budget);
+static u32 rt_gc_sweep_page(struct rt_task *task, struct rt_gc_page *page);
+
+static void *rt_gc_alloc_small(struct rt_task *task, struct rt_gc_heap *heap, u32 size_class) {
+    struct rt_gc_size_class *sc = heap->classes + size_class;
+    for (;;) {
+        struct rt_gc_page *page = sc->current;
+        if (page) {
+            for (u32 i = sc->current_word; i < page->word_count; ++i) {
+                u64 free_bits = ~page->alloc_bits[i] & rt_gc_page_word_mask(page, i);
+                if (free_bits) {
+                    u32 bit = __builtin_ctzll(free_bits);
+                    page->alloc_bits[i] |= (u64)1 << bit;
+                    sc->current_word = i;
+                    char *box = rt_gc_page_box(page, i * 64 + bit);
+                    memset(box, 0, page->box_size);
+                    return box + RT_BOX_HEADER_SIZE;
+                }
+            }
+        }
+
+        sc->current_word = 0;
+        page = NULL;
+        while (sc->unswept) {
+            struct rt_gc_page *unswept = sc->unswept;
+            sc->unswept = unswept->next_partial;
+            if (rt_gc_sweep_page(task, unswept) < unswept->box_count) {
+                page = unswept;
+                break;
+            }
+        }
+        if (!page && sc->partial) {
+            page = sc->partial;
+            sc->partial = page->next_partial;
+        }
+        if (page) {
+            sc->current = page;
+            if (!page->young) {
+                page->young = true;
+                page->next_young = heap->young_pages;
+                heap->young_pages = page;
+            }
+            continue;
+        }
+
+        u32 box_size = rt_gc_size_classes[size_class];
+        page = rt_gc_new_page(RT_GC_PAGE_SIZE, RT_GC_SMALL_PAGE_HEADER_SIZE, RT_GC_BITMAP_WORDS);
+        page->size_class = size_class;
+        page->box_size = box_size;
+        page->box_count = (RT_GC_PAGE_SIZE - RT_GC_SMALL_PAGE_HEADER_SIZE) / box_size;
+        page->word_count = (page->box_count + 63) / 64;
+        page->box_size_recip = (((u64)1 << 32) / box_size) + 1;
+        page->next = heap->small_pages;
+        heap->small_pages = page;
+        page->young = true;
+        page->next_young = heap->young_pages;
+        heap->young_pages = page;
+        sc->current = page;
     }
 }
 
-static void rt_gc_add_weakptr(struct rt_task *task, void **ptr, struct rt_type **any_type, struct rt_type *type) {
-    if (task->num_weakptrs == task->max_weakptrs) {
-        task->max_weakptrs = task->max_weakptrs ? task->max_weakptrs * 2 : 16;
-        task->weakptrs = realloc(task->weakptrs, sizeof(struct rt_weakptr_entry) * task->max_weakptrs);
+void *rt_gc_alloc(struct rt_task *task, rt_size_t size) {
+    struct rt_gc_heap *heap = rt_gc_get_heap(task);
+    if (heap->marking && task->gc_alloc_step_budget) {
+        /* only mark here. finishing the cycle would free boxes the caller may not have rooted yet */
+        rt_gc_drain_mark_stack_bounded(&heap->marker, task->gc_alloc_step_budget);
+    }
+    size += RT_BOX_HEADER_SIZE;
+    if (size < RT_GC_MIN_BOX_SIZE) {
+        size = RT_GC_MIN_BOX_SIZE;
+    }
+    if (size <= RT_GC_MAX_SMALL_SIZE) {
+        return rt_gc_alloc_small(task, heap, rt_gc_size_class_lookup[(size + 7) / 8]);
     }
-    struct rt_weakptr_entry *e = &task->weakptrs[task->num_weakptrs++];
+    struct rt_gc_page *page = rt_gc_new_page(RT_GC_LARGE_PAGE_HEADER_SIZE + size, RT_GC_LARGE_PAGE_HEADER_SIZE, 1);
+    page->size_class = RT_GC_LARGE_CLASS;
+    page->box_count = 1;
+    page->alloc_bits[0] = 1;
+    page->young = true;
+    page->next = heap->large_pages;
+    heap->large_pages = page;
+    memset(page->boxes, 0, size);
+    return page->boxes + RT_BOX_HEADER_SIZE;
+}
+
+/* sets the mark bit of the box, returning whether it was already set */
+static bool rt_gc_test_and_mark(struct rt_gc_marker *m, char *box) {
+    struct rt_gc_page *page = rt_gc_page_of(box);
+    u32 index = rt_gc_page_index(page, box);
+    u64 *word = page->mark_bits + (index >> 6);
+    u64 bit = (u64)1 << (index & 63);
+#ifdef RT_GC_PARALLEL
+    if (m->workers) {
+        if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit) {
+            return true;
+        }
+        return (__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit) != 0;
+    }
+#endif
+    if (*word & bit) {
+        return true;
+    }
+    *word |= bit;
+    return false;
+}
+
+static bool rt_gc_is_marked(char *box) {
+    struct rt_gc_page *page = rt_gc_page_of(box);
+    u32 index = rt_gc_page_index(page, box);
+    return (page->mark_bits[index >> 6] >> (index & 63)) & 1;
+}
+
+static void rt_gc_mark_value(struct rt_gc_marker *m, char *ptr, struct rt_type *type);
+
+static void rt_gc_reserve(struct rt_gc_mark_stack *stack, u32 extra) {
+    if (stack->count + extra > stack->capacity) {
+        do {
+            stack->capacity = stack->capacity ? stack->capacity * 2 : 1024;
+        } while (stack->count + extra > stack->capacity);
+        stack->entries = realloc(stack->entries, sizeof(struct rt_gc_mark_entry) * stack->capacity);
+    }
+}
+
+static void rt_gc_push(struct rt_gc_mark_stack *stack, char *ptr, struct rt_type *type) {
+    rt_gc_reserve(stack, 1);
+    struct rt_gc_mark_entry *e = stack->entries + stack->count++;
     e->ptr = ptr;
-    e->any_type = any_type;
     e->type = type;
 }
 
-static void rt_gc_mark_array(struct rt_task *task, char *ptr, struct rt_type *type) {
-    struct rt_type *elem_type = type->u.array.elem_type;
-    rt_size_t elem_size = elem_type->size;
+static void rt_gc_mark_box(struct rt_gc_marker *m, char *box, struct rt_type *boxed_type) {
+    if (!rt_gc_test_and_mark(m, box)) {
+        /* start pulling in the contents, as they will be scanned soon */
+        __builtin_prefetch(box);
+        rt_gc_push(&m->stack, box, boxed_type);
+    }
+}
+
+/* scan pushed boxes until the mark stack is empty */
+static void rt_gc_drain_mark_stack(struct rt_gc_marker *m) {
+    struct rt_gc_mark_stack *stack = &m->stack;
+    while (stack->count) {
+        struct rt_gc_mark_entry e = stack->entries[--stack->count];
+        rt_gc_mark_value(m, e.ptr, e.type);
+    }
+}
+
+/* scan at most budget pushed boxes. returns true if the mark stack was emptied */
+static bool rt_gc_drain_mark_stack_bounded(struct rt_gc_marker *m, u32 budget) {
+    struct rt_gc_mark_stack *stack = &m->stack;
+    for (u32 i = 0; i < budget && stack->count; ++i) {
+        struct rt_gc_mark_entry e = stack->entries[--stack->count];
+        rt_gc_mark_value(m, e.ptr, e.type);
+    }
+    return !stack->count;
+}
+
+/* scan the slots listed in a type's pointer map, for a value at ptr. boxed pointers,
+   by far the most common kind of slot, are marked without going through rt_gc_mark_value */
+static void rt_gc_mark_slots(struct rt_gc_marker *m, char *ptr, u32 slot_count, struct rt_gc_slot *slots) {
+    for (u32 i = 0; i < slot_count; ++i) {
+        struct rt_type *type = slots[i].type;
+        char *slot = ptr + slots[i].offset;
+        if (type->kind == RT_KIND_PTR && type->u.ptr.box_type && !(type->flags & RT_TYPE_FLAG_WEAK_PTR)) {
+            char *target = *(char **)slot;
+            if (target) {
+                rt_gc_mark_box(m, target - type->u.ptr.box_offset, type->u.ptr.box_type);
+            }
+        } else {
+            rt_gc_mark_value(m, slot, type);
+        }
+    }
+}
+
+/* the entry is returned with its any fields cleared, for the caller to fill in */
+static struct rt_weakptr_entry *rt_gc_add_weakptr(struct rt_gc_marker *m, void **ptr, struct rt_type *type) {
+    if (m->num_weakptrs == m->max_weakptrs) {
+        m->max_weakptrs = m->max_weakptrs ? m->max_weakptrs * 2 : 16;
+        m->weakptrs = realloc(m->weakptrs, sizeof(struct rt_weakptr_entry) * m->max_weakptrs);
+    }
+    struct rt_weakptr_entry *e = &m->weakptrs[m->num_weakptrs++];
+    *e = (struct rt_weakptr_entry) { ptr, 0, type };
+    return e;
+}
+
+static void rt_gc_mark_array(struct rt_gc_marker *m, char *ptr, struct rt_type *type) {
+    rt_size_t elem_size = type->u.array.elem_type->size;
     assert(elem_size);
-    
+
     rt_size_t length;
     if (type->size) {
         length = type->size / elem_size;
@@ -59,26 +466,42 @@ static void rt_gc_mark_array(struct rt_task *task, char *ptr, struct rt_type *ty
         length = *(rt_size_t *)ptr;
         ptr += sizeof(rt_size_t);
     }
-    
+
+    u32 slot_count = type->gc_slot_count;
+    struct rt_gc_slot *slots = type->gc_slots;
     for (rt_size_t i = 0; i < length; ++i) {
-        rt_gc_mark_value(task, ptr + i*elem_size, elem_type);
+        rt_gc_mark_slots(m, ptr + i*elem_size, slot_count, slots);
     }
 }
 
-static void rt_gc_mark_value(struct rt_task *task, char *ptr, struct rt_type *type) {
+static void rt_gc_mark_value(struct rt_gc_marker *m, char *ptr, struct rt_type *type) {
     if (!(type->flags & RT_TYPE_FLAG_NEED_GC_MARK)) {
         return;
     }
     switch (type->kind) {
     case RT_KIND_ANY: {
         struct rt_any *any = (struct rt_any *)ptr;
+#ifdef RT_COMPACT_ANY
+        u32 tag = rt_any_tag(*any);
+        if (tag == RT_ANY_TAG_PTR) {
+            if (any->u.data) {
+                rt_gc_mark_value(m, (char *)&any->u.data, rt_box_type(any->u.ptr));
+            }
+        } else if (tag == RT_ANY_TAG_WEAK) {
+            /* only the box offset of the type is needed, which the strong type shares */
+            rt_gc_add_weakptr(m, &any->u.ptr, rt_box_type(rt_any_ptr(*any)))->any_data = any->u.data;
+        } else if (tag == RT_ANY_TAG_BOXED_I64 || tag == RT_ANY_TAG_BOXED_U64) {
+            rt_gc_test_and_mark(m, rt_any_ptr(*any));
+        }
+#else
         if (any->_type) {
             if (any->_type->flags & RT_TYPE_FLAG_WEAK_PTR) {
-                rt_gc_add_weakptr(task, &any->u.ptr, &any->_type, any->_type);
+                rt_gc_add_weakptr(m, &any->u.ptr, any->_type)->any_type = &any->_type;
             } else {
-                rt_gc_mark_value(task, (char *)&any->u.data, any->_type);
+                rt_gc_mark_value(m, (char *)&any->u.data, any->_type);
             }
         }
+#endif
         break;
     }
     case RT_KIND_PTR:
@@ -87,21 +510,19 @@ static void rt_gc_mark_value(struct rt_task *task, char *ptr, struct rt_type *ty
         }
         if (type->u.ptr.box_type) {
             if (type->flags & RT_TYPE_FLAG_WEAK_PTR) {
-                rt_gc_add_weakptr(task, (void **)ptr, NULL, type);
+                rt_gc_add_weakptr(m, (void **)ptr, type);
             } else {
-                rt_gc_mark_box(task,
-                    (struct rt_box *)(*(char **)ptr - type->u.ptr.box_offset - sizeof(struct rt_box)),
-                    type->u.ptr.box_type);
+                rt_gc_mark_box(m, *(char **)ptr - type->u.ptr.box_offset, type->u.ptr.box_type);
             }
         } else {
-            rt_gc_mark_value(task, *(char **)ptr, type->u.ptr.target_type);
+            rt_gc_mark_value(m, *(char **)ptr, type->u.ptr.target_type);
         }
         break;
     case RT_KIND_STRUCT:
-        rt_gc_mark_struct(task, ptr, type);
+        rt_gc_mark_slots(m, ptr, type->gc_slot_count, type->gc_slots);
         break;
     case RT_KIND_ARRAY:
-        rt_gc_mark_array(task, ptr, type);
+        rt_gc_mark_array(m, ptr, type);
         break;
     default:
         break;
@@ -109,21 +530,208 @@ static void rt_gc_mark_value(struct rt_task *task, char *ptr, struct rt_type *ty
 }
 
 
-static void free_boxes(struct rt_task *task, struct rt_box *boxes) {
-    while (boxes) {
-        struct rt_box *box = boxes;
-        boxes = rt_boxheader_get_next(box->header);
-        if (task->free_func) {
-            task->free_func(task->free_func_userdata, box);
-        } else {
-            free(box);
+void rt_gc_remember_slot(struct rt_task *task, void *slot, struct rt_type *slot_type) {
+    struct rt_gc_heap *heap = task->heap;
+    if (!heap || !(heap->has_old || heap->marking)) {
+        return;
+    }
+    if (slot_type->kind == RT_KIND_ANY) {
+        struct rt_any *any = (struct rt_any *)slot;
+#ifdef RT_COMPACT_ANY
+        /* boxed integers have no type to tell, but are boxes all the same */
+        u32 tag = rt_any_tag(*any);
+        if (rt_any_is_nil(*any) || (tag > RT_ANY_TAG_WEAK && tag != RT_ANY_TAG_BOXED_I64 && tag != RT_ANY_TAG_BOXED_U64)) {
+            return;
+        }
+#else
+        struct rt_type *type = any->_type;
+        if (!type || !(type->flags & RT_TYPE_FLAG_NEED_GC_MARK)) {
+            return;
         }
+#endif
+    } else if (!(slot_type->flags & RT_TYPE_FLAG_NEED_GC_MARK)) {
+        return;
     }
+    rt_gc_push(&heap->remembered, slot, slot_type);
 }
 
-void rt_gc_run(struct rt_task *task) {
-    /* mark */
-    task->num_weakptrs = 0;
+
+/* frees the boxes of a bitmap word which are allocated but not marked, and makes the
+   marked ones the new allocated set. the mark bits are left set, making the survivors
+   old. returns the number of boxes that survived */
+static u32 rt_gc_sweep_word(struct rt_task *task, struct rt_gc_page *page, u32 word) {
+    u64 alloc = page->alloc_bits[word];
+    u64 mark = page->mark_bits[word];
+    u64 dead = alloc & ~mark;
+    if (dead && task->free_func) {
+        do {
+            u32 bit = __builtin_ctzll(dead);
+            dead &= dead - 1;
+            task->free_func(task->free_func_userdata, rt_gc_page_box(page, word * 64 + bit) + RT_BOX_HEADER_SIZE);
+        } while (dead);
+    }
+    page->alloc_bits[word] = mark;
+    return __builtin_popcountll(mark);
+}
+
+static u32 rt_gc_sweep_page(struct rt_task *task, struct rt_gc_page *page) {
+    u32 live = 0;
+    for (u32 i = 0; i < page->word_count; ++i) {
+        live += rt_gc_sweep_word(task, page, i);
+    }
+    page->young = false;
+    return live;
+}
+
+static void rt_gc_clear_marks(struct rt_gc_heap *heap) {
+    for (struct rt_gc_page *page = heap->small_pages; page; page = page->next) {
+        memset(page->mark_bits, 0, sizeof(u64) * page->word_count);
+    }
+    for (struct rt_gc_page *page = heap->large_pages; page; page = page->next) {
+        page->mark_bits[0] = 0;
+    }
+}
+
+/* sweep every page, giving empty ones back to the system. if lazy, small pages
+   are only queued for rt_gc_alloc_small and rt_gc_finish_sweep to sweep */
+static void rt_gc_sweep_major(struct rt_task *task, bool lazy) {
+    struct rt_gc_heap *heap = task->heap;
+
+    for (u32 i = 0; i < RT_GC_SIZE_CLASS_COUNT; ++i) {
+        heap->classes[i].current = NULL;
+        heap->classes[i].current_word = 0;
+        heap->classes[i].partial = NULL;
+    }
+    heap->young_pages = NULL;
+
+    if (lazy) {
+        for (struct rt_gc_page *page = heap->small_pages; page; page = page->next) {
+            struct rt_gc_size_class *sc = heap->classes + page->size_class;
+            page->young = false;
+            page->next_partial = sc->unswept;
+            sc->unswept = page;
+        }
+        heap->sweeping = heap->small_pages != NULL;
+    }
+
+    struct rt_gc_page **slot = &heap->small_pages;
+    while (!lazy && *slot) {
+        struct rt_gc_page *page = *slot;
+        u32 live = rt_gc_sweep_page(task, page);
+        if (!live) {
+            *slot = page->next;
+            free(page);
+            continue;
+        }
+        if (live < page->box_count) {
+            struct rt_gc_size_class *sc = heap->classes + page->size_class;
+            page->next_partial = sc->partial;
+            sc->partial = page;
+        }
+        slot = &page->next;
+    }
+
+    slot = &heap->large_pages;
+    while (*slot) {
+        struct rt_gc_page *page = *slot;
+        if (!rt_gc_sweep_page(task, page)) {
+            *slot = page->next;
+            free(page);
+            continue;
+        }
+        slot = &page->next;
+    }
+}
+
+void rt_gc_finish_sweep(struct rt_task *task) {
+    struct rt_gc_heap *heap = task->heap;
+    if (!heap || !heap->sweeping) {
+        return;
+    }
+    bool any_empty = false;
+    for (u32 i = 0; i < RT_GC_SIZE_CLASS_COUNT; ++i) {
+        struct rt_gc_size_class *sc = heap->classes + i;
+        while (sc->unswept) {
+            struct rt_gc_page *page = sc->unswept;
+            sc->unswept = page->next_partial;
+            u32 live = rt_gc_sweep_page(task, page);
+            if (!live) {
+                page->empty = true;
+                any_empty = true;
+            } else if (live < page->box_count) {
+                page->next_partial = sc->partial;
+                sc->partial = page;
+            }
+        }
+    }
+    heap->sweeping = false;
+
+    /* empty pages are on no list but the list of all pages, so one walk of it
+       gives them back. pages the allocator swept were taken into use instead */
+    struct rt_gc_page **slot = &heap->small_pages;
+    while (any_empty && *slot) {
+        struct rt_gc_page *page = *slot;
+        if (page->empty) {
+            *slot = page->next;
+            free(page);
+            continue;
+        }
+        slot = &page->next;
+    }
+}
+
+u32 rt_gc_page_count(struct rt_task *task) {
+    struct rt_gc_heap *heap = task->heap;
+    u32 count = 0;
+    if (!heap) {
+        return 0;
+    }
+    for (struct rt_gc_page *page = heap->small_pages; page; page = page->next) {
+        ++count;
+    }
+    for (struct rt_gc_page *page = heap->large_pages; page; page = page->next) {
+        ++count;
+    }
+    return count;
+}
+
+/* sweep only the pages allocated into since the last collection. the other pages
+   can only hold old boxes, which a minor collection never frees. empty small pages
+   are kept, as unlinking them would need a walk of all pages */
+static void rt_gc_sweep_minor(struct rt_task *task) {
+    struct rt_gc_heap *heap = task->heap;
+
+    /* the current pages are young, so they are put back on the partial lists below */
+    for (u32 i = 0; i < RT_GC_SIZE_CLASS_COUNT; ++i) {
+        heap->classes[i].current = NULL;
+        heap->classes[i].current_word = 0;
+    }
+
+    struct rt_gc_page *page = heap->young_pages;
+    while (page) {
+        struct rt_gc_page *next = page->next_young;
+        if (rt_gc_sweep_page(task, page) < page->box_count) {
+            struct rt_gc_size_class *sc = heap->classes + page->size_class;
+            page->next_partial = sc->partial;
+            sc->partial = page;
+        }
+        page = next;
+    }
+    heap->young_pages = NULL;
+
+    struct rt_gc_page **slot = &heap->large_pages;
+    while (*slot && (*slot)->young) {
+        page = *slot;
+        if (!rt_gc_sweep_page(task, page)) {
+            *slot = page->next;
+            free(page);
+            continue;
+        }
+        slot = &page->next;
+    }
+}
+
+static void rt_gc_mark_roots(struct rt_task *task, struct rt_gc_marker *m) {
     void **roots = task->roots;
     while (roots) {
         struct rt_type **types = roots[1];
@@ -133,63 +741,457 @@ void rt_gc_run(struct rt_task *task) {
                 break;
             }
             void *root = roots[i+2];
-            rt_gc_mark_value(task, root, type);
+            rt_gc_mark_value(m, root, type);
         }
         roots = roots[0];
     }
 
-    /* TODO: make hash table play nice with GC so we don't have to mark the keys manually */
     struct rt_module *module = task->current_module;
     if (module) {
-        for (u32 i = 0; i < module->location_before_car.size; ++i) {
-            struct rt_sourcemap_entry *e = module->location_before_car.entries + i;
-            if (e->hash) {
-                rt_gc_mark_value(task, (char *)&e->key, rt_types.boxed_cons);
-            }
+        for (u32 i = 0; i < module->global_count; ++i) {
+            rt_gc_mark_value(m, (char *)&module->globals[i].value, rt_types.any);
+            rt_gc_mark_value(m, (char *)&module->globals[i].form, rt_types.any);
+        }
+        for (u32 i = 0; i < module->literal_count; ++i) {
+            rt_gc_mark_value(m, (char *)&module->literals[i], rt_types.any);
         }
-        for (u32 i = 0; i < module->location_after_car.size; ++i) {
-            struct rt_sourcemap_entry *e = module->location_after_car.entries + i;
-            if (e->hash) {
-                rt_gc_mark_value(task, (char *)&e->key, rt_types.boxed_cons);
+    }
+}
+
+bool rt_gc_is_live(void *box) {
+    return rt_gc_is_marked(box);
+}
+
+void rt_gc_add_weak_table(struct rt_task *task, struct rt_gc_weak_table *weak) {
+    weak->next = task->weak_tables;
+    task->weak_tables = weak;
+}
+
+void rt_gc_remove_weak_table(struct rt_task *task, struct rt_gc_weak_table *weak) {
+    struct rt_gc_weak_table **slot = &task->weak_tables;
+    while (*slot != weak) {
+        slot = &(*slot)->next;
+    }
+    *slot = weak->next;
+    weak->next = NULL;
+}
+
+static void rt_gc_mark_ephemeron(void *ctx, void *key, void *value) {
+    struct rt_gc_marker *m = ctx;
+    if (rt_gc_is_marked(key)) {
+        rt_gc_mark_value(m, value, m->ephemeron_type);
+    }
+}
+
+/* mark the values of the weak table entries whose keys have been found reachable,
+   and what they reach, until that finds no more keys. run with the mark stack
+   drained, before weak pointers are cleared */
+static void rt_gc_mark_weak_tables(struct rt_task *task, struct rt_gc_marker *m) {
+    for (;;) {
+        for (struct rt_gc_weak_table *weak = task->weak_tables; weak; weak = weak->next) {
+            if (weak->value_type && (weak->value_type->flags & RT_TYPE_FLAG_NEED_GC_MARK)) {
+                m->ephemeron_type = weak->value_type;
+                weak->each(weak->table, rt_gc_mark_ephemeron, m);
             }
         }
+        if (!m->stack.count) {
+            break;
+        }
+        rt_gc_drain_mark_stack(m);
     }
+}
 
-    /* null out the weak pointers */
-    for (u32 i = 0; i < task->num_weakptrs; ++i) {
-        struct rt_weakptr_entry e = task->weakptrs[i];
-        struct rt_box *box = (struct rt_box *)(*(char **)e.ptr - e.type->u.ptr.box_offset - sizeof(struct rt_box));
-        if (!rt_boxheader_is_marked(box->header)) {
+/* remove the entries whose keys are about to be freed. the locations of the current
+   module are held the same way, though the module is not on the list */
+static void rt_gc_prune_weak_tables(struct rt_task *task) {
+    for (struct rt_gc_weak_table *weak = task->weak_tables; weak; weak = weak->next) {
+        weak->prune(weak->table);
+    }
+    if (task->current_module) {
+        rt_module_prune_locations(task->current_module);
+    }
+}
+
+static void rt_gc_mark_remembered(struct rt_task *task, struct rt_gc_marker *m) {
+    struct rt_gc_mark_stack *remembered = &task->heap->remembered;
+    for (u32 i = 0; i < remembered->count; ++i) {
+        struct rt_gc_mark_entry *e = remembered->entries + i;
+        rt_gc_mark_value(m, e->ptr, e->type);
+    }
+    remembered->count = 0;
+}
+
+static void rt_gc_clear_weakptrs(struct rt_gc_marker *m) {
+    for (u32 i = 0; i < m->num_weakptrs; ++i) {
+        struct rt_weakptr_entry e = m->weakptrs[i];
+        char *target = *(char **)e.ptr;
+        /* the slot may have been cleared or overwritten since it was found, if marking was incremental */
+#ifdef RT_COMPACT_ANY
+        if (e.any_data) {
+            if ((uintptr_t)target != e.any_data) {
+                continue;
+            }
+            target = (char *)(e.any_data & RT_ANY_PAYLOAD_MASK);
+        }
+        if (!target) {
+            continue;
+        }
+#else
+        if (!target || (e.any_type && *e.any_type != e.type)) {
+            continue;
+        }
+#endif
+        if (!rt_gc_is_marked(target - e.type->u.ptr.box_offset)) {
             *e.ptr = NULL;
+#ifndef RT_COMPACT_ANY
             if (e.any_type) {
                 *e.any_type = NULL;
             }
+#endif
         }
     }
+    m->num_weakptrs = 0;
+}
+
+static void rt_gc_free_marker(struct rt_gc_marker *m) {
+    free(m->stack.entries);
+    free(m->weakptrs);
+}
+
+
+#ifdef RT_GC_PARALLEL
+
+/* move the top n entries of one stack to another. the shared stack count is
+   stored atomically, as it is read by other markers without taking the lock */
+static void rt_gc_move_work(struct rt_gc_mark_stack *from, struct rt_gc_mark_stack *to, u32 n) {
+    rt_gc_reserve(to, n);
+    memcpy(to->entries + to->count, from->entries + from->count - n, sizeof(struct rt_gc_mark_entry) * n);
+    __atomic_store_n(&to->count, to->count + n, __ATOMIC_RELAXED);
+    __atomic_store_n(&from->count, from->count - n, __ATOMIC_RELAXED);
+}
+
+/* move half of the local stack to the shared one */
+static void rt_gc_share_work(struct rt_gc_marker *m) {
+    pthread_mutex_lock(&m->shared_lock);
+    rt_gc_move_work(&m->stack, &m->shared, m->stack.count / 2);
+    pthread_mutex_unlock(&m->shared_lock);
+}
 
-    /* sweep */
-    uintptr_t *slot = (uintptr_t *)&task->boxes;
-    struct rt_box *unreachable = NULL;
-    while (1) {
-        struct rt_box *box = rt_boxheader_get_next(*slot);
-        if (!box) {
+/* take all shared work of our own, or steal half of what another marker shares */
+static bool rt_gc_take_work(struct rt_gc_marker *m) {
+    struct rt_gc_workers *w = m->workers;
+    u32 self = (u32)(m - w->markers);
+    for (u32 i = 0; i < w->count; ++i) {
+        struct rt_gc_marker *victim = w->markers + (self + i) % w->count;
+        if (!__atomic_load_n(&victim->shared.count, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        pthread_mutex_lock(&victim->shared_lock);
+        u32 n = victim == m ? victim->shared.count : (victim->shared.count + 1) / 2;
+        rt_gc_move_work(&victim->shared, &m->stack, n);
+        pthread_mutex_unlock(&victim->shared_lock);
+        if (n) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool rt_gc_any_shared_work(struct rt_gc_workers *w) {
+    for (u32 i = 0; i < w->count; ++i) {
+        if (__atomic_load_n(&w->markers[i].shared.count, __ATOMIC_RELAXED)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* mark until every marker is out of work. a marker only goes idle when its own
+   shared stack is empty, and it can only share while not idle, so when all
+   markers are idle there is no work left anywhere */
+static void rt_gc_mark_parallel(struct rt_gc_marker *m) {
+    struct rt_gc_workers *w = m->workers;
+    for (;;) {
+        while (m->stack.count) {
+            if (m->stack.count > RT_GC_SHARE_THRESHOLD && !__atomic_load_n(&m->shared.count, __ATOMIC_RELAXED)) {
+                rt_gc_share_work(m);
+            }
+            struct rt_gc_mark_entry e = m->stack.entries[--m->stack.count];
+            rt_gc_mark_value(m, e.ptr, e.type);
+        }
+        if (rt_gc_take_work(m)) {
+            continue;
+        }
+
+        __atomic_add_fetch(&w->idle_count, 1, __ATOMIC_SEQ_CST);
+        for (;;) {
+            if (__atomic_load_n(&w->idle_count, __ATOMIC_SEQ_CST) == w->count) {
+                return;
+            }
+            if (rt_gc_any_shared_work(w)) {
+                __atomic_sub_fetch(&w->idle_count, 1, __ATOMIC_SEQ_CST);
+                break;
+            }
+            sched_yield();
+        }
+    }
+}
+
+static void *rt_gc_worker_main(void *arg) {
+    struct rt_gc_marker *m = arg;
+    struct rt_gc_workers *w = m->workers;
+    u32 generation = 0;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->generation == generation && !w->quit) {
+            pthread_cond_wait(&w->start_cond, &w->lock);
+        }
+        if (w->quit) {
             break;
         }
-        if (rt_boxheader_is_marked(box->header)) {
-            rt_boxheader_clear_mark(box->header);
-            slot = &box->header;
+        generation = w->generation;
+        enum rt_gc_phase phase = w->phase;
+        pthread_mutex_unlock(&w->lock);
+
+        if (phase == RT_GC_PHASE_MARK) {
+            rt_gc_mark_parallel(m);
         } else {
-            rt_boxheader_set_next(*slot, rt_boxheader_get_next(box->header));
-            rt_boxheader_set_next(box->header, unreachable);
-            unreachable = box;
+            rt_gc_clear_weakptrs(m);
+        }
+
+        pthread_mutex_lock(&w->lock);
+        if (++w->done_count == w->count - 1) {
+            pthread_cond_signal(&w->done_cond);
         }
     }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static void rt_gc_stop_workers(struct rt_gc_workers *w) {
+    pthread_mutex_lock(&w->lock);
+    w->quit = true;
+    pthread_cond_broadcast(&w->start_cond);
+    pthread_mutex_unlock(&w->lock);
+
+    for (u32 i = 1; i < w->count; ++i) {
+        pthread_join(w->threads[i - 1], NULL);
+    }
+    for (u32 i = 0; i < w->requested; ++i) {
+        pthread_mutex_destroy(&w->markers[i].shared_lock);
+        free(w->markers[i].shared.entries);
+        rt_gc_free_marker(w->markers + i);
+    }
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->start_cond);
+    pthread_cond_destroy(&w->done_cond);
+    free(w->markers);
+    free(w->threads);
+    free(w);
+}
 
-    /* free unreachable boxes. could be done on another thread */
-    free_boxes(task, unreachable);
+static struct rt_gc_workers *rt_gc_start_workers(u32 count) {
+    struct rt_gc_workers *w = calloc(1, sizeof(struct rt_gc_workers));
+    w->count = count;
+    w->requested = count;
+    w->markers = calloc(count, sizeof(struct rt_gc_marker));
+    w->threads = calloc(count - 1, sizeof(pthread_t));
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->start_cond, NULL);
+    pthread_cond_init(&w->done_cond, NULL);
+    for (u32 i = 0; i < count; ++i) {
+        w->markers[i].workers = w;
+        pthread_mutex_init(&w->markers[i].shared_lock, NULL);
+    }
+    for (u32 i = 1; i < count; ++i) {
+        if (pthread_create(&w->threads[i - 1], NULL, rt_gc_worker_main, w->markers + i)) {
+            /* run with the threads we got */
+            w->count = i;
+            break;
+        }
+    }
+    return w;
+}
+
+/* start the threads on a phase, do the part of the calling thread and wait for
+   the others to finish theirs */
+static void rt_gc_run_phase(struct rt_gc_workers *w, enum rt_gc_phase phase) {
+    struct rt_gc_marker *m = w->markers;
+    pthread_mutex_lock(&w->lock);
+    w->idle_count = 0;
+    w->done_count = 0;
+    w->phase = phase;
+    ++w->generation;
+    pthread_cond_broadcast(&w->start_cond);
+    pthread_mutex_unlock(&w->lock);
+
+    if (phase == RT_GC_PHASE_MARK) {
+        rt_gc_mark_parallel(m);
+    } else {
+        rt_gc_clear_weakptrs(m);
+    }
+
+    pthread_mutex_lock(&w->lock);
+    while (w->done_count != w->count - 1) {
+        pthread_cond_wait(&w->done_cond, &w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* mark from the roots using the worker threads, and clear the weak pointers.
+   returns false if there are not enough threads, and marking must be done serially */
+static bool rt_gc_mark_roots_parallel(struct rt_task *task) {
+    struct rt_gc_heap *heap = task->heap;
+    struct rt_gc_workers *w = heap->workers;
+    /* if fewer threads were started than asked for, the pool is kept with those,
+       rather than trying again every collection */
+    if (!w || w->requested != task->gc_mark_threads) {
+        if (w) {
+            rt_gc_stop_workers(w);
+        }
+        w = heap->workers = rt_gc_start_workers(task->gc_mark_threads);
+    }
+    if (w->count < 2) {
+        return false;
+    }
+
+    /* seed the shared stack of the first marker with everything reachable from the roots */
+    struct rt_gc_marker *m = w->markers;
+    rt_gc_mark_roots(task, m);
+    rt_gc_move_work(&m->stack, &m->shared, m->stack.count);
+    rt_gc_run_phase(w, RT_GC_PHASE_MARK);
+
+    /* what only weak tables reach is rare enough to be marked on this thread.
+       any weak pointers found doing so are cleared by it along with its own */
+    rt_gc_mark_weak_tables(task, m);
+    /* the slots of distinct boxes are cleared, and the mark bits no longer change */
+    rt_gc_run_phase(w, RT_GC_PHASE_CLEAR_WEAKPTRS);
+    return true;
+}
+
+#endif
+
+void rt_gc_run(struct rt_task *task) {
+    struct rt_gc_heap *heap = task->heap;
+    if (!heap) {
+        return;
+    }
+
+    /* mark. the remembered set is not needed, as every old box is traced again.
+       an incremental collection in progress is simply restarted */
+    rt_gc_finish_sweep(task);
+    rt_gc_clear_marks(heap);
+    heap->remembered.count = 0;
+    heap->marker.stack.count = 0;
+    heap->marker.num_weakptrs = 0;
+    heap->marking = false;
+#ifdef RT_GC_PARALLEL
+    if (task->gc_mark_threads > 1 && rt_gc_mark_roots_parallel(task)) {
+        /* the weak pointers have been nulled out by the marking threads */
+    } else
+#endif
+    {
+        rt_gc_mark_roots(task, &heap->marker);
+        rt_gc_drain_mark_stack(&heap->marker);
+        rt_gc_mark_weak_tables(task, &heap->marker);
+
+        /* null out the weak pointers */
+        rt_gc_clear_weakptrs(&heap->marker);
+    }
+
+    rt_gc_prune_weak_tables(task);
+    rt_gc_sweep_major(task, task->gc_lazy_sweep);
+    heap->has_old = true;
+}
+
+static void rt_gc_finish_incremental(struct rt_task *task) {
+    struct rt_gc_heap *heap = task->heap;
+
+    /* catch up with what the mutator did since marking started */
+    rt_gc_mark_remembered(task, &heap->marker);
+    rt_gc_mark_roots(task, &heap->marker);
+    rt_gc_drain_mark_stack(&heap->marker);
+    rt_gc_mark_weak_tables(task, &heap->marker);
+
+    rt_gc_clear_weakptrs(&heap->marker);
+    rt_gc_prune_weak_tables(task);
+    rt_gc_sweep_major(task, task->gc_lazy_sweep);
+    heap->marking = false;
+    heap->has_old = true;
+}
+
+bool rt_gc_step(struct rt_task *task, u32 budget) {
+    struct rt_gc_heap *heap = task->heap;
+    if (!heap) {
+        return true;
+    }
+
+    if (!heap->marking) {
+        rt_gc_finish_sweep(task);
+        rt_gc_clear_marks(heap);
+        heap->remembered.count = 0;
+        heap->marker.num_weakptrs = 0;
+        rt_gc_mark_roots(task, &heap->marker);
+        heap->marking = true;
+    }
+
+    if (!rt_gc_drain_mark_stack_bounded(&heap->marker, budget)) {
+        return false;
+    }
+    rt_gc_finish_incremental(task);
+    return true;
+}
+
+void rt_gc_run_minor(struct rt_task *task) {
+    struct rt_gc_heap *heap = task->heap;
+    if (!heap) {
+        return;
+    }
+
+    if (heap->marking) {
+        /* marks have been cleared, so a minor collection is not possible until the cycle is done */
+        rt_gc_finish_incremental(task);
+        return;
+    }
+    /* unswept pages still have dead boxes set in their allocation bits */
+    rt_gc_finish_sweep(task);
+
+    /* mark. old boxes are already marked, so only young ones reachable from the
+       roots, or from slots of old boxes which have been stored into, are visited */
+    heap->marker.num_weakptrs = 0;
+    rt_gc_mark_remembered(task, &heap->marker);
+    rt_gc_mark_roots(task, &heap->marker);
+    rt_gc_drain_mark_stack(&heap->marker);
+    rt_gc_mark_weak_tables(task, &heap->marker);
+
+    /* null out the weak pointers */
+    rt_gc_clear_weakptrs(&heap->marker);
+
+    rt_gc_prune_weak_tables(task);
+    rt_gc_sweep_minor(task);
+    heap->has_old = true;
 }
 
 void rt_gc_free_all(struct rt_task *task) {
-    free_boxes(task, task->boxes);
-    task->boxes = NULL;
+    struct rt_gc_heap *heap = task->heap;
+    if (!heap) {
+        return;
+    }
+
+    /* with no mark bits set, sweeping frees every box */
+    rt_gc_finish_sweep(task);
+    rt_gc_clear_marks(heap);
+    rt_gc_sweep_major(task, false);
+    assert(!heap->small_pages && !heap->large_pages);
+
+#ifdef RT_GC_PARALLEL
+    if (heap->workers) {
+        rt_gc_stop_workers(heap->workers);
+    }
+#endif
+    rt_gc_free_marker(&heap->marker);
+    free(heap->remembered.entries);
+    free(heap);
+    task->heap = NULL;
 }
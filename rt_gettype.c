@@ -5,6 +5,17 @@
 #include <string.h>
 #include <inttypes.h>
 
+static u32 type_hash(struct rt_type *type);
+static bool type_equals(struct rt_type *a, struct rt_type *b);
+
+/* interns types by structure. the keys are the types themselves, and lookups
+   are done with a probe type on the stack describing the type wanted */
+DECL_HASH_TABLE(typetab, struct rt_type *, struct rt_type *)
+IMPL_HASH_TABLE(typetab, struct rt_type *, struct rt_type *, type_hash, type_equals)
+
+/* TODO: add locking around typetab access if threading becomes a thing */
+static struct typetab typetab;
+
 void rt_gettype_free_all() {
     struct rt_type *type = rt_types.types_all;
     while (type) {
@@ -12,7 +23,10 @@ void rt_gettype_free_all() {
 
         if (type->kind == RT_KIND_STRUCT) {
             free(type->u._struct.fields);
+        } else if (type->kind == RT_KIND_FUNC) {
+            free(type->u.func.params);
         }
+        free(type->gc_slots);
         free((char *)type->desc);
         free(type);
 
@@ -20,12 +34,103 @@ void rt_gettype_free_all() {
     }
 
     rt_types.types_all = NULL;
-    rt_types.types_simple = NULL;
-    rt_types.types_ptr = NULL;
-    rt_types.types_boxptr = NULL;
-    rt_types.types_weakptr = NULL;
-    rt_types.types_array = NULL;
-    rt_types.types_struct = NULL;
+    typetab_free(&typetab);
+}
+
+static u32 hash_combine(u32 hash, u32 value) {
+    return (hash ^ value) * 0x01000193;
+}
+
+/* only covers what is set before a type is interned. the flags of simple types
+   are filled in by rt_init afterwards, so only the weak flag is hashed */
+static u32 type_hash(struct rt_type *type) {
+    u32 hash = hash_combine(0x811c9dc5, type->kind);
+    hash = hash_combine(hash, (u32)type->size);
+    hash = hash_combine(hash, type->flags & RT_TYPE_FLAG_WEAK_PTR);
+    switch (type->kind) {
+    case RT_KIND_PTR:
+        hash = hash_combine(hash, hashutil_ptr_hash(type->u.ptr.target_type));
+        hash = hash_combine(hash, hashutil_ptr_hash(type->u.ptr.box_type));
+        hash = hash_combine(hash, (u32)type->u.ptr.box_offset);
+        break;
+    case RT_KIND_ARRAY:
+        hash = hash_combine(hash, hashutil_ptr_hash(type->u.array.elem_type));
+        break;
+    case RT_KIND_STRUCT:
+        hash = hash_combine(hash, type->u._struct.field_count);
+        for (u32 i = 0; i < type->u._struct.field_count; ++i) {
+            struct rt_struct_field *f = type->u._struct.fields + i;
+            hash = hash_combine(hash, hashutil_ptr_hash(f->type));
+            hash = hash_combine(hash, (u32)f->offset);
+        }
+        break;
+    case RT_KIND_FUNC:
+        hash = hash_combine(hash, hashutil_ptr_hash(type->u.func.return_type));
+        hash = hash_combine(hash, type->u.func.param_count);
+        for (u32 i = 0; i < type->u.func.param_count; ++i) {
+            struct rt_func_param *p = type->u.func.params + i;
+            hash = hash_combine(hash, hashutil_ptr_hash(p->type));
+            hash = hash_combine(hash, hashutil_ptr_hash(p->name));
+        }
+        break;
+    default:
+        break;
+    }
+    /* the multiplies only carry upwards, so mix the high bits into the low ones
+       used to index the table */
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    return hash;
+}
+
+static bool type_equals(struct rt_type *a, struct rt_type *b) {
+    if (a->kind != b->kind || a->size != b->size ||
+        (a->flags & RT_TYPE_FLAG_WEAK_PTR) != (b->flags & RT_TYPE_FLAG_WEAK_PTR)) {
+        return false;
+    }
+    switch (a->kind) {
+    case RT_KIND_PTR:
+        return a->u.ptr.target_type == b->u.ptr.target_type &&
+            a->u.ptr.box_type == b->u.ptr.box_type &&
+            a->u.ptr.box_offset == b->u.ptr.box_offset;
+    case RT_KIND_ARRAY:
+        return a->u.array.elem_type == b->u.array.elem_type;
+    case RT_KIND_STRUCT:
+        if (a->u._struct.field_count != b->u._struct.field_count) {
+            return false;
+        }
+        for (u32 i = 0; i < a->u._struct.field_count; ++i) {
+            struct rt_struct_field *f1 = a->u._struct.fields + i;
+            struct rt_struct_field *f2 = b->u._struct.fields + i;
+            if (f1->type != f2->type || strcmp(f1->name, f2->name) || f1->offset != f2->offset) {
+                return false;
+            }
+        }
+        return true;
+    case RT_KIND_FUNC:
+        if (a->u.func.return_type != b->u.func.return_type || a->u.func.param_count != b->u.func.param_count) {
+            return false;
+        }
+        for (u32 i = 0; i < a->u.func.param_count; ++i) {
+            struct rt_func_param *p1 = a->u.func.params + i;
+            struct rt_func_param *p2 = b->u.func.params + i;
+            if (p1->type != p2->type || p1->name != p2->name) {
+                return false;
+            }
+        }
+        return true;
+    default:
+        return true;
+    }
+}
+
+static struct rt_type *find_type(struct rt_type *probe) {
+    struct rt_type *existing;
+    if (typetab_get(&typetab, probe, &existing)) {
+        return existing;
+    }
+    return NULL;
 }
 
 static const char *copy_string(const char *str) {
@@ -102,67 +207,116 @@ static const char *type_to_string(struct rt_type *type) {
 }
 
 
-static struct rt_type *make_type(enum rt_kind kind, rt_size_t size, struct rt_type **list_head) {
+/* arrays with more slots than this are scanned by the GC element by element
+   instead of being flattened into the slot list of an enclosing struct */
+#define MAX_FLATTENED_ARRAY_SLOTS 16
+
+struct gc_slot_list {
+    u32 count;
+    u32 capacity;
+    struct rt_gc_slot *slots;
+};
+
+static void add_gc_slot(struct gc_slot_list *list, rt_size_t offset, struct rt_type *type) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 4;
+        list->slots = realloc(list->slots, sizeof(struct rt_gc_slot) * list->capacity);
+    }
+    list->slots[list->count].offset = offset;
+    list->slots[list->count].type = type;
+    ++list->count;
+}
+
+/* append the slots the GC has to scan in a value of the given type stored at offset */
+static void add_gc_slots(struct gc_slot_list *list, rt_size_t offset, struct rt_type *type) {
+    if (!(type->flags & RT_TYPE_FLAG_NEED_GC_MARK)) {
+        return;
+    }
+    switch (type->kind) {
+    case RT_KIND_STRUCT:
+        if (type->size) {
+            for (u32 i = 0; i < type->gc_slot_count; ++i) {
+                add_gc_slot(list, offset + type->gc_slots[i].offset, type->gc_slots[i].type);
+            }
+            return;
+        }
+        break;
+    case RT_KIND_ARRAY:
+        if (type->size) {
+            rt_size_t elem_size = type->u.array.elem_type->size;
+            rt_size_t length = type->size / elem_size;
+            if (length * type->gc_slot_count <= MAX_FLATTENED_ARRAY_SLOTS) {
+                for (rt_size_t e = 0; e < length; ++e) {
+                    for (u32 i = 0; i < type->gc_slot_count; ++i) {
+                        add_gc_slot(list, offset + e*elem_size + type->gc_slots[i].offset, type->gc_slots[i].type);
+                    }
+                }
+                return;
+            }
+        }
+        break;
+    default:
+        break;
+    }
+    add_gc_slot(list, offset, type);
+}
+
+/* copies the probe the type was looked up with. the copy is interned when
+   done with add_type, as fields and params still point to the caller's arrays */
+static struct rt_type *make_type(struct rt_type *probe) {
     struct rt_type *new_type = calloc(1, sizeof(struct rt_type));
-    new_type->kind = kind;
-    new_type->size = size;
+    *new_type = *probe;
 
-    new_type->next = *list_head;
-    *list_head = new_type;
-    
     new_type->all_list_next = rt_types.types_all;
     rt_types.types_all = new_type;
     
     return new_type;
 }
 
-struct rt_type *rt_gettype_simple(enum rt_kind kind, rt_size_t size) {
-    struct rt_type *existing = rt_types.types_simple;
-    while (existing) {
-        if (existing->kind == kind && existing->size == size) {
-            return existing;
-        }
-        existing = existing->next;
-    }
-    struct rt_type *new_type = make_type(kind, size, &rt_types.types_simple);
+static struct rt_type *add_type(struct rt_type *new_type) {
     new_type->desc = type_to_string(new_type);
+    typetab_put(&typetab, new_type, new_type);
     return new_type;
 }
 
+struct rt_type *rt_gettype_simple(enum rt_kind kind, rt_size_t size) {
+    struct rt_type probe = { kind, 0 };
+    probe.size = size;
+    struct rt_type *existing = find_type(&probe);
+    if (existing) {
+        return existing;
+    }
+    return add_type(make_type(&probe));
+}
+
 struct rt_type *rt_gettype_ptr(struct rt_type *target_type) {
-    struct rt_type *existing = rt_types.types_ptr;
-    while (existing) {
-        if (existing->u.ptr.target_type == target_type) {
-            return existing;
-        }
-        existing = existing->next;
+    struct rt_type probe = { RT_KIND_PTR, 0 };
+    probe.size = sizeof(void *);
+    probe.u.ptr.target_type = target_type;
+    struct rt_type *existing = find_type(&probe);
+    if (existing) {
+        return existing;
     }
-    struct rt_type *new_type = make_type(RT_KIND_PTR, sizeof(void *), &rt_types.types_ptr);
+    struct rt_type *new_type = make_type(&probe);
     if (target_type->flags & RT_TYPE_FLAG_NEED_GC_MARK) {
         new_type->flags |= RT_TYPE_FLAG_NEED_GC_MARK;
     }
-    new_type->u.ptr.target_type = target_type;
-    new_type->desc = type_to_string(new_type);
-    return new_type;
+    return add_type(new_type);
 }
 
 struct rt_type *rt_gettype_boxptr(struct rt_type *target_type, struct rt_type *box_type, rt_size_t box_offset) {
-    struct rt_type *existing = rt_types.types_boxptr;
-    while (existing) {
-        if (existing->u.ptr.target_type == target_type &&
-            existing->u.ptr.box_type == box_type &&
-            existing->u.ptr.box_offset == box_offset) {
-            return existing;
-        }
-        existing = existing->next;
+    struct rt_type probe = { RT_KIND_PTR, 0 };
+    probe.size = sizeof(void *);
+    probe.u.ptr.target_type = target_type;
+    probe.u.ptr.box_type = box_type;
+    probe.u.ptr.box_offset = box_offset;
+    struct rt_type *existing = find_type(&probe);
+    if (existing) {
+        return existing;
     }
-    struct rt_type *new_type = make_type(RT_KIND_PTR, sizeof(void *), &rt_types.types_boxptr);
+    struct rt_type *new_type = make_type(&probe);
     new_type->flags |= RT_TYPE_FLAG_NEED_GC_MARK; /* always need to mark the box */
-    new_type->u.ptr.target_type = target_type;
-    new_type->u.ptr.box_type = box_type;
-    new_type->u.ptr.box_offset = box_offset;
-    new_type->desc = type_to_string(new_type);
-    return new_type;
+    return add_type(new_type);
 }
 
 struct rt_type *rt_gettype_boxed(struct rt_type *target_type) {
@@ -175,22 +329,16 @@ struct rt_type *rt_gettype_weak(struct rt_type *ptr_type) {
     }
     assert(ptr_type->kind == RT_KIND_PTR);
     assert(ptr_type->u.ptr.box_type);
-    struct rt_type *existing = rt_types.types_weakptr;
-    while (existing) {
-        if (existing->u.ptr.target_type == ptr_type->u.ptr.target_type &&
-            existing->u.ptr.box_type == ptr_type->u.ptr.box_type &&
-            existing->u.ptr.box_offset == ptr_type->u.ptr.box_offset) {
-            return existing;
-        }
-        existing = existing->next;
+    struct rt_type probe = { RT_KIND_PTR, RT_TYPE_FLAG_WEAK_PTR | RT_TYPE_FLAG_NEED_GC_MARK };
+    probe.size = sizeof(void *);
+    probe.u.ptr.target_type = ptr_type->u.ptr.target_type;
+    probe.u.ptr.box_type = ptr_type->u.ptr.box_type;
+    probe.u.ptr.box_offset = ptr_type->u.ptr.box_offset;
+    struct rt_type *existing = find_type(&probe);
+    if (existing) {
+        return existing;
     }
-    struct rt_type *new_type = make_type(RT_KIND_PTR, sizeof(void *), &rt_types.types_weakptr);
-    new_type->flags |= RT_TYPE_FLAG_WEAK_PTR | RT_TYPE_FLAG_NEED_GC_MARK;
-    new_type->u.ptr.target_type = ptr_type->u.ptr.target_type;
-    new_type->u.ptr.box_type = ptr_type->u.ptr.box_type;
-    new_type->u.ptr.box_offset = ptr_type->u.ptr.box_offset;
-    new_type->desc = type_to_string(new_type);
-    return new_type;
+    return add_type(make_type(&probe));
 }
 
 struct rt_type *rt_gettype_weak_boxed(struct rt_type *target_type) {
@@ -199,21 +347,22 @@ struct rt_type *rt_gettype_weak_boxed(struct rt_type *target_type) {
 
 struct rt_type *rt_gettype_array(struct rt_type *elem_type, rt_size_t length) {
     assert(elem_type->size);
-    rt_size_t size = length ? elem_type->size*length : 0;
-    struct rt_type *existing = rt_types.types_array;
-    while (existing) {
-        if (existing->size == size && existing->u.array.elem_type == elem_type) {
-            return existing;
-        }
-        existing = existing->next;
+    struct rt_type probe = { RT_KIND_ARRAY, 0 };
+    probe.size = length ? elem_type->size*length : 0;
+    probe.u.array.elem_type = elem_type;
+    struct rt_type *existing = find_type(&probe);
+    if (existing) {
+        return existing;
     }
-    struct rt_type *new_type = make_type(RT_KIND_ARRAY, size, &rt_types.types_array);
+    struct rt_type *new_type = make_type(&probe);
     if (elem_type->flags & RT_TYPE_FLAG_NEED_GC_MARK) {
         new_type->flags |= RT_TYPE_FLAG_NEED_GC_MARK;
+        struct gc_slot_list list = { 0, 0, NULL };
+        add_gc_slots(&list, 0, elem_type);
+        new_type->gc_slot_count = list.count;
+        new_type->gc_slots = list.slots;
     }
-    new_type->u.array.elem_type = elem_type;
-    new_type->desc = type_to_string(new_type);
-    return new_type;
+    return add_type(new_type);
 }
 
 struct rt_type *rt_gettype_boxed_array(struct rt_type *elem_type, rt_size_t length) {
@@ -221,23 +370,13 @@ struct rt_type *rt_gettype_boxed_array(struct rt_type *elem_type, rt_size_t leng
 }
 
 struct rt_type *rt_gettype_struct(const char *name, rt_size_t size, u32 field_count, struct rt_struct_field *fields) {
-    struct rt_type *existing = rt_types.types_struct;
-    while (existing) {
-        if (existing->size == size && existing->u._struct.field_count == field_count) {
-            bool fields_same = true;
-            for (u32 i = 0; i < field_count; ++i) {
-                struct rt_struct_field *f1 = existing->u._struct.fields + i;
-                struct rt_struct_field *f2 = fields + i;
-                if (f1->type != f2->type || strcmp(f1->name, f2->name) || f1->offset != f2->offset) {
-                    fields_same = false;
-                    break;
-                }
-            }
-            if (fields_same) {
-                return existing;
-            }
-        }
-        existing = existing->next;
+    struct rt_type probe = { RT_KIND_STRUCT, 0 };
+    probe.size = size;
+    probe.u._struct.field_count = field_count;
+    probe.u._struct.fields = fields;
+    struct rt_type *existing = find_type(&probe);
+    if (existing) {
+        return existing;
     }
     bool need_gc_mark = false;
     for (u32 i = 0; i < field_count; ++i) {
@@ -265,35 +404,32 @@ struct rt_type *rt_gettype_struct(const char *name, rt_size_t size, u32 field_co
     struct rt_struct_field *new_fields = malloc(sizeof(struct rt_struct_field) * field_count);
     memcpy(new_fields, fields, sizeof(struct rt_struct_field) * field_count);
 
-    struct rt_type *new_type = make_type(RT_KIND_STRUCT, size, &rt_types.types_struct);
+    struct rt_type *new_type = make_type(&probe);
     if (need_gc_mark) {
         new_type->flags |= RT_TYPE_FLAG_NEED_GC_MARK;
     }
     new_type->u._struct.name = name; /* TODO: copy? */
-    new_type->u._struct.field_count = field_count;
     new_type->u._struct.fields = new_fields;
-    new_type->desc = type_to_string(new_type);
-    return new_type;
+    if (need_gc_mark) {
+        struct gc_slot_list list = { 0, 0, NULL };
+        for (u32 i = 0; i < field_count; ++i) {
+            add_gc_slots(&list, fields[i].offset, fields[i].type);
+        }
+        new_type->gc_slot_count = list.count;
+        new_type->gc_slots = list.slots;
+    }
+    return add_type(new_type);
 }
 
 struct rt_type *rt_gettype_func(struct rt_type *return_type, u32 param_count, struct rt_func_param *params) {
-    struct rt_type *existing = rt_types.types_func;
-    while (existing) {
-        if (existing->u.func.return_type == return_type && existing->u.func.param_count == param_count) {
-            bool same_params = true;
-            for (u32 i = 0; i < param_count; ++i) {
-                struct rt_func_param *p1 = existing->u.func.params + i;
-                struct rt_func_param *p2 = params + i;
-                if (p1->type != p2->type || p1->name != p2->name) {
-                    same_params = false;
-                    break;
-                }
-            }
-            if (same_params) {
-                return existing;
-            }
-        }
-        existing = existing->next;
+    struct rt_type probe = { RT_KIND_FUNC, 0 };
+    probe.size = sizeof(struct rt_func);
+    probe.u.func.return_type = return_type;
+    probe.u.func.param_count = param_count;
+    probe.u.func.params = params;
+    struct rt_type *existing = find_type(&probe);
+    if (existing) {
+        return existing;
     }
 #ifndef NDEBUG
     for (u32 i = 0; i < param_count; ++i) {
@@ -304,10 +440,7 @@ struct rt_type *rt_gettype_func(struct rt_type *return_type, u32 param_count, st
     struct rt_func_param *new_params = malloc(sizeof(struct rt_func_param) * param_count);
     memcpy(new_params, params, sizeof(struct rt_func_param) * param_count);
 
-    struct rt_type *new_type = make_type(RT_KIND_FUNC, sizeof(struct rt_func), &rt_types.types_func);
-    new_type->u.func.return_type = return_type;
-    new_type->u.func.param_count = param_count;
+    struct rt_type *new_type = make_type(&probe);
     new_type->u.func.params = new_params;
-    new_type->desc = type_to_string(new_type);
-    return new_type;
-}
\ No newline at end of file
+    return add_type(new_type);
+}
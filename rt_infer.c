@@ -0,0 +1,237 @@
+#include "rt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+/* a single pass over the AST setting the result type of every node. types
+   come from literals and parameter ascriptions. a global may be redefined
+   with a value of another type, so global reads are any, except for callees,
+   which are checked at run time to have the type of the current value.
+   whatever can not be proven is left as any, for the run time checks.
+   declared types are only relied on once proven, so where a value is not
+   proven to have the type declared for it a check is made at run time.
+
+   calls of functions whose parameter types are matched by the argument types
+   are marked as checked, and calls of arithmetic and comparison primops on
+   two i64 values become i64 op nodes */
+
+struct infer_state {
+    struct rt_module *mod;
+    /* innermost scope of the function being inferred, as in the parser */
+    struct rt_astnode *scope;
+};
+
+static void infer_error(struct rt_astnode *node, const char *fmt, ...) {
+    printf("line %d, col %d: ", node->sourceloc.line + 1, node->sourceloc.col + 1);
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    printf("\n");
+    exit(1);
+}
+
+static struct rt_scope_var *find_local_var(struct infer_state *state, u32 stack_index) {
+    for (struct rt_astnode *scope = state->scope; scope; scope = scope->parent_scope) {
+        u32 var_count = scope->u.scope.var_count;
+        if (stack_index <= var_count) {
+            return scope->u.scope.vars + var_count - stack_index;
+        }
+        stack_index -= var_count;
+    }
+    assert(!"local outside of the scopes of the function");
+    return NULL;
+}
+
+/* the function type of a callee, if proven */
+static struct rt_type *callee_func_type(struct rt_astnode *func_expr) {
+    struct rt_type *type = func_expr->result_type;
+    if (type->kind != RT_KIND_PTR || type->u.ptr.target_type->kind != RT_KIND_FUNC) {
+        return NULL;
+    }
+    return type->u.ptr.target_type;
+}
+
+static void infer_expr(struct infer_state *state, struct rt_astnode *node);
+
+/* the node is turned into the check in place, so whatever refers to it gets
+   the check, and the original node is moved below it */
+static void insert_check(struct infer_state *state, struct rt_astnode *node, struct rt_type *type) {
+    struct rt_astnode *expr = rt_arena_alloc(&state->mod->ast_arena, sizeof(struct rt_astnode));
+    *expr = *node;
+    if (expr->node_type == RT_ASTNODE_CALL) {
+        /* the check runs after the call returns */
+        expr->u.call.tail = false;
+    }
+    node->node_type = RT_ASTNODE_CHECK_TYPE;
+    node->result_type = type;
+    node->is_const = false;
+    node->u.check_type.expr = expr;
+}
+
+/* check the value of a function body against the declared return type. the
+   checks go down into the branches, so those proven to be of the type, and
+   their tail calls, are left as they are */
+static void check_result(struct infer_state *state, struct rt_astnode *node, struct rt_type *type) {
+    if (node->result_type == type) {
+        return;
+    }
+    switch (node->node_type) {
+    case RT_ASTNODE_SCOPE:
+        check_result(state, node->u.scope.expr, type);
+        break;
+    case RT_ASTNODE_BLOCK:
+        if (!node->u.block.expr_count) {
+            insert_check(state, node, type);
+            return;
+        }
+        check_result(state, node->u.block.exprs[node->u.block.expr_count - 1], type);
+        break;
+    case RT_ASTNODE_COND:
+        check_result(state, node->u.cond.then_expr, type);
+        check_result(state, node->u.cond.else_expr, type);
+        break;
+    default:
+        insert_check(state, node, type);
+        return;
+    }
+    node->result_type = type;
+}
+
+static void infer_func(struct infer_state *state, struct rt_astnode *node) {
+    struct rt_func *func = node->const_value.u.func;
+    if (func->native) {
+        return;
+    }
+    struct rt_astnode *outer_scope = state->scope;
+    state->scope = NULL;
+    infer_expr(state, func->body_expr);
+    state->scope = outer_scope;
+
+    /* callers rely on the return type, so where it is not proven it is checked */
+    struct rt_type *return_type = rt_any_func_type(node->const_value)->u.func.return_type;
+    struct rt_type *body_type = func->body_expr->result_type;
+    if (return_type != rt_types.any && body_type != return_type) {
+        if (body_type != rt_types.any) {
+            infer_error(node, "function body is a %s, not the declared %s", body_type->desc, return_type->desc);
+        }
+        check_result(state, func->body_expr, return_type);
+    }
+}
+
+static void infer_call(struct infer_state *state, struct rt_astnode *node) {
+    struct rt_astnode *func_expr = node->u.call.func_expr;
+    u32 arg_count = node->u.call.arg_count;
+    infer_expr(state, func_expr);
+    for (u32 i = 0; i < arg_count; ++i) {
+        infer_expr(state, node->u.call.arg_exprs[i]);
+    }
+
+    /* a function global is most likely redefined with the same type, so the
+       one check of the callee saves checking the arguments, and proves the
+       result type */
+    if (func_expr->node_type == RT_ASTNODE_GET_GLOBAL) {
+        struct rt_global *global = state->mod->globals + func_expr->u.get_global.index;
+        if (global->defined && rt_any_is_func(global->value)) {
+            insert_check(state, func_expr, rt_any_get_type(global->value));
+        }
+    }
+
+    struct rt_type *func_type = callee_func_type(func_expr);
+    if (!func_type || func_type->u.func.param_count != arg_count) {
+        return;
+    }
+    for (u32 i = 0; i < arg_count; ++i) {
+        struct rt_type *param_type = func_type->u.func.params[i].type;
+        if (param_type != rt_types.any && node->u.call.arg_exprs[i]->result_type != param_type) {
+            return;
+        }
+    }
+    node->u.call.checked = true;
+    node->result_type = func_type->u.func.return_type;
+
+    enum rt_i64_op op;
+    if (arg_count == 2 && func_expr->node_type == RT_ASTNODE_LITERAL &&
+        rt_primop_i64_op(func_expr->const_value.u.func, &op) &&
+        node->u.call.arg_exprs[0]->result_type == rt_types.i64 &&
+        node->u.call.arg_exprs[1]->result_type == rt_types.i64) {
+        struct rt_astnode *lhs = node->u.call.arg_exprs[0];
+        struct rt_astnode *rhs = node->u.call.arg_exprs[1];
+        node->node_type = RT_ASTNODE_I64_OP;
+        node->u.i64_op.op = op;
+        node->u.i64_op.lhs = lhs;
+        node->u.i64_op.rhs = rhs;
+        node->result_type = op == RT_I64_ADD || op == RT_I64_SUB || op == RT_I64_MUL ? rt_types.i64 : rt_types._bool;
+    }
+}
+
+static void infer_expr(struct infer_state *state, struct rt_astnode *node) {
+    switch (node->node_type) {
+    case RT_ASTNODE_LITERAL:
+        if (rt_any_is_func(node->const_value)) {
+            infer_func(state, node);
+        }
+        break;
+    case RT_ASTNODE_SCOPE:
+        node->parent_scope = state->scope;
+        state->scope = node;
+        infer_expr(state, node->u.scope.expr);
+        state->scope = node->parent_scope;
+        node->result_type = node->u.scope.expr->result_type;
+        break;
+    case RT_ASTNODE_BLOCK:
+        node->result_type = rt_types.nil;
+        for (u32 i = 0; i < node->u.block.expr_count; ++i) {
+            infer_expr(state, node->u.block.exprs[i]);
+            node->result_type = node->u.block.exprs[i]->result_type;
+        }
+        break;
+    case RT_ASTNODE_GET_GLOBAL:
+        /* see infer_call */
+        break;
+    case RT_ASTNODE_GET_LOCAL:
+        node->result_type = find_local_var(state, node->u.get_local.stack_index)->type;
+        break;
+    case RT_ASTNODE_SET_LOCAL: {
+        struct rt_scope_var *var = find_local_var(state, node->u.set_local.stack_index);
+        infer_expr(state, node->u.set_local.expr);
+        node->result_type = node->u.set_local.expr->result_type;
+        /* reads of the variable rely on its type, so where it is not proven it is checked */
+        if (var->type != rt_types.any && node->result_type != var->type) {
+            if (node->result_type != rt_types.any) {
+                infer_error(node, "can not set '%s' of type %s to a %s",
+                            var->name->data, var->type->desc, node->result_type->desc);
+            }
+            insert_check(state, node->u.set_local.expr, var->type);
+            node->result_type = var->type;
+        }
+        break;
+    }
+    case RT_ASTNODE_COND: {
+        infer_expr(state, node->u.cond.pred_expr);
+        infer_expr(state, node->u.cond.then_expr);
+        infer_expr(state, node->u.cond.else_expr);
+        struct rt_type *then_type = node->u.cond.then_expr->result_type;
+        node->result_type = then_type == node->u.cond.else_expr->result_type ? then_type : rt_types.any;
+        break;
+    }
+    case RT_ASTNODE_LOOP:
+        /* nil when the body never runs */
+        infer_expr(state, node->u.loop.pred_expr);
+        infer_expr(state, node->u.loop.body_expr);
+        break;
+    case RT_ASTNODE_CALL:
+        infer_call(state, node);
+        break;
+    case RT_ASTNODE_I64_OP:
+    case RT_ASTNODE_CHECK_TYPE:
+        /* only made by this pass */
+        break;
+    }
+}
+
+void rt_infer_types(struct rt_module *mod, struct rt_astnode *node) {
+    struct infer_state state = { mod, NULL };
+    infer_expr(&state, node);
+}
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
 
 
 #define SAVED_CONS _saved_cons
@@ -15,7 +16,7 @@
 
 #define UNEXPECTED(...) \
     do { \
-        parse_error(LOC, __VA_ARGS__); \
+        parse_error(state, LOC, __VA_ARGS__); \
         return NULL; \
     } while (0);
 
@@ -52,7 +53,7 @@
 
 #define EXPECT_U64(VarName, ...) \
     do { \
-        struct rt_any _temp = rt_any_to_unsigned(CAR); \
+        struct rt_any _temp = rt_any_to_unsigned(state->task, CAR); \
         EXPECT(rt_any_is_unsigned(_temp), __VA_ARGS__) \
         (VarName) = rt_any_to_u64(_temp); \
     } while (0);
@@ -73,10 +74,17 @@
 struct parse_state {
     struct rt_task *task;
     struct rt_module *mod;
-    struct rt_sourceloc loc, loc_after;
+    /* the offset of the car of the current cons in the input, from the sourcemap */
+    u32 loc;
+
+    /* innermost scope of the function being parsed. the scope chain ends at
+       the function's parameters, as functions can not refer to the locals of
+       the functions they are nested in */
+    struct rt_astnode *scope;
 };
 
-static void parse_error(struct rt_sourceloc loc, const char *fmt, ...) {
+static void parse_error(struct parse_state *state, u32 offset, const char *fmt, ...) {
+    struct rt_sourceloc loc = rt_module_sourceloc(state->mod, offset);
     printf("line %d, col %d: ", loc.line + 1, loc.col + 1);
     va_list args;
     va_start(args, fmt);
@@ -91,32 +99,32 @@ static void update_loc(struct parse_state *state, struct rt_any cons) {
         return;
     }
     assert(rt_any_is_cons(cons));
-    struct rt_module *mod = state->mod;
-    if (mod) {
-        rt_sourcemap_get(&mod->location_before_car, cons.u.cons, &state->loc);
-        rt_sourcemap_get(&mod->location_after_car, cons.u.cons, &state->loc_after);
-    }
+    rt_module_find_location(state->mod, cons.u.cons, &state->loc);
 }
 
-static struct rt_astnode *make_ast(struct parse_state *state, struct rt_sourceloc loc, enum rt_astnode_type node_type) {
-    struct rt_astnode *node = calloc(1, sizeof(struct rt_astnode));
+/* lines are only looked up for the nodes made, not for every step */
+static struct rt_astnode *make_ast(struct parse_state *state, u32 loc, enum rt_astnode_type node_type) {
+    struct rt_astnode *node = rt_arena_alloc(&state->mod->ast_arena, sizeof(struct rt_astnode));
     node->result_type = rt_types.any;
     node->node_type = node_type;
-    node->sourceloc = loc;
+    node->sourceloc = rt_module_sourceloc(state->mod, loc);
     return node;
 }
 
-static struct rt_astnode *make_literal(struct parse_state *state, struct rt_sourceloc loc, struct rt_any value) {
+static struct rt_astnode *make_literal(struct parse_state *state, u32 loc, struct rt_any value) {
     struct rt_astnode *node = make_ast(state, loc, RT_ASTNODE_LITERAL);
     node->result_type = rt_any_get_type(value);
     node->is_const = true;
     node->const_value = value;
+    rt_module_add_literal(state->mod, value);
     return node;
 }
 
 static struct rt_astnode *make_block(struct parse_state *state, u32 expr_count, struct rt_astnode **exprs) {
-    struct rt_astnode **new_exprs = malloc(sizeof(struct rt_astnode *) * expr_count);
-    memcpy(new_exprs, exprs, sizeof(struct rt_astnode *) * expr_count);
+    struct rt_astnode **new_exprs = rt_arena_alloc(&state->mod->ast_arena, sizeof(struct rt_astnode *) * expr_count);
+    if (expr_count) {
+        memcpy(new_exprs, exprs, sizeof(struct rt_astnode *) * expr_count);
+    }
     struct rt_astnode *block = make_ast(state, LOC, RT_ASTNODE_BLOCK);
     block->u.block.expr_count = expr_count;
     block->u.block.exprs = new_exprs;
@@ -172,6 +180,7 @@ static void *parse_param_list(struct parse_state *state, struct rt_any list_head
             param->type = rt_types.any;
             EXPECT_ANY_SYM(param->name, "expected a parameter name") STEP()
         }
+        EXPECT(++i < MAX_PARAMS, "too many parameters")
     }
     *param_count = i;
     return params; /* just returned to distinguish success from failure (NULL) */
@@ -185,13 +194,77 @@ static struct rt_astnode *parse_block(struct parse_state *state, struct rt_any f
     u32 expr_count = 0;
     while (!END_OF_LIST) {
         struct rt_astnode *expr = NULL;
-        EXPECT(expr = parse_expression(state, CAR), "expected 'else' expression for if form") STEP()
+        EXPECT(expr_count < 1000, "too many expressions in block")
+        EXPECT(expr = parse_expression(state, CAR), "expected an expression") STEP()
         exprs[expr_count++] = expr;
     }
     return make_block(state, expr_count, exprs);
 }
 
+/* finds a local in the scopes of the current function. the stack index counts
+   back from the end of the innermost scope */
+static bool find_local(struct parse_state *state, struct rt_symbol *name, u32 *stack_index) {
+    u32 scopes_size = 0;
+    for (struct rt_astnode *scope = state->scope; scope; scope = scope->parent_scope) {
+        u32 var_count = scope->u.scope.var_count;
+        for (u32 i = var_count; i-- > 0; ) {
+            if (scope->u.scope.vars[i].name == name) {
+                *stack_index = scopes_size + var_count - i;
+                return true;
+            }
+        }
+        scopes_size += var_count;
+    }
+    return false;
+}
+
+static struct rt_astnode *parse_symbol(struct parse_state *state, struct rt_symbol *name) {
+    u32 stack_index;
+    if (find_local(state, name, &stack_index)) {
+        struct rt_astnode *node = make_ast(state, LOC, RT_ASTNODE_GET_LOCAL);
+        node->u.get_local.name = name;
+        node->u.get_local.stack_index = stack_index;
+        return node;
+    }
+    struct rt_any primop = rt_lookup_primop(name);
+    if (!rt_any_is_nil(primop)) {
+        return make_literal(state, LOC, primop);
+    }
+    /* globals may be defined after the functions using them, so this may add
+       an undefined one, which the def form fills in later */
+    struct rt_astnode *node = make_ast(state, LOC, RT_ASTNODE_GET_GLOBAL);
+    node->u.get_global.name = name;
+    node->u.get_global.index = rt_module_global_index(state->mod, name);
+    return node;
+}
+
+/* marks the calls whose value is that of the function body they are in.
+   scopes pop their variables after the expression, so do not pass it on */
+static void mark_tail_calls(struct rt_astnode *node) {
+    switch (node->node_type) {
+    case RT_ASTNODE_CALL:
+        node->u.call.tail = true;
+        break;
+    case RT_ASTNODE_BLOCK:
+        if (node->u.block.expr_count) {
+            mark_tail_calls(node->u.block.exprs[node->u.block.expr_count - 1]);
+        }
+        break;
+    case RT_ASTNODE_COND:
+        mark_tail_calls(node->u.cond.then_expr);
+        mark_tail_calls(node->u.cond.else_expr);
+        break;
+    default:
+        break;
+    }
+}
+
+#define MAX_ARGS 100
+
 static struct rt_astnode *parse_expression(struct parse_state *state, struct rt_any form) {
+    if (rt_any_is_symbol(form)) {
+        return parse_symbol(state, form.u.symbol);
+    }
     if (!rt_any_is_cons(form)) {
         return make_literal(state, LOC, form);
     }
@@ -206,16 +279,46 @@ static struct rt_astnode *parse_expression(struct parse_state *state, struct rt_
             struct rt_astnode *body_expr;
             
             STEP()
-            EXPECT_PUSH_LIST("expected parameter list for fn form")
-            if (MATCHES_SYM(ascribe)) {
+            if (rt_any_is_nil(CAR)) {
+                /* no parameters */
                 STEP()
-                EXPECT(parse_param_list(state, CAR, params, &param_count), "expected valid parameter list") STEP()
-                EXPECT(return_type = parse_type(state, CAR), "expected a valid return type") STEP()
             } else {
-                EXPECT(parse_param_list(state, CONS, params, &param_count), "expected valid parameter list") STEP()
+                EXPECT_PUSH_LIST("expected parameter list for fn form")
+                if (MATCHES_SYM(ascribe)) {
+                    STEP()
+                    if (!rt_any_is_nil(CAR)) {
+                        EXPECT(parse_param_list(state, CAR, params, &param_count), "expected valid parameter list")
+                    }
+                    STEP()
+                    EXPECT(return_type = parse_type(state, CAR), "expected a valid return type") STEP()
+                } else {
+                    EXPECT(parse_param_list(state, CONS, params, &param_count), "expected valid parameter list")
+                    CONS = rt_nil;
+                }
+                EXPECT_POP_LIST("expected end of parameter list") STEP()
+            }
+
+            /* the parameters are the variables of the outermost scope of the body */
+            struct rt_astnode *scope = NULL;
+            if (param_count) {
+                scope = make_ast(state, LOC, RT_ASTNODE_SCOPE);
+                scope->u.scope.var_count = param_count;
+                scope->u.scope.vars = rt_arena_alloc(&state->mod->ast_arena, sizeof(struct rt_scope_var) * param_count);
+                for (u32 i = 0; i < param_count; ++i) {
+                    scope->u.scope.vars[i].type = params[i].type;
+                    scope->u.scope.vars[i].name = params[i].name;
+                }
+            }
+            struct rt_astnode *outer_scope = state->scope;
+            state->scope = scope;
+            body_expr = parse_block(state, CONS);
+            state->scope = outer_scope;
+            EXPECT(body_expr, "expected function body")
+            mark_tail_calls(body_expr);
+            if (scope) {
+                scope->u.scope.expr = body_expr;
+                body_expr = scope;
             }
-            EXPECT_POP_LIST("expected end of parameter list") STEP()
-            EXPECT(body_expr = parse_block(state, CONS), "expected function body")
 
             if (!return_type) {
                 return_type = rt_types.any;
@@ -224,7 +327,7 @@ static struct rt_astnode *parse_expression(struct parse_state *state, struct rt_
             struct rt_type *func_type = rt_gettype_boxed(rt_gettype_func(return_type, param_count, params));
             struct rt_func *func_ptr = rt_gc_alloc(state->task, sizeof(struct rt_func));
             func_ptr->body_expr = body_expr;
-            struct rt_any func = { func_type, { .func = func_ptr } };
+            struct rt_any func = rt_any_from_ptr(func_type, func_ptr);
             return make_literal(state, LOC, func);
         }
 
@@ -242,12 +345,74 @@ static struct rt_astnode *parse_expression(struct parse_state *state, struct rt_
             result->u.cond.else_expr = else_expr;
             return result;
         }
+
+        if (head_sym == rt_symbols._while.u.symbol) {
+            u32 loc = LOC;
+            struct rt_astnode *pred_expr, *body_expr;
+
+            STEP()
+            EXPECT(pred_expr = parse_expression(state, CAR), "expected predicate expression for while form") STEP()
+            EXPECT(body_expr = parse_block(state, CONS), "expected body for while form")
+
+            struct rt_astnode *result = make_ast(state, loc, RT_ASTNODE_LOOP);
+            result->u.loop.pred_expr = pred_expr;
+            result->u.loop.body_expr = body_expr;
+            return result;
+        }
+
+        if (head_sym == rt_symbols._do.u.symbol) {
+            STEP()
+            if (END_OF_LIST) {
+                return make_block(state, 0, NULL);
+            }
+            return parse_block(state, CONS);
+        }
+
+        if (head_sym == rt_symbols.set.u.symbol) {
+            u32 loc = LOC;
+            struct rt_symbol *name;
+            struct rt_astnode *expr;
+            u32 stack_index;
+
+            STEP()
+            EXPECT_ANY_SYM(name, "expected variable name for set form")
+            EXPECT(find_local(state, name, &stack_index), "can only set local variables") STEP()
+            EXPECT(expr = parse_expression(state, CAR), "expected value for set form") STEP()
+            EXPECT(END_OF_LIST, "expected end of set form")
+
+            struct rt_astnode *result = make_ast(state, loc, RT_ASTNODE_SET_LOCAL);
+            result->u.set_local.name = name;
+            result->u.set_local.stack_index = stack_index;
+            result->u.set_local.expr = expr;
+            return result;
+        }
     }
 
-    return NULL;
+    /* anything else is a call */
+    u32 loc = LOC;
+    struct rt_astnode *func_expr;
+    struct rt_astnode *arg_exprs[MAX_ARGS];
+    u32 arg_count = 0;
+
+    EXPECT(func_expr = parse_expression(state, CAR), "expected function expression") STEP()
+    while (!END_OF_LIST) {
+        EXPECT(arg_count < MAX_ARGS, "too many arguments")
+        EXPECT(arg_exprs[arg_count] = parse_expression(state, CAR), "expected argument expression") STEP()
+        ++arg_count;
+    }
+
+    struct rt_astnode *result = make_ast(state, loc, RT_ASTNODE_CALL);
+    result->u.call.func_expr = func_expr;
+    result->u.call.arg_count = arg_count;
+    result->u.call.arg_exprs = rt_arena_alloc(&state->mod->ast_arena, sizeof(struct rt_astnode *) * arg_count);
+    if (arg_count) {
+        memcpy(result->u.call.arg_exprs, arg_exprs, sizeof(struct rt_astnode *) * arg_count);
+    }
+    return result;
 }
 
 struct rt_astnode *rt_parse_module(struct rt_task *task, struct rt_any toplevel_module_list) {
+    assert(task->current_module);
     struct parse_state state_val = {0,};
     state_val.task = task;
     state_val.mod = task->current_module;
@@ -258,7 +423,12 @@ struct rt_astnode *rt_parse_module(struct rt_task *task, struct rt_any toplevel_
     struct rt_astnode *expr;
 
     struct rt_astnode *exprs[1000];
+    /* the global each expression is the value of */
+    u32 def_indices[1000];
     u32 expr_count = 0;
+    /* globals with a redefined global folded into their code */
+    u32 refold_indices[1000];
+    u32 refold_count = 0;
 
     BEGIN_PARSE(toplevel_module_list)
     while (!END_OF_LIST) {
@@ -267,7 +437,29 @@ struct rt_astnode *rt_parse_module(struct rt_task *task, struct rt_any toplevel_
 
         if (form_sym == rt_symbols.def.u.symbol) {
             EXPECT_ANY_SYM(name_sym, "expected name for def form") STEP()
-            EXPECT(expr = parse_expression(state, CAR), "expected value for def form") STEP()
+            struct rt_any form = CAR;
+            EXPECT(expr = parse_expression(state, form), "expected value for def form") STEP()
+            EXPECT(expr->is_const, "expected a constant value for def form")
+            EXPECT(expr_count < 1000, "too many top-level forms")
+            u32 index = rt_module_global_index(state->mod, name_sym);
+            struct rt_global *global = state->mod->globals + index;
+            /* code with the old value folded in is parsed again, once all the defs are in */
+            for (u32 i = 0; i < global->dependent_count; ++i) {
+                u32 j = 0;
+                while (j < refold_count && refold_indices[j] != global->dependents[i]) {
+                    ++j;
+                }
+                if (j == refold_count) {
+                    EXPECT(refold_count < 1000, "too many definitions to fold again")
+                    refold_indices[refold_count++] = global->dependents[i];
+                }
+            }
+            global->dependent_count = 0;
+            global->value = expr->const_value;
+            global->defined = true;
+            global->form = form;
+            rt_symbolmap_put(&state->mod->symbolmap, name_sym, expr);
+            def_indices[expr_count] = index;
             exprs[expr_count++] = expr;
         } else {
             UNEXPECTED("unexpected top-level form: %s", form_sym->data)
@@ -276,5 +468,35 @@ struct rt_astnode *rt_parse_module(struct rt_task *task, struct rt_any toplevel_
         EXPECT_POP_LIST("expected end of def form") STEP()
     }
 
-    return make_block(state, expr_count, exprs);
+    /* the defs of this load have been parsed anew already. the others are parsed
+       from their kept forms, and the new bodies replace those of the functions
+       already in the globals, which are then folded as if they were defs */
+    u32 def_count = expr_count;
+    for (u32 i = 0; i < refold_count; ++i) {
+        u32 index = refold_indices[i];
+        u32 j = 0;
+        while (j < def_count && def_indices[j] != index) {
+            ++j;
+        }
+        if (j < def_count || rt_any_is_nil(state->mod->globals[index].form)) {
+            continue;
+        }
+        EXPECT(expr = parse_expression(state, state->mod->globals[index].form), "expected value for def form")
+        EXPECT(expr_count < 1000, "too many top-level forms")
+        struct rt_global *global = state->mod->globals + index;
+        struct rt_func *func = global->value.u.func;
+        func->body_expr = expr->const_value.u.func->body_expr;
+        func->code = NULL;
+        func->flat = NULL;
+        expr->const_value = global->value;
+        rt_symbolmap_put(&state->mod->symbolmap, global->name, expr);
+        def_indices[expr_count] = index;
+        exprs[expr_count++] = expr;
+    }
+
+    /* after all the defs, as functions may refer to globals defined later */
+    struct rt_astnode *block = make_block(state, expr_count, exprs);
+    rt_fold_constants(state->task, block, def_indices);
+    rt_infer_types(state->mod, block);
+    return block;
 }
@@ -1,99 +1,106 @@
 #include "rt.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 struct rt_any rt_weak_any(struct rt_any any) {
     struct rt_type *type = rt_any_get_type(any);
     if (type->kind != RT_KIND_PTR) {
         return any;
     }
+#ifdef RT_COMPACT_ANY
+    /* the type stays in the box header, the tag tells the pointer is weak.
+       only boxes can be collected, so other pointers are left strong */
+    if (type->u.ptr.box_type) {
+        any.u.data |= (uintptr_t)RT_ANY_TAG_WEAK << 48;
+    }
+    return any;
+#else
     return rt_any_from_ptr(rt_gettype_weak(type), any.u.ptr);
+#endif
 }
 
 bool rt_any_to_bool(struct rt_any a) {
     assert(rt_any_is_bool(a));
-    return a.u._bool;
+    return rt_any_value(a)._bool;
 }
 
 f64 rt_any_to_f64(struct rt_any a) {
     struct rt_type *type = rt_any_get_type(a);
     assert(type->kind == RT_KIND_REAL);
+    union rt_value v = rt_any_value(a);
     if (type->size == 4) {
-        return a.u.f32;
+        return v.f32;
     }
-    return a.u.f64;
+    return v.f64;
 }
 
 u64 rt_any_to_u64(struct rt_any a) {
     struct rt_type *type = rt_any_get_type(a);
     assert(type->kind == RT_KIND_UNSIGNED);
+    union rt_value v = rt_any_value(a);
     switch (type->size) {
-    case 1: return a.u.u8;
-    case 2: return a.u.u16;
-    case 4: return a.u.u32;
+    case 1: return v.u8;
+    case 2: return v.u16;
+    case 4: return v.u32;
     default:
-    case 8: return a.u.u64;
+    case 8: return v.u64;
     }
 }
 
 i64 rt_any_to_i64(struct rt_any a) {
     struct rt_type *type = rt_any_get_type(a);
     assert(type->kind == RT_KIND_SIGNED);
+    union rt_value v = rt_any_value(a);
     switch (type->size) {
-    case 1: return a.u.i8;
-    case 2: return a.u.i16;
-    case 4: return a.u.i32;
+    case 1: return v.i8;
+    case 2: return v.i16;
+    case 4: return v.i32;
     default:
-    case 8: return a.u.i64;
+    case 8: return v.i64;
     }
 }
 
-struct rt_any rt_any_to_signed(struct rt_any a) {
+struct rt_any rt_any_to_signed(struct rt_task *task, struct rt_any a) {
     if (rt_any_is_unsigned(a)) {
         u64 uval = rt_any_to_u64(a);
         if (uval < INT64_MAX) {
-            return rt_new_i64((i64)uval);
+            return rt_new_i64(task, (i64)uval);
         }
     }
     return a;
 }
 
-struct rt_any rt_any_to_unsigned(struct rt_any a) {
+struct rt_any rt_any_to_unsigned(struct rt_task *task, struct rt_any a) {
     if (rt_any_is_signed(a)) {
         i64 ival = rt_any_to_i64(a);
         if (ival >= 0) {
-            return rt_new_u64((u64)ival);
+            return rt_new_u64(task, (u64)ival);
         }
     }
     return a;
 }
 
 bool rt_any_equals(struct rt_any a, struct rt_any b) {
-    if (!a._type && !b._type) {
-        return true;
+    if (rt_any_is_nil(a) || rt_any_is_nil(b)) {
+        return rt_any_is_nil(a) && rt_any_is_nil(b);
     }
-    if (!a._type || !b._type) {
-        return false;
-    }
-    if (a._type->kind != b._type->kind) {
-        if (a._type->kind == RT_KIND_UNSIGNED) {
-            b = rt_any_to_unsigned(b);
-            if (b._type->kind == RT_KIND_SIGNED) {
-                a = rt_any_to_signed(a);
-            }
-        } else if (b._type->kind == RT_KIND_UNSIGNED) {
-            a = rt_any_to_unsigned(a);
-            if (a._type->kind == RT_KIND_SIGNED) {
-                b = rt_any_to_signed(b);
-            }
-        } else {
-            return false;
+    struct rt_type *a_type = rt_any_get_type(a), *b_type = rt_any_get_type(b);
+    if (a_type->kind != b_type->kind) {
+        /* integers are equal if their values are, whatever their signedness */
+        if (a_type->kind == RT_KIND_SIGNED && b_type->kind == RT_KIND_UNSIGNED) {
+            i64 ival = rt_any_to_i64(a);
+            return ival >= 0 && (u64)ival == rt_any_to_u64(b);
         }
-        if (a._type->kind != b._type->kind) {
-            return false;
+        if (a_type->kind == RT_KIND_UNSIGNED && b_type->kind == RT_KIND_SIGNED) {
+            return rt_any_equals(b, a);
         }
+        return false;
     }
-    switch (a._type->kind) {
+    switch (a_type->kind) {
     case RT_KIND_PTR:
-        return a.u.ptr == b.u.ptr;
+        return rt_any_ptr(a) == rt_any_ptr(b);
     case RT_KIND_BOOL:
         return rt_any_to_bool(a) == rt_any_to_bool(b);
     case RT_KIND_SIGNED:
@@ -108,3 +115,135 @@ bool rt_any_equals(struct rt_any a, struct rt_any b) {
         return false;
     }
 }
+
+
+/* arithmetic on two numbers. reals win over integers, and integers are done
+   as i64 unless one of them only fits in a u64. two i64s, by far the most
+   common case, are checked for first */
+#define RT_DEF_ARITH_PRIMOP(Name, Op) \
+    static struct rt_any primop_##Name(struct rt_task *task, struct rt_any *args) { \
+        struct rt_any a = args[0], b = args[1]; \
+        if (rt_any_is_i64(a) && rt_any_is_i64(b)) { \
+            return rt_new_i64(task, (i64)((u64)rt_any_as_i64(a) Op (u64)rt_any_as_i64(b))); \
+        } \
+        if (rt_any_is_real(a) || rt_any_is_real(b)) { \
+            return rt_new_f64(primop_to_f64(a) Op primop_to_f64(b)); \
+        } \
+        a = rt_any_to_signed(task, a); \
+        b = rt_any_to_signed(task, b); \
+        if (rt_any_is_signed(a) && rt_any_is_signed(b)) { \
+            return rt_new_i64(task, (i64)((u64)rt_any_to_i64(a) Op (u64)rt_any_to_i64(b))); \
+        } \
+        return rt_new_u64(task, primop_to_u64(a) Op primop_to_u64(b)); \
+    }
+
+#define RT_DEF_COMPARE_PRIMOP(Name, Op) \
+    static struct rt_any primop_##Name(struct rt_task *task, struct rt_any *args) { \
+        struct rt_any a = args[0], b = args[1]; \
+        if (rt_any_is_i64(a) && rt_any_is_i64(b)) { \
+            return rt_new_bool(rt_any_as_i64(a) Op rt_any_as_i64(b)); \
+        } \
+        if (rt_any_is_real(a) || rt_any_is_real(b)) { \
+            return rt_new_bool(primop_to_f64(a) Op primop_to_f64(b)); \
+        } \
+        a = rt_any_to_signed(task, a); \
+        b = rt_any_to_signed(task, b); \
+        if (rt_any_is_signed(a) && rt_any_is_signed(b)) { \
+            return rt_new_bool(rt_any_to_i64(a) Op rt_any_to_i64(b)); \
+        } \
+        if (rt_any_is_signed(a)) { \
+            return rt_new_bool(rt_any_to_i64(a) < 0 ? 0 Op 1 : primop_to_u64(a) Op primop_to_u64(b)); \
+        } \
+        if (rt_any_is_signed(b)) { \
+            return rt_new_bool(rt_any_to_i64(b) < 0 ? 1 Op 0 : primop_to_u64(a) Op primop_to_u64(b)); \
+        } \
+        return rt_new_bool(primop_to_u64(a) Op primop_to_u64(b)); \
+    }
+
+static void primop_expect_number(struct rt_any a) {
+    if (!rt_any_is_signed(a) && !rt_any_is_unsigned(a) && !rt_any_is_real(a)) {
+        printf("expected a number, got a %s\n", rt_any_get_type(a)->desc);
+        exit(1);
+    }
+}
+
+static f64 primop_to_f64(struct rt_any a) {
+    primop_expect_number(a);
+    if (rt_any_is_signed(a)) {
+        return (f64)rt_any_to_i64(a);
+    }
+    if (rt_any_is_unsigned(a)) {
+        return (f64)rt_any_to_u64(a);
+    }
+    return rt_any_to_f64(a);
+}
+
+static u64 primop_to_u64(struct rt_any a) {
+    primop_expect_number(a);
+    if (rt_any_is_signed(a)) {
+        return (u64)rt_any_to_i64(a);
+    }
+    return rt_any_to_u64(a);
+}
+
+RT_DEF_ARITH_PRIMOP(add, +)
+RT_DEF_ARITH_PRIMOP(sub, -)
+RT_DEF_ARITH_PRIMOP(mul, *)
+RT_DEF_COMPARE_PRIMOP(lt, <)
+RT_DEF_COMPARE_PRIMOP(le, <=)
+RT_DEF_COMPARE_PRIMOP(eq, ==)
+
+#define RT_FOREACH_PRIMOP(X) \
+    X(add, +, ADD) \
+    X(sub, -, SUB) \
+    X(mul, *, MUL) \
+    X(lt, <, LT) \
+    X(le, <=, LE) \
+    X(eq, =, EQ)
+
+struct rt_primop {
+    const char *name;
+    rt_size_t name_length;
+    enum rt_i64_op i64_op;
+#ifdef RT_COMPACT_ANY
+    /* the box header of func, see RT_BOX_HEADER_SIZE */
+    struct rt_type *func_type;
+#endif
+    struct rt_func func;
+};
+
+#define RT_DEF_PRIMOP_ENTRY(Name, ProperName, I64Op) \
+    { .name = #ProperName, .name_length = sizeof(#ProperName) - 1, .i64_op = RT_I64_##I64Op, .func = { NULL, primop_##Name, NULL, NULL } },
+
+/* all primitive operations take two values of any type */
+static struct rt_primop primops[] = {
+    RT_FOREACH_PRIMOP(RT_DEF_PRIMOP_ENTRY)
+};
+
+struct rt_any rt_lookup_primop(struct rt_symbol *name) {
+    for (u32 i = 0; i < sizeof(primops) / sizeof(primops[0]); ++i) {
+        if (name->length == primops[i].name_length && !memcmp(primops[i].name, name->data, name->length)) {
+            struct rt_func_param params[2] = { { rt_types.any, NULL }, { rt_types.any, NULL } };
+            /* not boxed, as primops are not allocated by the GC */
+            struct rt_type *type = rt_gettype_ptr(rt_gettype_func(rt_types.any, 2, params));
+            return rt_any_from_ptr(type, &primops[i].func);
+        }
+    }
+    return rt_nil;
+}
+
+bool rt_primop_i64_op(struct rt_func *func, enum rt_i64_op *op_out) {
+    for (u32 i = 0; i < sizeof(primops) / sizeof(primops[0]); ++i) {
+        if (func == &primops[i].func) {
+            *op_out = primops[i].i64_op;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool rt_is_primop(struct rt_func *func) {
+    enum rt_i64_op op;
+    /* they all have an i64 variant */
+    return rt_primop_i64_op(func, &op);
+}
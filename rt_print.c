@@ -79,8 +79,7 @@ static void rt_print_array(char *ptr, struct rt_type *type) {
 static void rt_print_ptr(char *ptr, struct rt_type *type) {
     switch (type->kind) {
     case RT_KIND_ANY: {
-        struct rt_any *any = (struct rt_any *)ptr;
-        rt_print_ptr((char *)&any->u.data, rt_any_get_type(*any));
+        rt_print(*(struct rt_any *)ptr);
         break;
     }
     case RT_KIND_NIL:
@@ -132,5 +131,7 @@ static void rt_print_ptr(char *ptr, struct rt_type *type) {
 }
 
 void rt_print(struct rt_any any) {
-    rt_print_ptr((char *)&any.u.data, rt_any_get_type(any));
+    /* printed from a copy laid out as the type describes it */
+    union rt_value value = rt_any_value(any);
+    rt_print_ptr((char *)&value, rt_any_get_type(any));
 }
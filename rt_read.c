@@ -3,9 +3,15 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-IMPL_HASH_TABLE(rt_sourcemap, struct rt_cons *, struct rt_sourceloc, hashutil_ptr_hash, hashutil_ptr_equals)
+IMPL_GROUP_HASH_TABLE(rt_sourcemap, struct rt_cons *, u32, hashutil_ptr_hash, hashutil_ptr_equals)
+IMPL_GC_WEAK_TABLE(rt_sourcemap)
 
 
 long long int my_strtoll(const char *nptr, const char **endptr, int base);
@@ -36,6 +42,8 @@ static bool is_symchar(char ch) {
     case '%':
     case '^':
     case '~':
+    case '<':
+    case '>':
         return true;
     default:
         return false;
@@ -43,22 +51,276 @@ static bool is_symchar(char ch) {
 }
 
 
-#define SCRATCH_LEN 1024
 
-struct reader_state {
-    struct rt_task *task;
-    struct rt_module *mod;
+/* scalar scanners. each takes the index to start at, so the SIMD versions
+   can finish with them */
 
-    const char *text;
-    u32 pos;
-    struct rt_sourceloc loc;
+static bool is_run_space(char ch) {
+    return ch == ' ' || ch == '\t' || ch == '\f' || ch == '\v' || ch == '\n';
+}
 
-    char scratch[SCRATCH_LEN];
+static rt_size_t scan_space_from(const char *p, rt_size_t i, rt_size_t n, struct rt_space_run *run) {
+    for (; i < n && is_run_space(p[i]); ++i) {
+        if (p[i] == '\n') {
+            ++run->newlines;
+            run->line_start = i + 1;
+        }
+    }
+    return i;
+}
+
+static rt_size_t scan_symbol_from(const char *p, rt_size_t i, rt_size_t n) {
+    while (i < n && (is_alphanum(p[i]) || is_symchar(p[i]))) {
+        ++i;
+    }
+    return i;
+}
+
+static rt_size_t scan_string_from(const char *p, rt_size_t i, rt_size_t n) {
+    while (i < n && p[i] != '"' && p[i] != '\\' && p[i] != '\r' && p[i] != '\n' && p[i] != '\0') {
+        ++i;
+    }
+    return i;
+}
+
+static rt_size_t scan_comment_from(const char *p, rt_size_t i, rt_size_t n) {
+    while (i < n && p[i] != '\r' && p[i] != '\n' && p[i] != '\0') {
+        ++i;
+    }
+    return i;
+}
+
+static rt_size_t scan_space_scalar(const char *p, rt_size_t n, struct rt_space_run *run) {
+    return scan_space_from(p, 0, n, run);
+}
+
+static rt_size_t scan_symbol_scalar(const char *p, rt_size_t n) {
+    return scan_symbol_from(p, 0, n);
+}
+
+static rt_size_t scan_string_scalar(const char *p, rt_size_t n) {
+    return scan_string_from(p, 0, n);
+}
+
+static rt_size_t scan_comment_scalar(const char *p, rt_size_t n) {
+    return scan_comment_from(p, 0, n);
+}
+
+const struct rt_scanner rt_scanner_scalar = {
+    "scalar", scan_space_scalar, scan_symbol_scalar, scan_string_scalar, scan_comment_scalar
 };
 
 
-static void read_error(struct reader_state *state, const char *fmt, ...) {
-    printf("line %d, col %d: ", state->loc.line + 1, state->loc.col + 1);
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(RT_READ_NO_SIMD)
+#define RT_READ_SIMD
+#endif
+
+#ifdef RT_READ_SIMD
+#include <immintrin.h>
+
+/* the SIMD scanners make a bit mask of the characters in a block which
+   belong to the run, and the run ends at the first zero bit. the rest of
+   the input, less than a block, is left to the scalar versions, as reading
+   past the end could fault on a mapped file */
+
+static void add_newlines(struct rt_space_run *run, rt_size_t block_start, u32 newline_mask) {
+    if (newline_mask) {
+        run->newlines += (u32)__builtin_popcount(newline_mask);
+        run->line_start = block_start + 32 - (rt_size_t)__builtin_clz(newline_mask);
+    }
+}
+
+/* SSE2 is part of x86-64, so these need no check */
+
+static __m128i sse2_in_range(__m128i v, char lo, char hi) {
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8((char)(lo - 1))), _mm_cmplt_epi8(v, _mm_set1_epi8((char)(hi + 1))));
+}
+
+static rt_size_t scan_space_sse2(const char *p, rt_size_t n, struct rt_space_run *run) {
+    rt_size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        /* \t \n \v \f are 9 to 12 */
+        __m128i space = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), sse2_in_range(v, '\t', '\f'));
+        u32 space_mask = (u32)_mm_movemask_epi8(space);
+        u32 newline_mask = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+        if (space_mask != 0xffff) {
+            u32 len = (u32)__builtin_ctz(~space_mask);
+            add_newlines(run, i, newline_mask & ((1u << len) - 1));
+            return i + len;
+        }
+        add_newlines(run, i, newline_mask);
+    }
+    return scan_space_from(p, i, n, run);
+}
+
+static rt_size_t scan_symbol_sse2(const char *p, rt_size_t n) {
+    rt_size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i sym = sse2_in_range(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z');
+        sym = _mm_or_si128(sym, sse2_in_range(v, '0', '9'));
+        sym = _mm_or_si128(sym, sse2_in_range(v, '<', '?'));
+        sym = _mm_or_si128(sym, sse2_in_range(v, '^', '_'));
+        sym = _mm_or_si128(sym, sse2_in_range(v, '*', '+'));
+        sym = _mm_or_si128(sym, sse2_in_range(v, '%', '&'));
+        sym = _mm_or_si128(sym, _mm_cmpeq_epi8(v, _mm_set1_epi8('!')));
+        sym = _mm_or_si128(sym, _mm_cmpeq_epi8(v, _mm_set1_epi8('-')));
+        sym = _mm_or_si128(sym, _mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+        sym = _mm_or_si128(sym, _mm_cmpeq_epi8(v, _mm_set1_epi8('~')));
+        u32 mask = (u32)_mm_movemask_epi8(sym);
+        if (mask != 0xffff) {
+            return i + (u32)__builtin_ctz(~mask);
+        }
+    }
+    return scan_symbol_from(p, i, n);
+}
+
+static rt_size_t scan_string_sse2(const char *p, rt_size_t n) {
+    rt_size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i stop = _mm_cmpeq_epi8(v, _mm_set1_epi8('"'));
+        stop = _mm_or_si128(stop, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+        stop = _mm_or_si128(stop, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+        stop = _mm_or_si128(stop, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+        stop = _mm_or_si128(stop, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+        u32 mask = (u32)_mm_movemask_epi8(stop);
+        if (mask) {
+            return i + (u32)__builtin_ctz(mask);
+        }
+    }
+    return scan_string_from(p, i, n);
+}
+
+static rt_size_t scan_comment_sse2(const char *p, rt_size_t n) {
+    rt_size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i stop = _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'));
+        stop = _mm_or_si128(stop, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+        stop = _mm_or_si128(stop, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+        u32 mask = (u32)_mm_movemask_epi8(stop);
+        if (mask) {
+            return i + (u32)__builtin_ctz(mask);
+        }
+    }
+    return scan_comment_from(p, i, n);
+}
+
+static const struct rt_scanner scanner_sse2 = {
+    "sse2", scan_space_sse2, scan_symbol_sse2, scan_string_sse2, scan_comment_sse2
+};
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static rt_size_t scan_space_avx2(const char *p, rt_size_t n, struct rt_space_run *run) {
+    rt_size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i ctrl = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('\t' - 1)),
+                                        _mm256_cmpgt_epi8(_mm256_set1_epi8('\f' + 1), v));
+        __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), ctrl);
+        u32 space_mask = (u32)_mm256_movemask_epi8(space);
+        u32 newline_mask = (u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+        if (space_mask != 0xffffffff) {
+            u32 len = (u32)__builtin_ctz(~space_mask);
+            add_newlines(run, i, len == 0 ? 0 : newline_mask & (0xffffffffu >> (32 - len)));
+            return i + len;
+        }
+        add_newlines(run, i, newline_mask);
+    }
+    return scan_space_from(p, i, n, run);
+}
+
+/* symbol characters are found with two table lookups, on the low and the
+   high half of each byte. each high half which has symbol characters gets a
+   bit, and the low table has the bits of the high halves it makes a symbol
+   character with */
+AVX2 static rt_size_t scan_symbol_avx2(const char *p, rt_size_t n) {
+    const __m256i lo_table = _mm256_setr_epi8(
+        0x2a, 0x3f, 0x3e, 0x3e, 0x3e, 0x3f, 0x3f, 0x3e, 0x3e, 0x3e, 0x3d, 0x15, 0x16, 0x17, 0x3e, 0x1f,
+        0x2a, 0x3f, 0x3e, 0x3e, 0x3e, 0x3f, 0x3f, 0x3e, 0x3e, 0x3e, 0x3d, 0x15, 0x16, 0x17, 0x3e, 0x1f);
+    const __m256i hi_table = _mm256_setr_epi8(
+        0x00, 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    rt_size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i lo = _mm256_shuffle_epi8(lo_table, _mm256_and_si256(v, nibble));
+        __m256i hi = _mm256_shuffle_epi8(hi_table, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+        __m256i other = _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256());
+        u32 mask = (u32)_mm256_movemask_epi8(other);
+        if (mask) {
+            return i + (u32)__builtin_ctz(mask);
+        }
+    }
+    return scan_symbol_from(p, i, n);
+}
+
+AVX2 static rt_size_t scan_string_avx2(const char *p, rt_size_t n) {
+    rt_size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i stop = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'));
+        stop = _mm256_or_si256(stop, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+        stop = _mm256_or_si256(stop, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+        stop = _mm256_or_si256(stop, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+        stop = _mm256_or_si256(stop, _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+        u32 mask = (u32)_mm256_movemask_epi8(stop);
+        if (mask) {
+            return i + (u32)__builtin_ctz(mask);
+        }
+    }
+    return scan_string_from(p, i, n);
+}
+
+AVX2 static rt_size_t scan_comment_avx2(const char *p, rt_size_t n) {
+    rt_size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i stop = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'));
+        stop = _mm256_or_si256(stop, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+        stop = _mm256_or_si256(stop, _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+        u32 mask = (u32)_mm256_movemask_epi8(stop);
+        if (mask) {
+            return i + (u32)__builtin_ctz(mask);
+        }
+    }
+    return scan_comment_from(p, i, n);
+}
+
+static const struct rt_scanner scanner_avx2 = {
+    "avx2", scan_space_avx2, scan_symbol_avx2, scan_string_avx2, scan_comment_avx2
+};
+#endif
+
+const struct rt_scanner *rt_get_scanner(void) {
+#ifdef RT_READ_SIMD
+    /* set once, to the same value by any thread getting here */
+    static const struct rt_scanner *scanner;
+    if (!scanner) {
+        __builtin_cpu_init();
+        scanner = __builtin_cpu_supports("avx2") ? &scanner_avx2 : &scanner_sse2;
+    }
+    return scanner;
+#else
+    return &rt_scanner_scalar;
+#endif
+}
+
+
+/* the buffer for input which is not mapped. it only needs to hold a few
+   characters ahead of the position, so it does not grow */
+#define READ_BUFFER_SIZE (64 * 1024)
+
+/* numbers are copied out of the input to be parsed, and can be no longer */
+#define MAX_NUMBER_LEN 64
+
+
+static void read_error(struct rt_reader *state, const char *fmt, ...) {
+    printf("line %d, col %d: ", state->line + 1, (int)(state->base + state->pos - state->line_start) + 1);
     va_list args;
     va_start(args, fmt);
     vprintf(fmt, args);
@@ -67,50 +329,124 @@ static void read_error(struct reader_state *state, const char *fmt, ...) {
     exit(1);
 }
 
-static char peek(struct reader_state *state, int offset) {
-    return state->text[state->pos + offset];
+/* drops what has been read from the buffer, and reads until there are at
+   least count characters from the position on, or the input ends */
+static void refill(struct rt_reader *state, rt_size_t count) {
+    rt_size_t unread = state->len - state->pos;
+    memmove(state->buffer, state->buffer + state->pos, unread);
+    state->base += state->pos;
+    state->pos = 0;
+    state->len = unread;
+    while (state->len < count && !state->at_end) {
+        ssize_t n = read(state->fd, state->buffer + state->len, state->buffer_capacity - state->len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            read_error(state, "error reading input: %s", strerror(errno));
+        }
+        if (n == 0) {
+            state->at_end = true;
+        }
+        state->len += (rt_size_t)n;
+    }
+}
+
+/* the character at an offset from the position, or NUL past the end */
+static char peek(struct rt_reader *state, int offset) {
+    rt_size_t i = state->pos + offset;
+    if (i >= state->len) {
+        if (state->at_end) {
+            return '\0';
+        }
+        refill(state, offset + 1);
+        i = state->pos + offset;
+        if (i >= state->len) {
+            return '\0';
+        }
+    }
+    return state->text[i];
 }
 
-static void step(struct reader_state *state) {
-    ++state->loc.col;
+static void step(struct rt_reader *state) {
     ++state->pos;
 }
 
-static void spacestep(struct reader_state *state) {
-    if (state->text[state->pos] == '\r') {
-        if (state->text[state->pos + 1] != '\n') {
-            ++state->loc.line;
-            state->loc.col = 0;
-            ++state->pos;
-            return;
+/* offsets are kept in 32 bits, so locations past 4GiB into the input are off */
+static u32 offset(struct rt_reader *state, rt_size_t pos) {
+    return (u32)(state->base + pos);
+}
+
+/* a line starts at pos */
+static void new_line(struct rt_reader *state, rt_size_t pos) {
+    ++state->line;
+    state->line_start = state->base + pos;
+    struct rt_module *mod = state->mod;
+    if (mod) {
+        if (mod->line_count == mod->line_capacity) {
+            mod->line_capacity = mod->line_capacity ? mod->line_capacity * 2 : 256;
+            mod->line_starts = realloc(mod->line_starts, sizeof(u32) * mod->line_capacity);
         }
-    } else if (state->text[state->pos] == '\n') {
-        ++state->loc.line;
-        state->loc.col = 0;
-        ++state->pos;
-        return;
+        mod->line_starts[mod->line_count++] = offset(state, pos);
     }
-    ++state->loc.col;
+}
+
+static void spacestep(struct rt_reader *state) {
+    char ch = peek(state, 0);
     ++state->pos;
+    if (ch == '\n' || (ch == '\r' && peek(state, 0) != '\n')) {
+        new_line(state, state->pos);
+    }
 }
 
-static void skip_space(struct reader_state *state) {
-    char ch;
+/* the number of characters from the position on which are in memory,
+   reading more if there are none */
+static rt_size_t available(struct rt_reader *state) {
+    if (state->pos >= state->len && !state->at_end) {
+        refill(state, 1);
+    }
+    return state->len - state->pos;
+}
+
+static void skip_space(struct rt_reader *state) {
+    const struct rt_scanner *scanner = state->scanner;
     for (;;) {
+        rt_size_t n = available(state);
+        struct rt_space_run run = {0, 0};
+        rt_size_t start = state->pos;
+        rt_size_t len = scanner->space(state->text + start, n, &run);
+        state->pos += len;
+        if (run.newlines) {
+            if (state->mod) {
+                /* the scanner only tells where the last line starts */
+                const char *p = state->text + start;
+                const char *end = p + run.line_start;
+                while ((p = memchr(p, '\n', (size_t)(end - p)))) {
+                    ++p;
+                    new_line(state, (rt_size_t)(p - state->text));
+                }
+            } else {
+                state->line += run.newlines;
+                state->line_start = state->base + start + run.line_start;
+            }
+        }
+        if (len && len == n) {
+            continue;
+        }
         switch (peek(state, 0)) {
-        case ' ':
-        case '\t':
-        case '\f':
-        case '\v':
         case '\r':
-        case '\n':
             spacestep(state);
             continue;
         case ';': /* line comment */
-            do {
-                spacestep(state);
-                ch = peek(state, 0);
-            } while (ch && ch != '\n' && ch != '\r');
+            step(state);
+            for (;;) {
+                n = available(state);
+                len = scanner->comment(state->text + state->pos, n);
+                state->pos += len;
+                if (!n || len < n) {
+                    break;
+                }
+            }
             continue;
         default:
             return;
@@ -118,8 +454,9 @@ static void skip_space(struct reader_state *state) {
     }
 }
 
-static void expect_delim(struct reader_state *state) {
+static void expect_delim(struct rt_reader *state) {
     switch (peek(state, 0)) {
+    case '\0':
     case ' ':
     case '\t':
     case '\f':
@@ -137,27 +474,60 @@ static void expect_delim(struct reader_state *state) {
     read_error(state, "expected delimiter after expression");
 }
 
-static struct rt_any read_string(struct reader_state *state) {
-    char *scratch = state->scratch;
-    uint32_t len = 0;
+/* makes room for count characters in the scratch buffer */
+static void reserve_scratch(struct rt_reader *state, rt_size_t count) {
+    if (count > state->scratch_capacity) {
+        rt_size_t capacity = state->scratch_capacity ? state->scratch_capacity : 256;
+        while (capacity < count) {
+            capacity *= 2;
+        }
+        state->scratch = realloc(state->scratch, capacity);
+        state->scratch_capacity = capacity;
+    }
+}
+
+/* appends the run the scan function finds at the position to the len
+   characters in the scratch buffer, across refills of the input */
+static rt_size_t copy_run(struct rt_reader *state, rt_size_t (*scan)(const char *p, rt_size_t n), rt_size_t len) {
+    for (;;) {
+        rt_size_t n = available(state);
+        rt_size_t run = scan(state->text + state->pos, n);
+        reserve_scratch(state, len + run + 1);
+        memcpy(state->scratch + len, state->text + state->pos, run);
+        len += run;
+        state->pos += run;
+        if (!n || run < n) {
+            return len;
+        }
+    }
+}
+
+static struct rt_any read_string(struct rt_reader *state) {
+    /* without escapes or line breaks, the string is copied straight from
+       the input into its box */
+    rt_size_t n = available(state);
+    rt_size_t len = state->scanner->string(state->text + state->pos, n);
+    if (len < n && state->text[state->pos + len] == '"') {
+        struct rt_any result = rt_new_string_n(state->task, state->text + state->pos, len);
+        state->pos += len + 1;
+        return result;
+    }
+
+    len = 0;
     for (;;) {
+        len = copy_run(state, state->scanner->string, len);
         char ch = peek(state, 0);
         if (ch == '"') {
             step(state);
-            if (len >= SCRATCH_LEN) {
-                read_error(state, "string is too long");
-            }
-            scratch[len] = '\0';
-            return rt_new_string(state->task, scratch);
+            return rt_new_string_n(state->task, state->scratch, len);
         } else if (ch == '\\') {
             step(state);
             ch = peek(state, 0);
             if (ch == '\0') {
                 read_error(state, "unexpected end of input while reading string");
             }
-            if (len >= SCRATCH_LEN) {
-                read_error(state, "string is too long");
-            }
+            reserve_scratch(state, len + 1);
+            char *scratch = state->scratch;
             switch (ch) {
             case '\'': scratch[len++] = '\''; break;
             case '"': scratch[len++] = '"'; break;
@@ -177,96 +547,101 @@ static struct rt_any read_string(struct reader_state *state) {
         } else if (ch == '\0') {
             read_error(state, "unexpected end of input while reading string");
         } else {
-            if (ch == '\r' || ch == '\n') {
-                spacestep(state);
-            } else {
-                step(state);
-            }
-            if (len >= SCRATCH_LEN) {
-                read_error(state, "string is too long");
-            }
-            scratch[len++] = ch;
+            /* \r or \n */
+            spacestep(state);
+            reserve_scratch(state, len + 1);
+            state->scratch[len++] = ch;
         }
     }
     return rt_nil;
 }
 
-static struct rt_any read_symbol(struct reader_state *state) {
-    char *scratch = state->scratch;
-    uint32_t len = 0;
-    for (;;) {
-        char ch = peek(state, 0);
-        if (!is_alphanum(ch) && !is_symchar(ch)) {
-            if (len == 0) {
-                read_error(state, "expected a symbol");
-            }
-            if (len >= SCRATCH_LEN) {
-                read_error(state, "string is too long");
-            }
-            scratch[len] = '\0';
-            struct rt_any result = rt_get_symbol(scratch);
-            return result;
-        }
-        if (len >= SCRATCH_LEN) {
-            read_error(state, "string is too long");
+static struct rt_any read_symbol(struct rt_reader *state) {
+    /* interned straight from the input, unless a refill is needed to see
+       where it ends */
+    rt_size_t n = available(state);
+    rt_size_t len = state->scanner->symbol(state->text + state->pos, n);
+    if (len < n || state->at_end) {
+        if (len == 0) {
+            read_error(state, "expected a symbol");
         }
-        scratch[len++] = ch;
-        step(state);
+        struct rt_any result = rt_get_symbol_n(state->text + state->pos, len);
+        state->pos += len;
+        return result;
     }
+    len = copy_run(state, state->scanner->symbol, 0);
+    return rt_get_symbol_n(state->scratch, len);
 }
 
-static struct rt_any read_number(struct reader_state *state) {
+static bool is_number_char(char ch) {
+    return is_alphanum(ch) || ch == '.' || ch == '+' || ch == '-';
+}
+
+static struct rt_any read_number(struct rt_reader *state) {
+    char text[MAX_NUMBER_LEN + 1];
+    u32 text_len = 0;
+    char ch;
+    while (text_len < MAX_NUMBER_LEN && is_number_char(ch = peek(state, text_len))) {
+        text[text_len++] = ch;
+    }
+    text[text_len] = '\0';
+
     errno = 0;
     const char *end;
-    const char *start = state->text + state->pos;
     /* TODO: handle unsigned numbers */
-    i64 llval = my_strtoll(start, &end, 0);
-    if (start == end) {
+    i64 llval = my_strtoll(text, &end, 0);
+    if (text == end) {
         read_error(state, "error parsing number");
     }
     if (errno == ERANGE) {
         read_error(state, "number too large");
     }
+    struct rt_any result;
     if (*end != '.') {
-        state->pos += (int)(end - start);
-        return rt_new_i64(llval);
-    }
-    start = state->text + state->pos;
-    f64 dval = my_strtod(start, &end);
-    if (start == end) {
-        read_error(state, "error parsing number");
+        result = rt_new_i64(state->task, llval);
+    } else {
+        f64 dval = my_strtod(text, &end);
+        if (text == end) {
+            read_error(state, "error parsing number");
+        }
+        if (errno == ERANGE) {
+            read_error(state, "number too large");
+        }
+        result = rt_new_f64(dval);
     }
-    if (errno == ERANGE) {
-        read_error(state, "number too large");
+    if (end - text == MAX_NUMBER_LEN) {
+        read_error(state, "number is too long");
     }
-    state->pos += (int)(end - start);
-    return rt_new_f64(dval);
+    state->pos += (rt_size_t)(end - text);
+    return result;
 }
 
-static struct rt_any read_form(struct reader_state *state);
+static struct rt_any read_form(struct rt_reader *state);
 
-static struct rt_any read_list(struct reader_state *state, char end) {
+static struct rt_any read_list(struct rt_reader *state, char end) {
     skip_space(state);
     if (peek(state, 0) == end) {
         step(state);
         return rt_nil;
     }
 
-    struct rt_sourceloc loc_before_car = state->loc;
+    u32 car_offset = offset(state, state->pos);
     struct rt_any form = read_form(state);
-    struct rt_sourceloc loc_after_car = state->loc;
-
     struct rt_any result = rt_new_cons(state->task, form, read_list(state, end));
 
-    if (state->mod) {
-        rt_sourcemap_put(&state->mod->location_before_car, result.u.cons, loc_before_car);
-        rt_sourcemap_put(&state->mod->location_after_car, result.u.cons, loc_after_car);
+    struct rt_module *mod = state->mod;
+    if (mod) {
+        if (mod->pending_offset_count == mod->pending_offset_capacity) {
+            mod->pending_offset_capacity = mod->pending_offset_capacity ? mod->pending_offset_capacity * 2 : 256;
+            mod->pending_offsets = realloc(mod->pending_offsets, sizeof(struct rt_sourceoffset) * mod->pending_offset_capacity);
+        }
+        mod->pending_offsets[mod->pending_offset_count++] = (struct rt_sourceoffset) { result.u.cons, car_offset };
     }
 
     return result;
 }
 
-static struct rt_any read_form(struct reader_state *state) {
+static struct rt_any read_form(struct rt_reader *state) {
     struct rt_task *task = state->task;
     struct rt_any result = rt_nil;
     skip_space(state);
@@ -328,7 +703,195 @@ static struct rt_any read_form(struct reader_state *state) {
 }
 
 struct rt_any rt_read(struct rt_task *task, const char *text) {
-    struct reader_state state = {task,};
-    state.text = text;
-    return read_form(&state);
+    struct rt_reader state;
+    rt_reader_init_string(&state, task, text, strlen(text));
+    struct rt_any result = read_form(&state);
+    rt_reader_close(&state);
+    return result;
+}
+
+/* the input goes after what was read into the module before, so offsets
+   stay unique within the module */
+static void reader_init_locations(struct rt_reader *reader) {
+    reader->scanner = rt_get_scanner();
+    struct rt_module *mod = reader->task->current_module;
+    reader->mod = mod;
+    if (mod) {
+        reader->base = mod->source_length;
+        reader->line = mod->line_count;
+        reader->line_start = reader->base;
+    }
+}
+
+void rt_reader_init_string(struct rt_reader *reader, struct rt_task *task, const char *text, rt_size_t len) {
+    memset(reader, 0, sizeof(struct rt_reader));
+    reader->task = task;
+    reader->text = text;
+    reader->len = len;
+    reader->at_end = true;
+    reader->fd = -1;
+    reader_init_locations(reader);
+}
+
+void rt_reader_init_fd(struct rt_reader *reader, struct rt_task *task, int fd) {
+    memset(reader, 0, sizeof(struct rt_reader));
+    reader->task = task;
+    reader->fd = fd;
+    reader_init_locations(reader);
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        /* read straight from the page cache. an empty file can not be mapped */
+        if (st.st_size == 0) {
+            reader->text = "";
+            reader->at_end = true;
+            return;
+        }
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+            reader->map = map;
+            reader->map_len = (rt_size_t)st.st_size;
+            reader->text = map;
+            reader->len = reader->map_len;
+            reader->at_end = true;
+            return;
+        }
+        /* otherwise it is read like a pipe */
+    }
+    reader->buffer_capacity = READ_BUFFER_SIZE;
+    reader->buffer = malloc(READ_BUFFER_SIZE);
+    reader->text = reader->buffer;
+}
+
+bool rt_reader_init_file(struct rt_reader *reader, struct rt_task *task, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    rt_reader_init_fd(reader, task, fd);
+    reader->owns_fd = true;
+    return true;
+}
+
+bool rt_reader_next(struct rt_reader *reader, struct rt_any *form_out) {
+    skip_space(reader);
+    if (peek(reader, 0) == '\0' && reader->pos >= reader->len) {
+        return false;
+    }
+    *form_out = read_form(reader);
+    return true;
+}
+
+void rt_reader_close(struct rt_reader *reader) {
+    if (reader->mod) {
+        /* the next input starts on a line of its own */
+        if (reader->line_start != reader->base + reader->len) {
+            new_line(reader, reader->len);
+        }
+        reader->mod->source_length = offset(reader, reader->len);
+    }
+    if (reader->map) {
+        munmap(reader->map, reader->map_len);
+    }
+    free(reader->buffer);
+    free(reader->scratch);
+    if (reader->owns_fd) {
+        close(reader->fd);
+    }
+    memset(reader, 0, sizeof(struct rt_reader));
+    reader->fd = -1;
+}
+
+/* the forms are appended as they are read, so the head is kept as a root */
+static struct rt_any read_all(struct rt_reader *reader) {
+    struct rt_task *task = reader->task;
+    struct rt_any head = rt_nil, tail = rt_nil, form;
+    struct rt_type *root_types[2] = { rt_types.any, NULL };
+    void *roots[3] = { task->roots, root_types, &head };
+    task->roots = roots;
+    while (rt_reader_next(reader, &form)) {
+        struct rt_any cons = rt_new_cons(task, form, rt_nil);
+        if (rt_any_is_nil(head)) {
+            head = cons;
+        } else {
+            rt_set_cdr(task, tail, cons);
+        }
+        tail = cons;
+    }
+    task->roots = roots[0];
+    return head;
+}
+
+bool rt_read_file(struct rt_task *task, const char *path, struct rt_any *forms_out) {
+    struct rt_reader reader;
+    if (!rt_reader_init_file(&reader, task, path)) {
+        return false;
+    }
+    *forms_out = read_all(&reader);
+    rt_reader_close(&reader);
+    return true;
+}
+
+struct rt_any rt_read_fd(struct rt_task *task, int fd) {
+    struct rt_reader reader;
+    rt_reader_init_fd(&reader, task, fd);
+    struct rt_any forms = read_all(&reader);
+    rt_reader_close(&reader);
+    return forms;
+}
+
+
+bool rt_module_find_location(struct rt_module *mod, struct rt_cons *cons, u32 *offset_out) {
+    if (mod->pending_offset_count) {
+        /* sized up front, as there is no growing it while moving them in */
+        rt_sourcemap_reserve(&mod->sourcemap, mod->sourcemap.used + mod->pending_offset_count);
+        for (u32 i = 0; i < mod->pending_offset_count; ++i) {
+            rt_sourcemap_put(&mod->sourcemap, mod->pending_offsets[i].cons, mod->pending_offsets[i].offset);
+        }
+        free(mod->pending_offsets);
+        mod->pending_offsets = NULL;
+        mod->pending_offset_count = 0;
+        mod->pending_offset_capacity = 0;
+    }
+    return rt_sourcemap_get(&mod->sourcemap, cons, offset_out);
+}
+
+void rt_module_prune_locations(struct rt_module *mod) {
+    rt_sourcemap_prune(&mod->sourcemap);
+    u32 kept = 0;
+    for (u32 i = 0; i < mod->pending_offset_count; ++i) {
+        if (rt_gc_is_live(mod->pending_offsets[i].cons)) {
+            mod->pending_offsets[kept++] = mod->pending_offsets[i];
+        }
+    }
+    mod->pending_offset_count = kept;
+}
+
+struct rt_sourceloc rt_module_sourceloc(struct rt_module *mod, u32 offset) {
+    /* the number of lines starting at or before the offset */
+    u32 lo = 0, hi = mod->line_count;
+    while (lo < hi) {
+        u32 mid = lo + (hi - lo) / 2;
+        if (mod->line_starts[mid] <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    struct rt_sourceloc loc = { lo, offset - (lo ? mod->line_starts[lo - 1] : 0) };
+    return loc;
+}
+
+void rt_module_free_locations(struct rt_module *mod) {
+    rt_sourcemap_free(&mod->sourcemap);
+    free(mod->pending_offsets);
+    free(mod->line_starts);
+    mod->pending_offsets = NULL;
+    mod->pending_offset_count = 0;
+    mod->pending_offset_capacity = 0;
+    mod->line_starts = NULL;
+    mod->line_count = 0;
+    mod->line_capacity = 0;
+    mod->source_length = 0;
 }
@@ -0,0 +1,585 @@
+#include "rt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+/* a stack based VM running bytecode compiled from the AST of function bodies.
+   instructions are sequences of u32 words: an opcode followed by its operands.
+   the operand stack of a call sits right on top of its locals, which start with
+   the arguments, so the frame pointer points at the first argument and locals
+   are addressed by their (compile time) offset from it.
+
+   a scope reserves its variables on the operand stack, and the compiler tracks
+   the stack depth at each instruction to turn the stack index of a local (which
+   counts back from the end of the innermost scope) into a frame offset.
+
+   dispatch uses computed goto where the compiler supports it */
+
+#if defined(__GNUC__) && !defined(RT_VM_SWITCH_DISPATCH)
+#define RT_VM_COMPUTED_GOTO
+#endif
+
+#define STACK_SIZE 65536
+#define MAX_FRAMES 16384
+
+#define RT_FOREACH_OPCODE(X) \
+    X(CONST)            /* const index: push a constant */ \
+    X(NIL)              /* push nil */ \
+    X(POP)              /* drop the top value */ \
+    X(RESERVE)          /* count: push count nils for the variables of a scope */ \
+    X(DROP_UNDER)       /* count: drop count values under the top value */ \
+    X(GET_GLOBAL)       /* global index, node index: push the value of a global */ \
+    X(GET_LOCAL)        /* frame offset: push a local */ \
+    X(SET_LOCAL)        /* frame offset: store the top value in a local */ \
+    X(JUMP)             /* target */ \
+    X(JUMP_IF_FALSE)    /* node index, target: pop a bool, and jump if false */ \
+    X(CALL)             /* arg count, node index: call the function under the arguments */ \
+    X(CALL_CHECKED)     /* arg count, node index: as CALL, with the types proven by inference */ \
+    X(TAIL_CALL)        /* arg count, node index: as CALL, reusing the frame of the caller */ \
+    X(TAIL_CALL_CHECKED) \
+    X(CALL_NATIVE)      /* arg count, const index: call a known C function taking any values */ \
+    X(ADD_I64)          /* replace the two i64 values on top with their sum */ \
+    X(SUB_I64) \
+    X(MUL_I64) \
+    X(LT_I64)           /* replace the two i64 values on top with a bool */ \
+    X(LE_I64) \
+    X(EQ_I64) \
+    X(CHECK_TYPE)       /* node index: fail unless the top value is of the result type of the node */ \
+    X(RETURN)
+
+#define RT_DEF_OPCODE(Name) RT_OP_##Name,
+
+enum rt_opcode {
+    RT_FOREACH_OPCODE(RT_DEF_OPCODE)
+};
+
+struct rt_code {
+    /* chains all code of a module */
+    struct rt_code *next;
+
+    u32 instr_count;
+    u32 *instrs;
+
+    u32 const_count;
+    struct rt_any *consts;
+
+    /* nodes instructions refer to, for global names and error locations */
+    u32 node_count;
+    struct rt_astnode **nodes;
+
+    /* the most stack slots used above the frame pointer */
+    u32 max_stack;
+};
+
+struct compile_state {
+    struct rt_code *code;
+    u32 instr_capacity;
+    u32 const_capacity;
+    u32 node_capacity;
+
+    /* stack depth above the frame pointer, and where the innermost scope ends */
+    u32 depth;
+    u32 scope_top;
+};
+
+struct vm_frame {
+    struct rt_code *code;
+    u32 *pc;
+    struct rt_any *fp;
+};
+
+struct vm_state {
+    struct rt_task *task;
+    struct rt_module *mod;
+
+    struct rt_any stack[STACK_SIZE];
+    struct vm_frame frames[MAX_FRAMES];
+};
+
+/* node is NULL for errors in the call made by rt_vm_call */
+static void vm_error(struct rt_astnode *node, const char *fmt, ...) {
+    if (node) {
+        printf("line %d, col %d: ", node->sourceloc.line + 1, node->sourceloc.col + 1);
+    }
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    printf("\n");
+    exit(1);
+}
+
+
+static u32 emit(struct compile_state *cs, u32 word) {
+    struct rt_code *code = cs->code;
+    if (code->instr_count == cs->instr_capacity) {
+        cs->instr_capacity = cs->instr_capacity ? cs->instr_capacity * 2 : 64;
+        code->instrs = realloc(code->instrs, sizeof(u32) * cs->instr_capacity);
+    }
+    code->instrs[code->instr_count] = word;
+    return code->instr_count++;
+}
+
+static u32 add_const(struct compile_state *cs, struct rt_any value) {
+    struct rt_code *code = cs->code;
+    if (code->const_count == cs->const_capacity) {
+        cs->const_capacity = cs->const_capacity ? cs->const_capacity * 2 : 16;
+        code->consts = realloc(code->consts, sizeof(struct rt_any) * cs->const_capacity);
+    }
+    code->consts[code->const_count] = value;
+    return code->const_count++;
+}
+
+static u32 add_node(struct compile_state *cs, struct rt_astnode *node) {
+    struct rt_code *code = cs->code;
+    if (code->node_count == cs->node_capacity) {
+        cs->node_capacity = cs->node_capacity ? cs->node_capacity * 2 : 16;
+        code->nodes = realloc(code->nodes, sizeof(struct rt_astnode *) * cs->node_capacity);
+    }
+    code->nodes[code->node_count] = node;
+    return code->node_count++;
+}
+
+static void push_depth(struct compile_state *cs, u32 count) {
+    cs->depth += count;
+    if (cs->depth > cs->code->max_stack) {
+        cs->code->max_stack = cs->depth;
+    }
+}
+
+/* whether a call can go straight to a C function, with no checks needed */
+static bool is_known_native(struct rt_astnode *func_expr, u32 arg_count) {
+    if (func_expr->node_type != RT_ASTNODE_LITERAL || !rt_any_is_func(func_expr->const_value) ||
+        !func_expr->const_value.u.func->native) {
+        return false;
+    }
+    struct rt_type *func_type = rt_any_func_type(func_expr->const_value);
+    if (func_type->u.func.param_count != arg_count) {
+        return false;
+    }
+    for (u32 i = 0; i < arg_count; ++i) {
+        if (func_type->u.func.params[i].type != rt_types.any) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void compile_expr(struct compile_state *cs, struct rt_astnode *node) {
+    switch (node->node_type) {
+    case RT_ASTNODE_LITERAL:
+        emit(cs, RT_OP_CONST);
+        emit(cs, add_const(cs, node->const_value));
+        push_depth(cs, 1);
+        break;
+    case RT_ASTNODE_SCOPE: {
+        u32 var_count = node->u.scope.var_count;
+        u32 saved_top = cs->scope_top;
+        emit(cs, RT_OP_RESERVE);
+        emit(cs, var_count);
+        push_depth(cs, var_count);
+        cs->scope_top = cs->depth;
+        compile_expr(cs, node->u.scope.expr);
+        cs->scope_top = saved_top;
+        emit(cs, RT_OP_DROP_UNDER);
+        emit(cs, var_count);
+        cs->depth -= var_count;
+        break;
+    }
+    case RT_ASTNODE_BLOCK:
+        if (!node->u.block.expr_count) {
+            emit(cs, RT_OP_NIL);
+            push_depth(cs, 1);
+            break;
+        }
+        for (u32 i = 0; i < node->u.block.expr_count; ++i) {
+            if (i) {
+                emit(cs, RT_OP_POP);
+                --cs->depth;
+            }
+            compile_expr(cs, node->u.block.exprs[i]);
+        }
+        break;
+    case RT_ASTNODE_GET_GLOBAL:
+        emit(cs, RT_OP_GET_GLOBAL);
+        emit(cs, node->u.get_global.index);
+        emit(cs, add_node(cs, node));
+        push_depth(cs, 1);
+        break;
+    case RT_ASTNODE_GET_LOCAL:
+        emit(cs, RT_OP_GET_LOCAL);
+        emit(cs, cs->scope_top - node->u.get_local.stack_index);
+        push_depth(cs, 1);
+        break;
+    case RT_ASTNODE_SET_LOCAL:
+        compile_expr(cs, node->u.set_local.expr);
+        emit(cs, RT_OP_SET_LOCAL);
+        emit(cs, cs->scope_top - node->u.set_local.stack_index);
+        break;
+    case RT_ASTNODE_COND: {
+        compile_expr(cs, node->u.cond.pred_expr);
+        emit(cs, RT_OP_JUMP_IF_FALSE);
+        emit(cs, add_node(cs, node));
+        u32 else_jump = emit(cs, 0);
+        --cs->depth;
+        compile_expr(cs, node->u.cond.then_expr);
+        emit(cs, RT_OP_JUMP);
+        u32 end_jump = emit(cs, 0);
+        --cs->depth;
+        cs->code->instrs[else_jump] = cs->code->instr_count;
+        compile_expr(cs, node->u.cond.else_expr);
+        cs->code->instrs[end_jump] = cs->code->instr_count;
+        break;
+    }
+    case RT_ASTNODE_LOOP: {
+        /* the result is that of the last iteration, or nil */
+        emit(cs, RT_OP_NIL);
+        push_depth(cs, 1);
+        u32 loop_start = cs->code->instr_count;
+        compile_expr(cs, node->u.loop.pred_expr);
+        emit(cs, RT_OP_JUMP_IF_FALSE);
+        emit(cs, add_node(cs, node));
+        u32 end_jump = emit(cs, 0);
+        --cs->depth;
+        emit(cs, RT_OP_POP);
+        --cs->depth;
+        compile_expr(cs, node->u.loop.body_expr);
+        emit(cs, RT_OP_JUMP);
+        emit(cs, loop_start);
+        cs->code->instrs[end_jump] = cs->code->instr_count;
+        break;
+    }
+    case RT_ASTNODE_CALL: {
+        u32 arg_count = node->u.call.arg_count;
+        struct rt_astnode *func_expr = node->u.call.func_expr;
+        if (is_known_native(func_expr, arg_count)) {
+            /* nothing to check at run time, and the function need not be on the stack */
+            for (u32 i = 0; i < arg_count; ++i) {
+                compile_expr(cs, node->u.call.arg_exprs[i]);
+            }
+            emit(cs, RT_OP_CALL_NATIVE);
+            emit(cs, arg_count);
+            emit(cs, add_const(cs, func_expr->const_value));
+            cs->depth -= arg_count;
+            push_depth(cs, 1);
+            break;
+        }
+        compile_expr(cs, func_expr);
+        for (u32 i = 0; i < arg_count; ++i) {
+            compile_expr(cs, node->u.call.arg_exprs[i]);
+        }
+        if (node->u.call.tail) {
+            emit(cs, node->u.call.checked ? RT_OP_TAIL_CALL_CHECKED : RT_OP_TAIL_CALL);
+        } else {
+            emit(cs, node->u.call.checked ? RT_OP_CALL_CHECKED : RT_OP_CALL);
+        }
+        emit(cs, arg_count);
+        emit(cs, add_node(cs, node));
+        cs->depth -= arg_count;
+        break;
+    }
+    case RT_ASTNODE_I64_OP: {
+        static const enum rt_opcode i64_opcodes[] = {
+            [RT_I64_ADD] = RT_OP_ADD_I64,
+            [RT_I64_SUB] = RT_OP_SUB_I64,
+            [RT_I64_MUL] = RT_OP_MUL_I64,
+            [RT_I64_LT] = RT_OP_LT_I64,
+            [RT_I64_LE] = RT_OP_LE_I64,
+            [RT_I64_EQ] = RT_OP_EQ_I64,
+        };
+        compile_expr(cs, node->u.i64_op.lhs);
+        compile_expr(cs, node->u.i64_op.rhs);
+        emit(cs, i64_opcodes[node->u.i64_op.op]);
+        --cs->depth;
+        break;
+    }
+    case RT_ASTNODE_CHECK_TYPE:
+        compile_expr(cs, node->u.check_type.expr);
+        emit(cs, RT_OP_CHECK_TYPE);
+        emit(cs, add_node(cs, node));
+        break;
+    }
+}
+
+/* the arguments are already on the stack when the body starts, so the scope
+   holding the parameters does not reserve anything */
+static struct rt_code *compile_func(struct rt_module *mod, struct rt_func *func, u32 param_count) {
+    struct compile_state cs = {0,};
+    cs.code = calloc(1, sizeof(struct rt_code));
+
+    struct rt_astnode *body = func->body_expr;
+    if (param_count > 0) {
+        assert(body->node_type == RT_ASTNODE_SCOPE);
+        assert(body->u.scope.var_count == param_count);
+        push_depth(&cs, param_count);
+        cs.scope_top = param_count;
+        body = body->u.scope.expr;
+    }
+    compile_expr(&cs, body);
+    emit(&cs, RT_OP_RETURN);
+
+    cs.code->next = mod->code_list;
+    mod->code_list = cs.code;
+    return cs.code;
+}
+
+void rt_vm_free_code(struct rt_module *mod) {
+    struct rt_code *code = mod->code_list;
+    while (code) {
+        struct rt_code *next = code->next;
+        free(code->instrs);
+        free(code->consts);
+        free(code->nodes);
+        free(code);
+        code = next;
+    }
+    mod->code_list = NULL;
+}
+
+
+#ifdef RT_VM_COMPUTED_GOTO
+/* labels as values are a GNU extension */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#define RT_DEF_OPCODE_LABEL(Name) &&op_##Name,
+#define CASE(Name) op_##Name:
+#define DISPATCH() goto *dispatch_table[*pc++]
+#else
+#define CASE(Name) case RT_OP_##Name:
+#define DISPATCH() break
+#endif
+
+static struct rt_any vm_run(struct vm_state *vm, struct rt_any func, u32 arg_count) {
+#ifdef RT_VM_COMPUTED_GOTO
+    static void *dispatch_table[] = {
+        RT_FOREACH_OPCODE(RT_DEF_OPCODE_LABEL)
+    };
+#endif
+    struct rt_any *stack_end = vm->stack + STACK_SIZE;
+    struct vm_frame *frame = vm->frames;
+    struct vm_frame *frames_end = vm->frames + MAX_FRAMES;
+
+    /* the function and its arguments are at the bottom of the stack. calling
+       it pushes the first frame, and returning from that ends the run */
+    struct rt_any *sp = vm->stack + 1 + arg_count;
+    struct rt_any *fp = NULL;
+    struct rt_code *code = NULL;
+    u32 *pc = NULL;
+    struct rt_astnode *node = NULL;
+    struct rt_any callee = func;
+    bool tail = false;
+    goto call;
+
+    for (;;) {
+#ifdef RT_VM_COMPUTED_GOTO
+        DISPATCH();
+#else
+        switch (*pc++) {
+#endif
+        CASE(CONST)
+            *sp++ = code->consts[*pc++];
+            DISPATCH();
+        CASE(NIL)
+            *sp++ = rt_nil;
+            DISPATCH();
+        CASE(POP)
+            --sp;
+            DISPATCH();
+        CASE(RESERVE) {
+            u32 count = *pc++;
+            for (u32 i = 0; i < count; ++i) {
+                *sp++ = rt_nil;
+            }
+            DISPATCH();
+        }
+        CASE(DROP_UNDER) {
+            u32 count = *pc++;
+            sp[-1 - (i32)count] = sp[-1];
+            sp -= count;
+            DISPATCH();
+        }
+        CASE(GET_GLOBAL) {
+            struct rt_global *global = vm->mod->globals + pc[0];
+            if (!global->defined) {
+                node = code->nodes[pc[1]];
+                vm_error(node, "no toplevel item with name '%s' found", node->u.get_global.name->data);
+            }
+            pc += 2;
+            *sp++ = global->value;
+            DISPATCH();
+        }
+        CASE(GET_LOCAL)
+            *sp++ = fp[*pc++];
+            DISPATCH();
+        CASE(SET_LOCAL)
+            fp[*pc++] = sp[-1];
+            DISPATCH();
+        CASE(JUMP)
+            pc = code->instrs + *pc;
+            DISPATCH();
+        CASE(JUMP_IF_FALSE) {
+            struct rt_any pred = *--sp;
+            if (!rt_any_is_bool(pred)) {
+                node = code->nodes[pc[0]];
+                vm_error(node, node->node_type == RT_ASTNODE_LOOP ?
+                    "boolean value required for loop predicate" :
+                    "boolean value required for conditional predicate");
+            }
+            pc = rt_any_to_bool(pred) ? pc + 2 : code->instrs + pc[1];
+            DISPATCH();
+        }
+        CASE(CALL)
+            tail = false;
+            goto decode_call;
+        CASE(TAIL_CALL)
+            tail = true;
+        decode_call:
+            arg_count = pc[0];
+            node = code->nodes[pc[1]];
+            pc += 2;
+            callee = sp[-1 - (i32)arg_count];
+        call: {
+            if (!rt_any_is_func(callee)) {
+                vm_error(node, "expected a function value");
+            }
+            struct rt_type *func_type = rt_any_func_type(callee);
+            if (func_type->u.func.param_count != arg_count) {
+                vm_error(node, "expected %u arguments, got %u", func_type->u.func.param_count, arg_count);
+            }
+            for (u32 i = 0; i < arg_count; ++i) {
+                struct rt_type *param_type = func_type->u.func.params[i].type;
+                if (param_type != rt_types.any && rt_any_get_type(sp[(i32)i - (i32)arg_count]) != param_type) {
+                    vm_error(node, "type mismatch");
+                }
+            }
+            goto enter;
+        }
+        CASE(CALL_CHECKED)
+            tail = false;
+            goto decode_checked_call;
+        CASE(TAIL_CALL_CHECKED)
+            tail = true;
+        decode_checked_call:
+            arg_count = pc[0];
+            node = code->nodes[pc[1]];
+            pc += 2;
+            callee = sp[-1 - (i32)arg_count];
+        enter: {
+            struct rt_any *args = sp - arg_count;
+            struct rt_func *f = callee.u.func;
+            if (f->native) {
+                struct rt_any result = f->native(vm->task, args);
+                sp = args;
+                sp[-1] = result;
+                if (!code) {
+                    return result;
+                }
+                DISPATCH();
+            }
+            if (!f->code) {
+                f->code = compile_func(vm->mod, f, arg_count);
+            }
+            if (tail) {
+                /* the callee and arguments replace those of the current call */
+                if (fp + f->code->max_stack > stack_end) {
+                    vm_error(node, "stack overflow");
+                }
+                memmove(fp - 1, args - 1, sizeof(struct rt_any) * (arg_count + 1));
+                sp = fp + arg_count;
+            } else {
+                if (frame == frames_end || args + f->code->max_stack > stack_end) {
+                    vm_error(node, "stack overflow");
+                }
+                frame->code = code;
+                frame->pc = pc;
+                frame->fp = fp;
+                ++frame;
+                fp = args;
+            }
+            code = f->code;
+            pc = code->instrs;
+            DISPATCH();
+        }
+        CASE(CALL_NATIVE) {
+            arg_count = pc[0];
+            struct rt_func *f = code->consts[pc[1]].u.func;
+            pc += 2;
+            sp -= arg_count;
+            *sp = f->native(vm->task, sp);
+            ++sp;
+            DISPATCH();
+        }
+        CASE(ADD_I64)
+            sp[-2] = rt_new_i64(vm->task, (i64)((u64)rt_any_as_i64(sp[-2]) + (u64)rt_any_as_i64(sp[-1])));
+            --sp;
+            DISPATCH();
+        CASE(SUB_I64)
+            sp[-2] = rt_new_i64(vm->task, (i64)((u64)rt_any_as_i64(sp[-2]) - (u64)rt_any_as_i64(sp[-1])));
+            --sp;
+            DISPATCH();
+        CASE(MUL_I64)
+            sp[-2] = rt_new_i64(vm->task, (i64)((u64)rt_any_as_i64(sp[-2]) * (u64)rt_any_as_i64(sp[-1])));
+            --sp;
+            DISPATCH();
+        CASE(LT_I64)
+            sp[-2] = rt_new_bool(rt_any_as_i64(sp[-2]) < rt_any_as_i64(sp[-1]));
+            --sp;
+            DISPATCH();
+        CASE(LE_I64)
+            sp[-2] = rt_new_bool(rt_any_as_i64(sp[-2]) <= rt_any_as_i64(sp[-1]));
+            --sp;
+            DISPATCH();
+        CASE(EQ_I64)
+            sp[-2] = rt_new_bool(rt_any_as_i64(sp[-2]) == rt_any_as_i64(sp[-1]));
+            --sp;
+            DISPATCH();
+        CASE(CHECK_TYPE) {
+            struct rt_type *type = rt_any_get_type(sp[-1]);
+            if (type != code->nodes[*pc]->result_type) {
+                node = code->nodes[*pc];
+                vm_error(node, "expected a %s, got a %s", node->result_type->desc, type->desc);
+            }
+            ++pc;
+            DISPATCH();
+        }
+        CASE(RETURN) {
+            struct rt_any result = sp[-1];
+            sp = fp;
+            sp[-1] = result;
+            --frame;
+            code = frame->code;
+            pc = frame->pc;
+            fp = frame->fp;
+            if (!code) {
+                return result;
+            }
+            DISPATCH();
+        }
+#ifndef RT_VM_COMPUTED_GOTO
+        }
+#endif
+    }
+}
+
+#ifdef RT_VM_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+struct rt_any rt_vm_call(struct rt_task *task, struct rt_any func, u32 arg_count, struct rt_any *args) {
+    assert(rt_any_is_func(func));
+    assert(task->current_module);
+
+    struct vm_state *vm = malloc(sizeof(struct vm_state));
+    vm->task = task;
+    vm->mod = task->current_module;
+    vm->stack[0] = func;
+    if (arg_count) {
+        memcpy(vm->stack + 1, args, sizeof(struct rt_any) * arg_count);
+    }
+
+    struct rt_any result = vm_run(vm, func, arg_count);
+    free(vm);
+    return result;
+}
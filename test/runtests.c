@@ -1,9 +1,17 @@
 #include "testutil.h"
 
 void gc_test_suite(struct test_context *);
+void eval_test_suite(struct test_context *);
+void read_test_suite(struct test_context *);
+void hash_test_suite(struct test_context *);
+void hash_scalar_test_suite(struct test_context *);
 
 int main(int argc, char *argv[]) {
     struct test_context tc = {0,};
     gc_test_suite(&tc);
+    eval_test_suite(&tc);
+    read_test_suite(&tc);
+    hash_test_suite(&tc);
+    hash_scalar_test_suite(&tc);
     return 0;
 }
@@ -0,0 +1,306 @@
+#include "testutil.h"
+#include "rt.h"
+
+#include <stdlib.h>
+
+struct suite_data {
+    struct rt_task task;
+    struct rt_module mod;
+};
+
+static void setup(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    memset(&data->task, 0, sizeof(struct rt_task));
+    memset(&data->mod, 0, sizeof(struct rt_module));
+    data->task.current_module = &data->mod;
+}
+
+static void teardown(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    rt_task_cleanup(&data->task);
+}
+
+static void load(struct suite_data *data, const char *text) {
+    data->mod.root_block = rt_parse_module(&data->task, rt_read(&data->task, text));
+}
+
+/* calls a global function with both the tree walker and the VM, which must agree */
+static struct rt_any call(struct test_context *tc, const char *name, u32 arg_count, struct rt_any *args) {
+    struct suite_data *data = tc->suite_data;
+    struct rt_any func;
+    TEST_ASSERT(tc, rt_module_get_global(&data->mod, rt_get_symbol(name).u.symbol, &func));
+    struct rt_any ast_result = rt_ast_call(&data->task, func, arg_count, args);
+    struct rt_any vm_result = rt_vm_call(&data->task, func, arg_count, args);
+    TEST_ASSERT(tc, rt_any_get_type(ast_result) == rt_any_get_type(vm_result));
+    TEST_ASSERT(tc, rt_any_is_nil(ast_result) || rt_any_equals(ast_result, vm_result));
+    return vm_result;
+}
+
+static struct rt_any new_i64(struct test_context *tc, i64 value) {
+    struct suite_data *data = tc->suite_data;
+    return rt_new_i64(&data->task, value);
+}
+
+
+
+static void require_that_literals_and_blocks_evaluate(struct test_context *tc) {
+    load(tc->suite_data, "((def f (fn () 1 2 3)) (def g (fn () (do))))");
+    TEST_ASSERT(tc, rt_any_to_i64(call(tc, "f", 0, NULL)) == 3);
+    TEST_ASSERT(tc, rt_any_is_nil(call(tc, "g", 0, NULL)));
+}
+
+static void require_that_arguments_are_locals(struct test_context *tc) {
+    load(tc->suite_data, "((def second (fn (a b c) a c b)) (def sub (fn (a b) (- a b))))");
+    struct rt_any args[3] = { new_i64(tc, 1), new_i64(tc, 2), new_i64(tc, 3) };
+    TEST_ASSERT(tc, rt_any_to_i64(call(tc, "second", 3, args)) == 2);
+    TEST_ASSERT(tc, rt_any_to_i64(call(tc, "sub", 2, args)) == -1);
+}
+
+static void require_that_nested_calls_keep_their_arguments(struct test_context *tc) {
+    load(tc->suite_data, "((def add3 (fn (a b c) (+ a (+ b c)))) (def f (fn (x) (add3 (+ x 1) (add3 x x x) (- x 1)))))");
+    struct rt_any args[1] = { new_i64(tc, 10) };
+    TEST_ASSERT(tc, rt_any_to_i64(call(tc, "f", 1, args)) == 11 + 30 + 9);
+}
+
+static void require_that_conditionals_pick_a_branch(struct test_context *tc) {
+    load(tc->suite_data, "((def max (fn (a b) (if (< a b) b a))))");
+    struct rt_any args[2] = { new_i64(tc, 4), new_i64(tc, 7) };
+    TEST_ASSERT(tc, rt_any_to_i64(call(tc, "max", 2, args)) == 7);
+    args[1] = new_i64(tc, -7);
+    TEST_ASSERT(tc, rt_any_to_i64(call(tc, "max", 2, args)) == 4);
+}
+
+static void require_that_loops_run_until_predicate_is_false(struct test_context *tc) {
+    load(tc->suite_data,
+        "((def sum (fn (n) (while (< 0 n) (set n (- n 1))))) "
+        " (def sum-to (fn (n acc) (while (< 0 n) (set acc (+ acc n)) (set n (- n 1))) acc)))");
+    struct rt_any args[2] = { new_i64(tc, 100), new_i64(tc, 0) };
+    TEST_ASSERT(tc, rt_any_to_i64(call(tc, "sum-to", 2, args)) == 5050);
+    TEST_ASSERT(tc, rt_any_to_i64(call(tc, "sum", 1, args)) == 0);
+    args[0] = new_i64(tc, 0);
+    TEST_ASSERT(tc, rt_any_is_nil(call(tc, "sum", 1, args)));
+}
+
+static void require_that_globals_can_be_used_before_definition(struct test_context *tc) {
+    load(tc->suite_data,
+        "((def fib (fn (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))) "
+        " (def fib-of-ten (fn () (fib ten))) "
+        " (def ten 10))");
+    TEST_ASSERT(tc, rt_any_to_i64(call(tc, "fib-of-ten", 0, NULL)) == 55);
+}
+
+static void require_that_redefined_globals_are_seen_by_callers(struct test_context *tc) {
+    load(tc->suite_data, "((def f (fn () (+ (g) one))) (def g (fn () 1)) (def one 1))");
+    TEST_ASSERT(tc, rt_any_to_i64(call(tc, "f", 0, NULL)) == 2);
+    load(tc->suite_data, "((def g (fn () 2)) (def one 10))");
+    TEST_ASSERT(tc, rt_any_to_i64(call(tc, "f", 0, NULL)) == 12);
+}
+
+static void require_that_globals_can_be_redefined_with_another_type(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    /* later is not defined yet, so it is read when called. k is inlined */
+    load(data, "((def f (fn () later)) (def add (fn (x:i64) (+ x later))) (def k 1) (def g (fn () k)))");
+    load(data, "((def later 1))");
+    struct rt_any args[1] = { new_i64(tc, 2) };
+    TEST_ASSERT(tc, rt_any_to_i64(call(tc, "f", 0, NULL)) == 1);
+    TEST_ASSERT(tc, rt_any_to_i64(call(tc, "add", 1, args)) == 3);
+    TEST_ASSERT(tc, rt_any_to_i64(call(tc, "g", 0, NULL)) == 1);
+
+    load(data, "((def later 0.5) (def k \"k\"))");
+    TEST_ASSERT(tc, rt_any_to_f64(call(tc, "f", 0, NULL)) == 0.5);
+    TEST_ASSERT(tc, rt_any_to_f64(call(tc, "add", 1, args)) == 2.5);
+    struct rt_any k = call(tc, "g", 0, NULL);
+    TEST_ASSERT(tc, strcmp(k.u.string->data, "k") == 0);
+}
+
+/* the body of a function global, inside the scope of its parameters */
+static struct rt_astnode *func_body(struct test_context *tc, const char *name) {
+    struct suite_data *data = tc->suite_data;
+    struct rt_any func;
+    TEST_ASSERT(tc, rt_module_get_global(&data->mod, rt_get_symbol(name).u.symbol, &func));
+    struct rt_astnode *body = func.u.func->body_expr;
+    if (body->node_type == RT_ASTNODE_SCOPE) {
+        body = body->u.scope.expr;
+    }
+    return body;
+}
+
+static void require_that_proven_i64_operations_are_specialized(struct test_context *tc) {
+    load(tc->suite_data, "((def fib (fn (n:i64):i64 (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))))");
+    struct rt_any args[1] = { new_i64(tc, 20) };
+    TEST_ASSERT(tc, rt_any_to_i64(call(tc, "fib", 1, args)) == 6765);
+
+    struct rt_astnode *body = func_body(tc, "fib");
+    TEST_ASSERT(tc, body->result_type == rt_types.i64);
+    struct rt_astnode *cond = body;
+    TEST_ASSERT(tc, cond->u.cond.pred_expr->node_type == RT_ASTNODE_I64_OP);
+    TEST_ASSERT(tc, cond->u.cond.pred_expr->result_type == rt_types._bool);
+    struct rt_astnode *add = cond->u.cond.else_expr;
+    TEST_ASSERT(tc, add->node_type == RT_ASTNODE_I64_OP);
+    TEST_ASSERT(tc, add->u.i64_op.lhs->node_type == RT_ASTNODE_CALL && add->u.i64_op.lhs->u.call.checked);
+}
+
+static void require_that_unproven_operations_are_left_generic(struct test_context *tc) {
+    load(tc->suite_data, "((def half (fn (n:i64) (* n 0.5))) (def add (fn (a b) (+ a b))) (def f (fn (x:i64) (half x))))");
+    struct rt_any args[2] = { new_i64(tc, 5), rt_new_f64(0.25) };
+    TEST_ASSERT(tc, rt_any_to_f64(call(tc, "half", 1, args)) == 2.5);
+    TEST_ASSERT(tc, rt_any_to_f64(call(tc, "add", 2, args)) == 5.25);
+    TEST_ASSERT(tc, rt_any_to_f64(call(tc, "f", 1, args)) == 2.5);
+
+    TEST_ASSERT(tc, func_body(tc, "half")->node_type == RT_ASTNODE_CALL);
+    TEST_ASSERT(tc, func_body(tc, "add")->node_type == RT_ASTNODE_CALL);
+    TEST_ASSERT(tc, func_body(tc, "add")->result_type == rt_types.any);
+    TEST_ASSERT(tc, func_body(tc, "f")->u.call.checked);
+}
+
+static void require_that_unproven_declared_types_are_checked_at_run_time(struct test_context *tc) {
+    load(tc->suite_data,
+        "((def id (fn (a) a)) "
+        " (def add (fn (x:i64 y):i64 (+ x y))) "
+        " (def inc (fn (x:i64 y) (set x (id y)) (+ x 1))) "
+        " (def pick (fn (p n):i64 (if p n (id n)))))");
+    struct rt_any args[2] = { new_i64(tc, 1), new_i64(tc, 5) };
+    TEST_ASSERT(tc, rt_any_to_i64(call(tc, "add", 2, args)) == 6);
+    TEST_ASSERT(tc, rt_any_to_i64(call(tc, "inc", 2, args)) == 6);
+    args[0] = rt_new_bool(false);
+    TEST_ASSERT(tc, rt_any_to_i64(call(tc, "pick", 2, args)) == 5);
+
+    TEST_ASSERT(tc, func_body(tc, "add")->node_type == RT_ASTNODE_CHECK_TYPE);
+    TEST_ASSERT(tc, func_body(tc, "add")->result_type == rt_types.i64);
+    struct rt_astnode *set = func_body(tc, "inc")->u.block.exprs[0];
+    TEST_ASSERT(tc, set->u.set_local.expr->node_type == RT_ASTNODE_CHECK_TYPE);
+    TEST_ASSERT(tc, func_body(tc, "inc")->u.block.exprs[1]->node_type == RT_ASTNODE_I64_OP);
+    struct rt_astnode *cond = func_body(tc, "pick");
+    TEST_ASSERT(tc, cond->u.cond.then_expr->node_type == RT_ASTNODE_CHECK_TYPE);
+    struct rt_astnode *tail = cond->u.cond.else_expr;
+    TEST_ASSERT(tc, tail->node_type == RT_ASTNODE_CHECK_TYPE);
+    TEST_ASSERT(tc, !tail->u.check_type.expr->u.call.tail);
+}
+
+static void require_that_constant_expressions_are_folded(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    load(data, "((def f (fn () (if (< one 2) (+ one 2) (g)))) (def one 1) (def g (fn () one)))");
+    TEST_ASSERT(tc, rt_any_to_i64(call(tc, "f", 0, NULL)) == 3);
+
+    struct rt_astnode *body = func_body(tc, "f");
+    TEST_ASSERT(tc, body->node_type == RT_ASTNODE_LITERAL);
+    TEST_ASSERT(tc, rt_any_to_i64(body->const_value) == 3);
+    TEST_ASSERT(tc, func_body(tc, "g")->node_type == RT_ASTNODE_LITERAL);
+    /* the calls of g are not inlined, so g can be redefined */
+    struct rt_global *one = data->mod.globals + rt_module_global_index(&data->mod, rt_get_symbol("one").u.symbol);
+    TEST_ASSERT(tc, one->dependent_count == 2);
+    TEST_ASSERT(tc, !data->mod.globals[rt_module_global_index(&data->mod, rt_get_symbol("g").u.symbol)].dependent_count);
+}
+
+static void require_that_redefined_globals_are_folded_again(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    load(data, "((def f (fn () (if (< one 2) (+ one 2) (g)))) (def one 1) (def g (fn () one)) (def h (fn () 7)))");
+    struct rt_any f;
+    TEST_ASSERT(tc, rt_module_get_global(&data->mod, rt_get_symbol("f").u.symbol, &f));
+    TEST_ASSERT(tc, rt_any_to_i64(call(tc, "f", 0, NULL)) == 3);
+    /* the kept forms must outlive a collection */
+    rt_gc_run(&data->task);
+
+    load(data, "((def one 5))");
+    TEST_ASSERT(tc, rt_any_to_i64(call(tc, "f", 0, NULL)) == 5);
+    TEST_ASSERT(tc, rt_any_to_i64(call(tc, "g", 0, NULL)) == 5);
+    /* the function keeps its identity, with the new body */
+    struct rt_any new_f;
+    TEST_ASSERT(tc, rt_module_get_global(&data->mod, rt_get_symbol("f").u.symbol, &new_f));
+    TEST_ASSERT(tc, new_f.u.func == f.u.func);
+    TEST_ASSERT(tc, func_body(tc, "f")->node_type == RT_ASTNODE_CALL);
+    TEST_ASSERT(tc, rt_any_to_i64(func_body(tc, "g")->const_value) == 5);
+
+    /* only defs with globals folded in keep their form */
+    struct rt_global *g = data->mod.globals + rt_module_global_index(&data->mod, rt_get_symbol("g").u.symbol);
+    struct rt_global *h = data->mod.globals + rt_module_global_index(&data->mod, rt_get_symbol("h").u.symbol);
+    TEST_ASSERT(tc, !rt_any_is_nil(g->form));
+    TEST_ASSERT(tc, rt_any_is_nil(h->form));
+
+    /* a dependent redefined in the same load is only folded as its new def */
+    load(data, "((def g (fn () 2)) (def one 6))");
+    g = data->mod.globals + rt_module_global_index(&data->mod, rt_get_symbol("g").u.symbol);
+    TEST_ASSERT(tc, rt_any_is_nil(g->form));
+    TEST_ASSERT(tc, rt_any_to_i64(call(tc, "f", 0, NULL)) == 2);
+}
+
+static void require_that_unused_pure_expressions_are_dropped(struct test_context *tc) {
+    load(tc->suite_data, "((def f (fn (x) 1 x (while #f (set x 2)) (do 3 x))))");
+    struct rt_any args[1] = { new_i64(tc, 5) };
+    TEST_ASSERT(tc, rt_any_to_i64(call(tc, "f", 1, args)) == 5);
+    TEST_ASSERT(tc, func_body(tc, "f")->node_type == RT_ASTNODE_GET_LOCAL);
+}
+
+/* deeper than either evaluator could go if each call kept its frame */
+static void require_that_tail_calls_run_in_constant_stack(struct test_context *tc) {
+    load(tc->suite_data,
+        "((def count (fn (n acc) (if (< n 1) acc (count (- n 1) (+ acc 1))))) "
+        " (def even? (fn (n:i64) (if (= n 0) #t (odd? (- n 1))))) "
+        " (def odd? (fn (n:i64) (if (= n 0) #f (even? (- n 1))))) "
+        " (def sum (fn (n) (+ n (count n 0)))))");
+    struct rt_any args[2] = { new_i64(tc, 1000000), new_i64(tc, 0) };
+    TEST_ASSERT(tc, rt_any_to_i64(call(tc, "count", 2, args)) == 1000000);
+    TEST_ASSERT(tc, rt_any_to_i64(call(tc, "sum", 1, args)) == 2000000);
+    TEST_ASSERT(tc, rt_any_to_bool(call(tc, "even?", 1, args)));
+    args[0] = new_i64(tc, 1000001);
+    TEST_ASSERT(tc, rt_any_to_bool(call(tc, "odd?", 1, args)));
+}
+
+static void require_that_flattened_bodies_are_in_post_order(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    load(data, "((def f (fn (a b) (if (< a b) (g a) (do (g b) b)))) (def g (fn (x) x)))");
+    struct rt_any func;
+    TEST_ASSERT(tc, rt_module_get_global(&data->mod, rt_get_symbol("f").u.symbol, &func));
+    struct rt_flat_body *body = rt_flatten(&data->mod.ast_arena, func.u.func->body_expr);
+
+    /* scope, cond, call of <, a, b, call of g, check of g, g, a, block, call of g,
+       check of g, g, b, b */
+    TEST_ASSERT(tc, body->node_count == 16);
+    TEST_ASSERT(tc, body->const_count == 1);
+    TEST_ASSERT(tc, body->extra_count == 2 + 1 + 2 + 1);
+    struct rt_flat_node *root = body->nodes + body->node_count - 1;
+    TEST_ASSERT(tc, root->node_type == RT_ASTNODE_SCOPE && root->a == 2);
+    for (u32 i = 0; i < body->node_count; ++i) {
+        struct rt_flat_node *node = body->nodes + i;
+        if (node->node_type == RT_ASTNODE_COND) {
+            TEST_ASSERT(tc, node->a < i && node->b < i && node->c < i);
+            TEST_ASSERT(tc, body->nodes[node->a].node_type == RT_ASTNODE_CALL);
+            TEST_ASSERT(tc, body->nodes[node->c].node_type == RT_ASTNODE_BLOCK);
+        }
+        if (node->node_type == RT_ASTNODE_CALL) {
+            TEST_ASSERT(tc, node->a < i);
+            for (u32 j = 0; j < node->b; ++j) {
+                TEST_ASSERT(tc, body->extra[node->c + j] < i);
+            }
+        }
+    }
+    struct rt_any args[2] = { new_i64(tc, 3), new_i64(tc, 2) };
+    TEST_ASSERT(tc, rt_any_to_i64(call(tc, "f", 2, args)) == 2);
+}
+
+TEST_SUITE_BEGIN(eval_test_suite, setup, teardown)
+{
+    rt_init();
+    tc->suite_data = calloc(1, sizeof(struct suite_data));
+}
+TEST_SUITE_TEST(require_that_literals_and_blocks_evaluate)
+TEST_SUITE_TEST(require_that_arguments_are_locals)
+TEST_SUITE_TEST(require_that_nested_calls_keep_their_arguments)
+TEST_SUITE_TEST(require_that_conditionals_pick_a_branch)
+TEST_SUITE_TEST(require_that_loops_run_until_predicate_is_false)
+TEST_SUITE_TEST(require_that_globals_can_be_used_before_definition)
+TEST_SUITE_TEST(require_that_redefined_globals_are_seen_by_callers)
+TEST_SUITE_TEST(require_that_globals_can_be_redefined_with_another_type)
+TEST_SUITE_TEST(require_that_proven_i64_operations_are_specialized)
+TEST_SUITE_TEST(require_that_unproven_operations_are_left_generic)
+TEST_SUITE_TEST(require_that_unproven_declared_types_are_checked_at_run_time)
+TEST_SUITE_TEST(require_that_constant_expressions_are_folded)
+TEST_SUITE_TEST(require_that_redefined_globals_are_folded_again)
+TEST_SUITE_TEST(require_that_unused_pure_expressions_are_dropped)
+TEST_SUITE_TEST(require_that_tail_calls_run_in_constant_stack)
+TEST_SUITE_TEST(require_that_flattened_bodies_are_in_post_order)
+{
+    free(tc->suite_data);
+    rt_cleanup();
+}
+TEST_SUITE_END()
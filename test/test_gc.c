@@ -19,8 +19,7 @@ static void free_func(void *userdata, void *ptr) {
         data->max_freed = data->max_freed ? data->max_freed * 2 : 16;
         data->freed = realloc(data->freed, sizeof(void *) * data->max_freed);
     }
-    data->freed[data->num_freed++] = (char *)ptr + sizeof(struct rt_box);
-    free(ptr);
+    data->freed[data->num_freed++] = ptr;
 }
 
 static void setup(struct test_context *tc) {
@@ -57,7 +56,359 @@ static void require_that_simple_referenced_is_not_collected(struct test_context
     TEST_ASSERT(tc, data->num_freed == 0);
 }
 
+static void require_that_collected_memory_is_reused(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    /* keep a neighbour alive so the page is not given back to the system */
+    struct rt_any keep = rt_new_cons(&data->task, rt_nil, rt_nil);
+    void *roots[] = { data->task.roots, data->typelist_any, &keep };
+    data->task.roots = roots;
+    void *ptr = rt_new_cons(&data->task, rt_nil, rt_nil).u.cons;
+    rt_gc_run(&data->task);
+    TEST_ASSERT(tc, data->num_freed == 1);
+    struct rt_cons *cons = rt_new_cons(&data->task, rt_nil, rt_nil).u.cons;
+    TEST_ASSERT(tc, (void *)cons == ptr);
+}
+
+static void require_that_large_unreferenced_is_collected(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    struct rt_type *array_type = rt_gettype_boxed_array(rt_types.any, 0);
+    struct rt_any small = rt_new_array(&data->task, 2, array_type);
+    struct rt_any large = rt_new_array(&data->task, 1000, array_type);
+    rt_box_array_ref(large.u.ptr, struct rt_any, 999) = small;
+    rt_gc_run(&data->task);
+    TEST_ASSERT(tc, data->num_freed == 2);
+}
+
+static void require_that_only_unreferenced_are_collected_across_pages(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    struct rt_any arr = rt_new_array(&data->task, 5000, rt_gettype_boxed_array(rt_types.any, 0));
+    void *roots[] = { data->task.roots, data->typelist_any, &arr };
+    data->task.roots = roots;
+    for (u32 i = 0; i < 5000; ++i) {
+        rt_box_array_ref(arr.u.ptr, struct rt_any, i) = rt_new_cons(&data->task, rt_new_u32(i), rt_nil);
+    }
+    for (u32 i = 0; i < 5000; i += 2) {
+        rt_box_array_ref(arr.u.ptr, struct rt_any, i) = rt_nil;
+    }
+    rt_gc_run(&data->task);
+    TEST_ASSERT(tc, data->num_freed == 2500);
+    for (u32 i = 1; i < 5000; i += 2) {
+        struct rt_any cons = rt_box_array_ref(arr.u.ptr, struct rt_any, i);
+        TEST_ASSERT(tc, rt_any_to_u64(rt_car(cons)) == i);
+    }
+}
+
+static void require_that_pointers_in_array_of_structs_are_marked(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    struct pair { u64 n; struct rt_cons *cons; };
+    struct rt_struct_field fields[2] = {
+        { rt_gettype_simple(RT_KIND_UNSIGNED, sizeof(u64)), "n", offsetof(struct pair, n) },
+        { rt_gettype_boxed(rt_types.cons), "cons", offsetof(struct pair, cons) }
+    };
+    struct rt_type *pair_type = rt_gettype_struct("pair", sizeof(struct pair), 2, fields);
+    TEST_ASSERT(tc, pair_type->gc_slot_count == 1);
+    struct rt_any arr = rt_new_array(&data->task, 3, rt_gettype_boxed_array(pair_type, 0));
+    void *roots[] = { data->task.roots, data->typelist_any, &arr };
+    data->task.roots = roots;
+    for (u32 i = 1; i < 3; ++i) {
+        rt_box_array_ref(arr.u.ptr, struct pair, i).cons = rt_new_cons(&data->task, rt_new_u32(i), rt_nil).u.cons;
+    }
+    rt_new_cons(&data->task, rt_nil, rt_nil);
+    rt_gc_run(&data->task);
+    TEST_ASSERT(tc, data->num_freed == 1);
+}
+
+static void require_that_marking_long_list_does_not_recurse(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    struct rt_any list = rt_nil;
+    void *roots[] = { data->task.roots, data->typelist_any, &list };
+    data->task.roots = roots;
+    for (u32 i = 0; i < 1000000; ++i) {
+        list = rt_new_cons(&data->task, rt_nil, list);
+    }
+    rt_gc_run(&data->task);
+    TEST_ASSERT(tc, data->num_freed == 0);
+    list = rt_nil;
+    rt_gc_run(&data->task);
+    TEST_ASSERT(tc, data->num_freed == 1000000);
+}
+
+static void require_that_minor_gc_only_collects_young(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    struct rt_any old = rt_new_cons(&data->task, rt_nil, rt_nil);
+    void *roots[] = { data->task.roots, data->typelist_any, &old };
+    data->task.roots = roots;
+    rt_gc_run(&data->task);
+    void *young = rt_new_cons(&data->task, rt_nil, rt_nil).u.cons;
+    void *old_ptr = old.u.cons;
+    old = rt_nil;
+    rt_gc_run_minor(&data->task);
+    TEST_ASSERT(tc, data->num_freed == 1);
+    TEST_ASSERT(tc, data->freed[0] == young);
+    rt_gc_run(&data->task);
+    TEST_ASSERT(tc, data->num_freed == 2);
+    TEST_ASSERT(tc, data->freed[1] == old_ptr);
+}
+
+static void require_that_young_stored_in_old_survives_minor_gc(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    struct rt_any old = rt_new_cons(&data->task, rt_nil, rt_nil);
+    void *roots[] = { data->task.roots, data->typelist_any, &old };
+    data->task.roots = roots;
+    rt_gc_run(&data->task);
+    struct rt_any young = rt_new_cons(&data->task, rt_new_u32(1), rt_new_cons(&data->task, rt_new_u32(2), rt_nil));
+    rt_set_cdr(&data->task, old, young);
+    young = rt_nil;
+    rt_gc_run_minor(&data->task);
+    TEST_ASSERT(tc, data->num_freed == 0);
+    rt_set_cdr(&data->task, old, rt_nil);
+    rt_gc_run_minor(&data->task);
+    TEST_ASSERT(tc, data->num_freed == 0); /* promoted by the previous minor collection */
+    rt_gc_run(&data->task);
+    TEST_ASSERT(tc, data->num_freed == 2);
+}
+
+static void require_that_incremental_gc_keeps_boxes_stored_while_marking(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    struct rt_type *types[] = { rt_types.any, rt_types.any, NULL };
+    struct rt_any list = rt_nil;
+    for (u32 i = 0; i < 10; ++i) {
+        list = rt_new_cons(&data->task, rt_nil, list);
+    }
+    struct rt_any scanned = rt_new_cons(&data->task, rt_nil, rt_nil);
+    void *roots[] = { data->task.roots, types, &list, &scanned };
+    data->task.roots = roots;
+
+    TEST_ASSERT(tc, !rt_gc_step(&data->task, 0));
+    TEST_ASSERT(tc, !rt_gc_step(&data->task, 1)); /* the last pushed root is scanned first */
+    rt_set_car(&data->task, scanned, rt_new_cons(&data->task, rt_nil, rt_nil));
+    rt_new_cons(&data->task, rt_nil, rt_nil);
+    while (!rt_gc_step(&data->task, 1)) {
+    }
+    TEST_ASSERT(tc, data->num_freed == 1);
+    TEST_ASSERT(tc, rt_any_is_cons(rt_car(scanned)));
+}
+
+static void require_that_parallel_marking_finds_all_reachable(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    struct rt_any arr = rt_new_array(&data->task, 1000, rt_gettype_boxed_array(rt_types.any, 0));
+    void *roots[] = { data->task.roots, data->typelist_any, &arr };
+    data->task.roots = roots;
+    for (u32 i = 0; i < 1000; ++i) {
+        struct rt_any list = rt_nil;
+        for (u32 j = 0; j < 100; ++j) {
+            list = rt_new_cons(&data->task, rt_new_u32(j), list);
+        }
+        rt_box_array_ref(arr.u.ptr, struct rt_any, i) = list;
+    }
+    for (u32 i = 0; i < 1000; i += 2) {
+        rt_box_array_ref(arr.u.ptr, struct rt_any, i) = rt_weak_any(rt_box_array_ref(arr.u.ptr, struct rt_any, i));
+    }
+    data->task.gc_mark_threads = 4;
+    rt_gc_run(&data->task);
+    TEST_ASSERT(tc, data->num_freed == 500 * 100);
+    for (u32 i = 0; i < 1000; ++i) {
+        struct rt_any list = rt_box_array_ref(arr.u.ptr, struct rt_any, i);
+        TEST_ASSERT(tc, (i & 1) ? rt_any_is_cons(list) : rt_any_is_nil(list));
+    }
 
+    /* the pool is started again for the clearing of each collection */
+    for (u32 i = 1; i < 1000; i += 2) {
+        rt_box_array_ref(arr.u.ptr, struct rt_any, i) = rt_weak_any(rt_box_array_ref(arr.u.ptr, struct rt_any, i));
+    }
+    rt_gc_run(&data->task);
+    TEST_ASSERT(tc, data->num_freed == 1000 * 100);
+    for (u32 i = 0; i < 1000; ++i) {
+        TEST_ASSERT(tc, rt_any_is_nil(rt_box_array_ref(arr.u.ptr, struct rt_any, i)));
+    }
+}
+
+/* in the compact representation, these cover every encoding: immediate and
+   boxed 64-bit integers, offset f64s and the small scalars */
+static void require_that_scalars_keep_their_values_across_collection(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    struct rt_any arr = rt_new_array(&data->task, 12, rt_gettype_boxed_array(rt_types.any, 0));
+    void *roots[] = { data->task.roots, data->typelist_any, &arr };
+    data->task.roots = roots;
+    struct rt_any *values = &rt_box_array_ref(arr.u.ptr, struct rt_any, 0);
+    values[0] = rt_new_i64(&data->task, -1);
+    values[1] = rt_new_i64(&data->task, INT64_MIN);
+    values[2] = rt_new_i64(&data->task, INT64_MAX);
+    values[3] = rt_new_i64(&data->task, (i64)1 << 47);
+    values[4] = rt_new_u64(&data->task, UINT64_MAX);
+    values[5] = rt_new_u64(&data->task, 12345);
+    values[6] = rt_new_f64(-0.5);
+    values[7] = rt_new_f64(0.0 / 0.0);
+    values[8] = rt_new_u8(200);
+    values[9] = rt_new_i32(INT32_MIN);
+    values[10] = rt_new_bool(true);
+    values[11] = rt_new_f32(1.5f);
+    for (u32 i = 0; i < 1000; ++i) {
+        rt_new_i64(&data->task, INT64_MIN + i);
+    }
+    rt_gc_run(&data->task);
+    TEST_ASSERT(tc, rt_any_to_i64(values[0]) == -1);
+    TEST_ASSERT(tc, rt_any_to_i64(values[1]) == INT64_MIN);
+    TEST_ASSERT(tc, rt_any_to_i64(values[2]) == INT64_MAX);
+    TEST_ASSERT(tc, rt_any_to_i64(values[3]) == (i64)1 << 47);
+    TEST_ASSERT(tc, rt_any_to_u64(values[4]) == UINT64_MAX);
+    TEST_ASSERT(tc, rt_any_to_u64(values[5]) == 12345);
+    TEST_ASSERT(tc, rt_any_to_f64(values[6]) == -0.5);
+    TEST_ASSERT(tc, rt_any_is_real(values[7]) && rt_any_to_f64(values[7]) != rt_any_to_f64(values[7]));
+    TEST_ASSERT(tc, rt_any_get_type(values[8]) == rt_types.u8 && rt_any_to_u64(values[8]) == 200);
+    TEST_ASSERT(tc, rt_any_get_type(values[9]) == rt_types.i32 && rt_any_to_i64(values[9]) == INT32_MIN);
+    TEST_ASSERT(tc, rt_any_to_bool(values[10]));
+    TEST_ASSERT(tc, rt_any_get_type(values[11]) == rt_types.f32 && rt_any_to_f64(values[11]) == 1.5);
+    TEST_ASSERT(tc, rt_any_equals(values[5], rt_new_i64(&data->task, 12345)));
+    TEST_ASSERT(tc, !rt_any_equals(values[0], values[4]));
+}
+
+
+
+static void require_that_lazy_sweep_frees_on_allocation(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    data->task.gc_lazy_sweep = true;
+    struct rt_any keep = rt_new_cons(&data->task, rt_nil, rt_nil);
+    void *roots[] = { data->task.roots, data->typelist_any, &keep };
+    data->task.roots = roots;
+    void *ptr = rt_new_cons(&data->task, rt_nil, rt_nil).u.cons;
+    rt_gc_run(&data->task);
+    TEST_ASSERT(tc, data->num_freed == 0);
+    struct rt_cons *cons = rt_new_cons(&data->task, rt_nil, rt_nil).u.cons;
+    TEST_ASSERT(tc, data->num_freed == 1);
+    TEST_ASSERT(tc, data->freed[0] == ptr);
+    TEST_ASSERT(tc, (void *)cons == ptr);
+}
+
+static void require_that_finish_sweep_frees_the_rest(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    data->task.gc_lazy_sweep = true;
+    struct rt_any keep = rt_new_cons(&data->task, rt_nil, rt_nil);
+    void *roots[] = { data->task.roots, data->typelist_any, &keep };
+    data->task.roots = roots;
+    for (u32 i = 0; i < 10000; ++i) {
+        rt_new_cons(&data->task, rt_nil, rt_nil);
+    }
+    rt_gc_run(&data->task);
+    TEST_ASSERT(tc, data->num_freed == 0);
+    rt_gc_finish_sweep(&data->task);
+    TEST_ASSERT(tc, data->num_freed == 10000);
+    rt_gc_run(&data->task);
+    rt_gc_finish_sweep(&data->task);
+    TEST_ASSERT(tc, data->num_freed == 10000);
+}
+
+static void require_that_finish_sweep_gives_empty_pages_back(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    data->task.gc_lazy_sweep = true;
+    struct rt_any keep = rt_new_cons(&data->task, rt_nil, rt_nil);
+    void *roots[] = { data->task.roots, data->typelist_any, &keep };
+    data->task.roots = roots;
+    for (u32 i = 0; i < 10000; ++i) {
+        rt_new_cons(&data->task, rt_nil, rt_nil);
+    }
+    u32 pages = rt_gc_page_count(&data->task);
+    TEST_ASSERT(tc, pages > 1);
+    rt_gc_run(&data->task);
+    rt_gc_finish_sweep(&data->task);
+    TEST_ASSERT(tc, data->num_freed == 10000);
+    TEST_ASSERT(tc, rt_gc_page_count(&data->task) < pages);
+}
+
+/* the reader's forms are not kept, so code must keep its literals alive */
+static void require_that_literals_in_code_outlive_the_read_forms(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    struct rt_module mod = {0,};
+    data->task.current_module = &mod;
+    rt_parse_module(&data->task, rt_read(&data->task,
+        "((def f (fn () \"hello world string\")) "
+        " (def g (fn () (fn () \"inner\"))) "
+        " (def h (fn () 1125899906842624)))"));
+    rt_gc_run(&data->task);
+    TEST_ASSERT(tc, data->num_freed > 0);
+    for (u32 i = 0; i < 1000; ++i) {
+        rt_new_string(&data->task, "something else entirely");
+    }
+
+    struct rt_any f, g, h;
+    TEST_ASSERT(tc, rt_module_get_global(&mod, rt_get_symbol("f").u.symbol, &f));
+    TEST_ASSERT(tc, rt_module_get_global(&mod, rt_get_symbol("g").u.symbol, &g));
+    TEST_ASSERT(tc, rt_module_get_global(&mod, rt_get_symbol("h").u.symbol, &h));
+    struct rt_any str = rt_ast_call(&data->task, f, 0, NULL);
+    TEST_ASSERT(tc, strcmp(str.u.string->data, "hello world string") == 0);
+    struct rt_any inner = rt_ast_call(&data->task, g, 0, NULL);
+    TEST_ASSERT(tc, rt_any_is_func(inner));
+    str = rt_vm_call(&data->task, inner, 0, NULL);
+    TEST_ASSERT(tc, strcmp(str.u.string->data, "inner") == 0);
+    TEST_ASSERT(tc, rt_any_to_i64(rt_vm_call(&data->task, h, 0, NULL)) == 1125899906842624);
+    for (u32 i = 0; i < data->num_freed; ++i) {
+        TEST_ASSERT(tc, data->freed[i] != str.u.string && data->freed[i] != inner.u.func);
+    }
+    /* the module goes out of scope here */
+    rt_task_cleanup(&data->task);
+}
+
+static void require_that_weak_table_entries_go_with_their_keys(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    struct rt_weakmap map;
+    struct rt_gc_weak_table weak;
+    rt_weakmap_init(&map, 16);
+    rt_weakmap_init_weak(&map, &weak, rt_types.any);
+    rt_gc_add_weak_table(&data->task, &weak);
+
+    struct rt_any keep = rt_new_cons(&data->task, rt_nil, rt_nil);
+    void *roots[] = { data->task.roots, data->typelist_any, &keep };
+    data->task.roots = roots;
+    rt_weakmap_put(&map, keep.u.cons, rt_new_u32(1));
+    rt_weakmap_put(&map, rt_new_cons(&data->task, rt_nil, rt_nil).u.cons, rt_new_u32(2));
+    rt_gc_run_minor(&data->task);
+    TEST_ASSERT(tc, data->num_freed == 1);
+    TEST_ASSERT(tc, map.used == 1);
+    struct rt_any value;
+    TEST_ASSERT(tc, rt_weakmap_get(&map, keep.u.cons, &value) && rt_any_to_u64(value) == 1);
+
+    keep = rt_nil;
+    rt_gc_run(&data->task);
+    TEST_ASSERT(tc, data->num_freed == 2);
+    TEST_ASSERT(tc, map.used == 0);
+
+    rt_gc_remove_weak_table(&data->task, &weak);
+    rt_weakmap_free(&map);
+}
+
+static void require_that_weak_table_values_live_only_while_their_keys_do(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    struct rt_weakmap map;
+    struct rt_gc_weak_table weak;
+    rt_weakmap_init(&map, 16);
+    rt_weakmap_init_weak(&map, &weak, rt_types.any);
+    rt_gc_add_weak_table(&data->task, &weak);
+
+    /* keep -> (second), second -> (second), third -> (third) */
+    struct rt_any keep = rt_new_cons(&data->task, rt_nil, rt_nil);
+    void *roots[] = { data->task.roots, data->typelist_any, &keep };
+    data->task.roots = roots;
+    struct rt_any second = rt_new_cons(&data->task, rt_nil, rt_nil);
+    struct rt_any third = rt_new_cons(&data->task, rt_nil, rt_nil);
+    rt_weakmap_put(&map, keep.u.cons, rt_new_cons(&data->task, second, rt_nil));
+    rt_weakmap_put(&map, second.u.cons, rt_new_cons(&data->task, second, rt_nil));
+    rt_weakmap_put(&map, third.u.cons, rt_new_cons(&data->task, third, rt_nil));
+    /* with several threads, the values are marked once the threads are done */
+    data->task.gc_mark_threads = 2;
+    rt_gc_run(&data->task);
+    TEST_ASSERT(tc, data->num_freed == 2);
+    TEST_ASSERT(tc, map.used == 2);
+    struct rt_any value;
+    TEST_ASSERT(tc, rt_weakmap_get(&map, second.u.cons, &value) && rt_car(value).u.cons == second.u.cons);
+
+    keep = rt_nil;
+    rt_gc_run(&data->task);
+    TEST_ASSERT(tc, data->num_freed == 6);
+    TEST_ASSERT(tc, map.used == 0);
+
+    rt_gc_remove_weak_table(&data->task, &weak);
+    rt_weakmap_free(&map);
+}
 
 TEST_SUITE_BEGIN(gc_test_suite, setup, teardown)
 {
@@ -69,6 +420,22 @@ TEST_SUITE_BEGIN(gc_test_suite, setup, teardown)
 }
 TEST_SUITE_TEST(require_that_simple_unreferenced_is_collected)
 TEST_SUITE_TEST(require_that_simple_referenced_is_not_collected)
+TEST_SUITE_TEST(require_that_collected_memory_is_reused)
+TEST_SUITE_TEST(require_that_large_unreferenced_is_collected)
+TEST_SUITE_TEST(require_that_only_unreferenced_are_collected_across_pages)
+TEST_SUITE_TEST(require_that_pointers_in_array_of_structs_are_marked)
+TEST_SUITE_TEST(require_that_marking_long_list_does_not_recurse)
+TEST_SUITE_TEST(require_that_minor_gc_only_collects_young)
+TEST_SUITE_TEST(require_that_young_stored_in_old_survives_minor_gc)
+TEST_SUITE_TEST(require_that_incremental_gc_keeps_boxes_stored_while_marking)
+TEST_SUITE_TEST(require_that_parallel_marking_finds_all_reachable)
+TEST_SUITE_TEST(require_that_scalars_keep_their_values_across_collection)
+TEST_SUITE_TEST(require_that_lazy_sweep_frees_on_allocation)
+TEST_SUITE_TEST(require_that_finish_sweep_frees_the_rest)
+TEST_SUITE_TEST(require_that_finish_sweep_gives_empty_pages_back)
+TEST_SUITE_TEST(require_that_literals_in_code_outlive_the_read_forms)
+TEST_SUITE_TEST(require_that_weak_table_entries_go_with_their_keys)
+TEST_SUITE_TEST(require_that_weak_table_values_live_only_while_their_keys_do)
 {
     struct suite_data *data = tc->suite_data;
     rt_task_cleanup(&data->task);
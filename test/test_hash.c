@@ -0,0 +1,380 @@
+#include "testutil.h"
+#include "rt.h"
+
+#include <stdlib.h>
+
+/* test_hash_scalar.c builds this file again with RT_HASH_NO_SIMD, under
+   another suite name */
+#ifndef HASH_TEST_SUITE
+#define HASH_TEST_SUITE hash_test_suite
+#endif
+/* expands the suite name before TEST_SUITE_BEGIN prints it */
+#define HASH_TEST_SUITE_BEGIN(SuiteFunc) TEST_SUITE_BEGIN(SuiteFunc, setup, teardown)
+
+static u32 key_hash(u32 key) {
+    return hashutil_ptr_hash((void *)(uintptr_t)key);
+}
+/* every key lands in the same slot with the same control byte, so each probe
+   goes through all of them */
+static u32 key_hash_colliding(u32 key) {
+    (void)key;
+    return 0;
+}
+static int key_equals(u32 a, u32 b) {
+    return a == b;
+}
+
+DECL_GROUP_HASH_TABLE(testmap, u32, u32)
+IMPL_GROUP_HASH_TABLE(testmap, u32, u32, key_hash, key_equals)
+DECL_GROUP_HASH_TABLE(collidemap, u32, u32)
+IMPL_GROUP_HASH_TABLE(collidemap, u32, u32, key_hash_colliding, key_equals)
+
+#define NUM_KEYS 4096
+
+/* the reference the table is compared against: the value of each key below
+   NUM_KEYS, if it is present */
+struct suite_data {
+    struct testmap map;
+    struct collidemap collide;
+    u8 present[NUM_KEYS];
+    u32 values[NUM_KEYS];
+    u32 count;
+    u32 seed;
+};
+
+static void setup(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    memset(data, 0, sizeof(struct suite_data));
+    data->seed = 12345;
+}
+
+static void teardown(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    testmap_free(&data->map);
+    collidemap_free(&data->collide);
+}
+
+static u32 next_random(struct suite_data *data) {
+    data->seed = data->seed * 1103515245 + 12345;
+    return data->seed >> 8;
+}
+
+static void ref_put(struct suite_data *data, u32 key, u32 value) {
+    testmap_put(&data->map, key, value);
+    data->count += !data->present[key];
+    data->present[key] = 1;
+    data->values[key] = value;
+}
+
+static int ref_remove(struct suite_data *data, u32 key) {
+    int removed = testmap_remove(&data->map, key);
+    data->count -= data->present[key];
+    data->present[key] = 0;
+    return removed;
+}
+
+/* looks up every key, then walks the slots and finds each present key once */
+static void check_against_reference(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    struct testmap *map = &data->map;
+    u8 seen[NUM_KEYS] = {0,};
+    for (u32 key = 0; key < NUM_KEYS; ++key) {
+        u32 value = ~0u;
+        int found = testmap_get(map, key, &value);
+        TEST_ASSERT(tc, found == data->present[key]);
+        TEST_ASSERT(tc, !found || value == data->values[key]);
+    }
+    TEST_ASSERT(tc, map->used == data->count);
+    testmap_finish_resize(map);
+    u32 used = 0;
+    for (u32 i = 0; i < map->size; ++i) {
+        if (testmap_slot_used(map, i)) {
+            u32 key = map->entries[i].key;
+            TEST_ASSERT(tc, key < NUM_KEYS && data->present[key] && !seen[key]);
+            TEST_ASSERT(tc, map->entries[i].value == data->values[key]);
+            seen[key] = 1;
+            ++used;
+        }
+    }
+    TEST_ASSERT(tc, used == data->count);
+}
+
+
+
+static void require_that_entries_can_be_put_and_removed(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    u32 value;
+    testmap_init(&data->map, 16);
+    TEST_ASSERT(tc, !testmap_get(&data->map, 1, &value));
+    TEST_ASSERT(tc, !testmap_remove(&data->map, 1));
+    for (u32 key = 0; key < 100; ++key) {
+        ref_put(data, key, key * 3);
+    }
+    check_against_reference(tc);
+    for (u32 key = 0; key < 100; key += 2) {
+        TEST_ASSERT(tc, ref_remove(data, key));
+    }
+    TEST_ASSERT(tc, !testmap_remove(&data->map, 0));
+    check_against_reference(tc);
+    testmap_clear(&data->map);
+    memset(data->present, 0, sizeof(data->present));
+    data->count = 0;
+    check_against_reference(tc);
+}
+
+static void require_that_puts_overwrite_the_value(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    u32 value;
+    testmap_init(&data->map, 16);
+    for (u32 key = 0; key < 10; ++key) {
+        ref_put(data, key, key);
+    }
+    ref_put(data, 5, 500);
+    TEST_ASSERT(tc, data->map.used == 10);
+    TEST_ASSERT(tc, testmap_get(&data->map, 5, &value) && value == 500);
+    check_against_reference(tc);
+}
+
+static void require_that_random_operations_match_the_reference(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    testmap_init(&data->map, 0);
+    for (u32 i = 0; i < 50000; ++i) {
+        u32 op = next_random(data) % 8;
+        u32 key = next_random(data) % NUM_KEYS;
+        if (op < 5) {
+            ref_put(data, key, i);
+        } else if (op < 7) {
+            int present = data->present[key];
+            TEST_ASSERT(tc, ref_remove(data, key) == present);
+        } else {
+            u32 value;
+            TEST_ASSERT(tc, testmap_get(&data->map, key, &value) == data->present[key]);
+        }
+        if (i % 5000 == 0) {
+            check_against_reference(tc);
+        }
+    }
+    check_against_reference(tc);
+}
+
+static void require_that_removed_slots_are_put_into_again(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    struct collidemap *map = &data->collide;
+    u32 value;
+    collidemap_init(map, 64);
+    /* all probes start at slot 0, so these fill slots 0 to 2. a probe stops at
+       slot 3 wherever it starts, so a removed slot is made empty again */
+    for (u32 key = 0; key < 3; ++key) {
+        collidemap_put(map, key, key);
+    }
+    TEST_ASSERT(tc, collidemap_remove(map, 1));
+    TEST_ASSERT(tc, map->ctrl[1] == HASHUTIL_CTRL_EMPTY && map->deleted == 0);
+    TEST_ASSERT(tc, collidemap_get(map, 2, &value) && value == 2);
+    collidemap_put(map, 1, 1);
+    for (u32 key = 3; key < 20; ++key) {
+        collidemap_put(map, key, key);
+    }
+    for (u32 key = 0; key < 20; ++key) {
+        TEST_ASSERT(tc, collidemap_slot_used(map, key) && map->entries[key].key == key);
+    }
+    /* now probes for the keys after it go past the slot, so it gets the marker */
+    TEST_ASSERT(tc, collidemap_remove(map, 5));
+    TEST_ASSERT(tc, map->ctrl[5] == HASHUTIL_CTRL_DELETED && map->deleted == 1);
+    TEST_ASSERT(tc, collidemap_get(map, 19, &value) && value == 19);
+    collidemap_put(map, 100, 100);
+    TEST_ASSERT(tc, map->deleted == 0);
+    TEST_ASSERT(tc, collidemap_slot_used(map, 5) && map->entries[5].key == 100);
+    TEST_ASSERT(tc, map->used == 20);
+    /* removing and putting over and over keeps the size */
+    for (u32 i = 0; i < 1000; ++i) {
+        TEST_ASSERT(tc, collidemap_remove(map, 1000 + i - 1) || i == 0);
+        collidemap_put(map, 1000 + i, i);
+        TEST_ASSERT(tc, map->size == 64);
+    }
+    for (u32 key = 0; key < 20; ++key) {
+        TEST_ASSERT(tc, collidemap_get(map, key, &value) == (key != 5));
+    }
+    TEST_ASSERT(tc, collidemap_get(map, 100, &value) && value == 100);
+    TEST_ASSERT(tc, collidemap_get(map, 1999, &value) && value == 999);
+    TEST_ASSERT(tc, map->used == 21);
+}
+
+/* puts keys from 0 up until the table grows incrementally, and returns the
+   first key not put */
+static u32 put_until_growing(struct suite_data *data) {
+    u32 key = 0;
+    while (!data->map.old_entries) {
+        ref_put(data, key, key + 1);
+        ++key;
+    }
+    return key;
+}
+
+/* a key in an old slot which the next count batches will not reach */
+static u32 key_left_in_old_slots(struct testmap *map, u32 count, u32 skip_key) {
+    for (u32 i = map->old_moved + count * HASHUTIL_MIGRATE_SLOTS; i < map->old_size; ++i) {
+        if ((map->old_ctrl[i] & HASHUTIL_CTRL_FULL) && map->old_entries[i].key != skip_key) {
+            return map->old_entries[i].key;
+        }
+    }
+    return ~0u;
+}
+
+static int in_old_slots(struct testmap *map, u32 key) {
+    for (u32 i = map->old_moved; map->old_entries && i < map->old_size; ++i) {
+        if ((map->old_ctrl[i] & HASHUTIL_CTRL_FULL) && map->old_entries[i].key == key) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void require_that_entries_are_found_while_growing(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    struct testmap *map = &data->map;
+    u32 value;
+    testmap_init(map, 16);
+    u32 next_key = put_until_growing(data);
+    TEST_ASSERT(tc, map->old_size == HASHUTIL_INCREMENTAL_MIN_SIZE);
+    TEST_ASSERT(tc, map->size == 2 * HASHUTIL_INCREMENTAL_MIN_SIZE);
+    TEST_ASSERT(tc, map->old_moved == 0 && map->old_used == next_key - 1);
+    TEST_ASSERT(tc, map->used == next_key);
+    u32 kept = key_left_in_old_slots(map, 3, ~0u);
+    u32 removed = key_left_in_old_slots(map, 3, kept);
+    TEST_ASSERT(tc, kept < NUM_KEYS && removed < NUM_KEYS);
+    /* each call moves a batch of the old slots */
+    TEST_ASSERT(tc, testmap_get(map, kept, &value) && value == kept + 1);
+    TEST_ASSERT(tc, map->old_moved == HASHUTIL_MIGRATE_SLOTS);
+    TEST_ASSERT(tc, in_old_slots(map, kept));
+    ref_put(data, kept, 1000000);
+    TEST_ASSERT(tc, in_old_slots(map, kept));
+    TEST_ASSERT(tc, map->used == next_key);
+    TEST_ASSERT(tc, testmap_get(map, kept, &value) && value == 1000000);
+    TEST_ASSERT(tc, in_old_slots(map, removed));
+    TEST_ASSERT(tc, ref_remove(data, removed));
+    TEST_ASSERT(tc, !in_old_slots(map, removed));
+    TEST_ASSERT(tc, !testmap_get(map, removed, &value));
+    TEST_ASSERT(tc, !testmap_remove(map, removed));
+    /* keys moved already, and keys put while growing */
+    TEST_ASSERT(tc, testmap_get(map, next_key - 1, &value) && value == next_key);
+    TEST_ASSERT(tc, ref_remove(data, next_key - 1));
+    ref_put(data, next_key, 7);
+    TEST_ASSERT(tc, testmap_get(map, next_key, &value) && value == 7);
+    check_against_reference(tc);
+    TEST_ASSERT(tc, map->old_size == 0 && !map->old_entries);
+}
+
+static void require_that_growing_finishes_on_its_own(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    struct testmap *map = &data->map;
+    u32 value;
+    testmap_init(map, 16);
+    put_until_growing(data);
+    u32 calls = 0;
+    while (map->old_entries) {
+        testmap_get(map, 0, &value);
+        ++calls;
+    }
+    TEST_ASSERT(tc, calls <= HASHUTIL_INCREMENTAL_MIN_SIZE / HASHUTIL_MIGRATE_SLOTS);
+    TEST_ASSERT(tc, map->old_size == 0 && map->old_used == 0 && map->old_moved == 0);
+    check_against_reference(tc);
+}
+
+static void require_that_growing_can_be_finished(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    struct testmap *map = &data->map;
+    testmap_init(map, 16);
+    u32 next_key = put_until_growing(data);
+    TEST_ASSERT(tc, map->old_used);
+    testmap_finish_resize(map);
+    TEST_ASSERT(tc, !map->old_entries && !map->old_ctrl);
+    TEST_ASSERT(tc, map->old_size == 0 && map->old_used == 0 && map->old_moved == 0);
+    TEST_ASSERT(tc, map->used == next_key);
+    u32 used = 0;
+    for (u32 i = 0; i < map->size; ++i) {
+        used += !!testmap_slot_used(map, i);
+    }
+    TEST_ASSERT(tc, used == next_key);
+    /* nothing left to do */
+    testmap_finish_resize(map);
+    check_against_reference(tc);
+}
+
+static void require_that_reserve_keeps_the_entries(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    struct testmap *map = &data->map;
+    testmap_init(map, 16);
+    for (u32 key = 0; key < 100; ++key) {
+        ref_put(data, key, key * 2);
+    }
+    /* room enough already */
+    testmap_reserve(map, 50);
+    TEST_ASSERT(tc, map->size == 128);
+    testmap_reserve(map, 3000);
+    TEST_ASSERT(tc, map->size == 4096 && !map->old_entries);
+    check_against_reference(tc);
+    for (u32 key = 100; key < 3000; ++key) {
+        ref_put(data, key, key * 2);
+    }
+    TEST_ASSERT(tc, map->size == 4096 && !map->old_entries);
+    check_against_reference(tc);
+}
+
+static void require_that_reserve_finishes_growing(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    struct testmap *map = &data->map;
+    testmap_init(map, 16);
+    u32 next_key = put_until_growing(data);
+    /* room enough in the new slots, so it is left growing */
+    testmap_reserve(map, next_key + 10);
+    TEST_ASSERT(tc, map->old_entries && map->old_moved == 0);
+    testmap_reserve(map, 3000);
+    TEST_ASSERT(tc, map->size == 4096);
+    TEST_ASSERT(tc, !map->old_entries && map->old_size == 0);
+    TEST_ASSERT(tc, map->used == next_key);
+    check_against_reference(tc);
+}
+
+static int value_is_odd(struct testmap_entry *entry, void *userdata) {
+    (void)userdata;
+    return entry->value & 1;
+}
+
+static void require_that_entries_are_removed_by_predicate(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    testmap_init(&data->map, 16);
+    u32 odd = 0;
+    for (u32 key = 0; key < 1000; ++key) {
+        ref_put(data, key, next_random(data));
+        odd += data->values[key] & 1;
+    }
+    u32 removed = testmap_remove_if(&data->map, value_is_odd, NULL);
+    TEST_ASSERT(tc, removed == odd);
+    for (u32 key = 0; key < 1000; ++key) {
+        if (data->values[key] & 1) {
+            data->present[key] = 0;
+            --data->count;
+        }
+    }
+    check_against_reference(tc);
+    TEST_ASSERT(tc, testmap_remove_if(&data->map, value_is_odd, NULL) == 0);
+}
+
+HASH_TEST_SUITE_BEGIN(HASH_TEST_SUITE)
+{
+    tc->suite_data = calloc(1, sizeof(struct suite_data));
+}
+TEST_SUITE_TEST(require_that_entries_can_be_put_and_removed)
+TEST_SUITE_TEST(require_that_puts_overwrite_the_value)
+TEST_SUITE_TEST(require_that_random_operations_match_the_reference)
+TEST_SUITE_TEST(require_that_removed_slots_are_put_into_again)
+TEST_SUITE_TEST(require_that_entries_are_removed_by_predicate)
+TEST_SUITE_TEST(require_that_entries_are_found_while_growing)
+TEST_SUITE_TEST(require_that_growing_finishes_on_its_own)
+TEST_SUITE_TEST(require_that_growing_can_be_finished)
+TEST_SUITE_TEST(require_that_reserve_keeps_the_entries)
+TEST_SUITE_TEST(require_that_reserve_finishes_growing)
+{
+    free(tc->suite_data);
+}
+TEST_SUITE_END()
@@ -0,0 +1,25 @@
+/* the group table tests again, with the probes which look at one control byte
+   at a time. the tables get other names, as their functions are not static */
+#ifndef RT_HASH_NO_SIMD
+#define RT_HASH_NO_SIMD
+#endif
+#define HASH_TEST_SUITE hash_scalar_test_suite
+#define testmap_clear scalar_testmap_clear
+#define testmap_remove scalar_testmap_remove
+#define testmap_remove_if scalar_testmap_remove_if
+#define testmap_get scalar_testmap_get
+#define testmap_put scalar_testmap_put
+#define testmap_reserve scalar_testmap_reserve
+#define testmap_finish_resize scalar_testmap_finish_resize
+#define testmap_init scalar_testmap_init
+#define testmap_free scalar_testmap_free
+#define collidemap_clear scalar_collidemap_clear
+#define collidemap_remove scalar_collidemap_remove
+#define collidemap_remove_if scalar_collidemap_remove_if
+#define collidemap_get scalar_collidemap_get
+#define collidemap_put scalar_collidemap_put
+#define collidemap_reserve scalar_collidemap_reserve
+#define collidemap_finish_resize scalar_collidemap_finish_resize
+#define collidemap_init scalar_collidemap_init
+#define collidemap_free scalar_collidemap_free
+#include "test_hash.c"
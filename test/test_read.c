@@ -0,0 +1,331 @@
+#include "testutil.h"
+#include "rt.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+struct suite_data {
+    struct rt_task task;
+    /* only made current by the tests which need locations */
+    struct rt_module mod;
+    char path[64];
+};
+
+static void setup(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    memset(&data->task, 0, sizeof(struct rt_task));
+    memset(&data->mod, 0, sizeof(struct rt_module));
+    data->path[0] = '\0';
+}
+
+static void teardown(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    if (data->path[0]) {
+        unlink(data->path);
+    }
+    rt_task_cleanup(&data->task);
+}
+
+static void write_all(int fd, const char *text, size_t len) {
+    while (len) {
+        ssize_t n = write(fd, text, len);
+        if (n <= 0) {
+            break;
+        }
+        text += n;
+        len -= (size_t)n;
+    }
+}
+
+static const char *write_temp_file(struct suite_data *data, const char *text) {
+    if (data->path[0]) {
+        unlink(data->path);
+    }
+    strcpy(data->path, "/tmp/rt_test_read_XXXXXX");
+    int fd = mkstemp(data->path);
+    write_all(fd, text, strlen(text));
+    close(fd);
+    return data->path;
+}
+
+/* the child process writes the text to a pipe, which the parent reads from */
+static int pipe_from_child(const char *text, size_t len, pid_t *child_out) {
+    int fds[2];
+    if (pipe(fds)) {
+        return -1;
+    }
+    pid_t child = fork();
+    if (child == 0) {
+        close(fds[0]);
+        write_all(fds[1], text, len);
+        close(fds[1]);
+        _exit(0);
+    }
+    close(fds[1]);
+    *child_out = child;
+    return fds[0];
+}
+
+
+
+static void require_that_files_are_read_form_by_form(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    const char *path = write_temp_file(data, "(a 1)\n; comment\n\"two\" (b (c 3.5))\n42");
+    struct rt_reader reader;
+    struct rt_any form;
+    TEST_ASSERT(tc, rt_reader_init_file(&reader, &data->task, path));
+    TEST_ASSERT(tc, reader.map);
+
+    TEST_ASSERT(tc, rt_reader_next(&reader, &form));
+    TEST_ASSERT(tc, rt_any_equals(rt_car(form), rt_get_symbol("a")));
+    TEST_ASSERT(tc, rt_reader_next(&reader, &form));
+    TEST_ASSERT(tc, rt_any_get_type(form) == rt_types.boxed_string);
+    TEST_ASSERT(tc, reader.line == 2);
+    TEST_ASSERT(tc, rt_reader_next(&reader, &form));
+    TEST_ASSERT(tc, rt_any_to_f64(rt_car(rt_cdr(rt_car(rt_cdr(form))))) == 3.5);
+    /* a number right at the end of the file */
+    TEST_ASSERT(tc, rt_reader_next(&reader, &form));
+    TEST_ASSERT(tc, rt_any_to_i64(form) == 42);
+    TEST_ASSERT(tc, !rt_reader_next(&reader, &form));
+    rt_reader_close(&reader);
+}
+
+static void require_that_whole_files_are_read_into_a_list(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    struct rt_any forms;
+    TEST_ASSERT(tc, rt_read_file(&data->task, write_temp_file(data, "1 2 (3)"), &forms));
+    TEST_ASSERT(tc, rt_any_to_i64(rt_car(forms)) == 1);
+    TEST_ASSERT(tc, rt_any_to_i64(rt_car(rt_cdr(forms))) == 2);
+    TEST_ASSERT(tc, rt_any_to_i64(rt_car(rt_car(rt_cdr(rt_cdr(forms))))) == 3);
+    TEST_ASSERT(tc, rt_any_is_nil(rt_cdr(rt_cdr(rt_cdr(forms)))));
+
+    TEST_ASSERT(tc, rt_read_file(&data->task, write_temp_file(data, ""), &forms));
+    TEST_ASSERT(tc, rt_any_is_nil(forms));
+    TEST_ASSERT(tc, !rt_read_file(&data->task, "/nonexistent/file", &forms));
+}
+
+/* much more than fits in the read buffer, so forms straddle refills */
+static void require_that_pipes_are_streamed(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    u32 form_count = 20000;
+    char *text = malloc(form_count * 32);
+    size_t len = 0;
+    for (u32 i = 0; i < form_count; ++i) {
+        len += (size_t)sprintf(text + len, "(entry %u \"text %u\" 0.5)\n", i, i);
+    }
+    pid_t child;
+    int fd = pipe_from_child(text, len, &child);
+    free(text);
+    TEST_ASSERT(tc, fd >= 0);
+
+    struct rt_reader reader;
+    struct rt_any form;
+    rt_reader_init_fd(&reader, &data->task, fd);
+    TEST_ASSERT(tc, !reader.map);
+    u32 count = 0;
+    while (rt_reader_next(&reader, &form)) {
+        TEST_ASSERT(tc, rt_any_to_i64(rt_car(rt_cdr(form))) == count);
+        ++count;
+    }
+    TEST_ASSERT(tc, count == form_count);
+    TEST_ASSERT(tc, reader.line == form_count);
+    rt_reader_close(&reader);
+    close(fd);
+    waitpid(child, NULL, 0);
+}
+
+static void require_same_scans(struct test_context *tc, const struct rt_scanner *scanner, const char *p, rt_size_t n) {
+    struct rt_space_run run = {0, 0}, expected_run = {0, 0};
+    TEST_ASSERT(tc, scanner->space(p, n, &run) == rt_scanner_scalar.space(p, n, &expected_run));
+    TEST_ASSERT(tc, run.newlines == expected_run.newlines);
+    TEST_ASSERT(tc, run.newlines == 0 || run.line_start == expected_run.line_start);
+    TEST_ASSERT(tc, scanner->symbol(p, n) == rt_scanner_scalar.symbol(p, n));
+    TEST_ASSERT(tc, scanner->string(p, n) == rt_scanner_scalar.string(p, n));
+    TEST_ASSERT(tc, scanner->comment(p, n) == rt_scanner_scalar.comment(p, n));
+}
+
+/* the scanner picked for the CPU must find the same runs as the scalar one,
+   wherever the run ends within or after a block */
+static void require_that_scanners_agree(struct test_context *tc) {
+    const struct rt_scanner *scanner = rt_get_scanner();
+    char text[200];
+    /* every byte value as the end of a run of each kind */
+    const char *runs[] = { " \t\n\v\f\n  ", "abc-def?!*<>=_^~%&/+XYZ09", "string text (with) 'quotes' ;", "comment \"\\ text" };
+    for (u32 r = 0; r < sizeof(runs) / sizeof(runs[0]); ++r) {
+        rt_size_t run_len = strlen(runs[r]);
+        for (u32 len = 0; len < 80; ++len) {
+            for (u32 i = 0; i < len; ++i) {
+                text[i] = runs[r][i % run_len];
+            }
+            for (u32 ch = 0; ch < 256; ++ch) {
+                text[len] = (char)ch;
+                text[len + 1] = 'x';
+                require_same_scans(tc, scanner, text, len + 2);
+                require_same_scans(tc, scanner, text, len + 1);
+                require_same_scans(tc, scanner, text, len);
+            }
+        }
+    }
+    /* pseudo-random text, at every offset */
+    u32 seed = 1;
+    for (u32 i = 0; i < sizeof(text); ++i) {
+        seed = seed * 1103515245 + 12345;
+        text[i] = " \n\"\\;(abz09-\r\t\x80"[(seed >> 16) % 15];
+    }
+    for (u32 offset = 0; offset < sizeof(text); ++offset) {
+        require_same_scans(tc, scanner, text + offset, sizeof(text) - offset);
+    }
+}
+
+/* runs longer than a SIMD block, ending at every position within one */
+static void require_that_long_runs_are_read(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    char text[512], expected[128];
+    for (u32 len = 1; len < 100; ++len) {
+        for (u32 i = 0; i < len; ++i) {
+            expected[i] = (char)('a' + i % 26);
+        }
+        expected[len] = '\0';
+        sprintf(text, "%*s; comment %s\n\n  \"%s\" %s", (int)len, "", expected, expected, expected);
+
+        struct rt_reader reader;
+        struct rt_any form;
+        rt_reader_init_string(&reader, &data->task, text, strlen(text));
+        TEST_ASSERT(tc, rt_reader_next(&reader, &form));
+        TEST_ASSERT(tc, strcmp(form.u.string->data, expected) == 0);
+        /* after the space following the string */
+        TEST_ASSERT(tc, reader.line == 2 && reader.base + reader.pos - reader.line_start == len + 5);
+        TEST_ASSERT(tc, rt_reader_next(&reader, &form));
+        TEST_ASSERT(tc, rt_any_equals(form, rt_get_symbol(expected)));
+        TEST_ASSERT(tc, !rt_reader_next(&reader, &form));
+        rt_reader_close(&reader);
+    }
+}
+
+/* far longer than the read buffer, so they are put together across refills
+   when read from a pipe */
+static void require_that_strings_and_symbols_have_no_length_limit(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    size_t len = 200000;
+    char *text = malloc(3 * len + 16);
+    char *p = text;
+    *p++ = '"';
+    for (size_t i = 0; i < len; ++i) {
+        *p++ = (char)('a' + i % 26);
+    }
+    p += sprintf(p, "\" \"\\\"");
+    for (size_t i = 0; i < len; ++i) {
+        *p++ = (char)('a' + i % 26);
+    }
+    p += sprintf(p, "\" ");
+    for (size_t i = 0; i < len; ++i) {
+        *p++ = (char)('a' + i % 26);
+    }
+    *p = '\0';
+    size_t text_len = (size_t)(p - text);
+
+    for (int from_pipe = 0; from_pipe < 2; ++from_pipe) {
+        pid_t child = 0;
+        int fd = -1;
+        struct rt_reader reader;
+        struct rt_any form;
+        if (from_pipe) {
+            fd = pipe_from_child(text, text_len, &child);
+            rt_reader_init_fd(&reader, &data->task, fd);
+        } else {
+            rt_reader_init_string(&reader, &data->task, text, text_len);
+        }
+        TEST_ASSERT(tc, rt_reader_next(&reader, &form));
+        TEST_ASSERT(tc, form.u.string->length == len);
+        TEST_ASSERT(tc, memcmp(form.u.string->data, text + 1, len) == 0);
+        /* with an escape at the start */
+        TEST_ASSERT(tc, rt_reader_next(&reader, &form));
+        TEST_ASSERT(tc, form.u.string->length == len + 1);
+        TEST_ASSERT(tc, form.u.string->data[0] == '"');
+        TEST_ASSERT(tc, memcmp(form.u.string->data + 1, text + 1, len) == 0);
+        TEST_ASSERT(tc, form.u.string->data[len + 1] == '\0');
+        TEST_ASSERT(tc, rt_reader_next(&reader, &form));
+        TEST_ASSERT(tc, form.u.symbol->length == len);
+        TEST_ASSERT(tc, memcmp(form.u.symbol->data, text + 1, len) == 0);
+        TEST_ASSERT(tc, !rt_reader_next(&reader, &form));
+        rt_reader_close(&reader);
+        if (from_pipe) {
+            close(fd);
+            waitpid(child, NULL, 0);
+        }
+    }
+    free(text);
+}
+
+static void require_that_symbols_are_interned_from_slices(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    struct rt_any sym = rt_get_symbol_n("interned-symbol and more", 15);
+    TEST_ASSERT(tc, rt_any_equals(sym, rt_get_symbol("interned-symbol")));
+    TEST_ASSERT(tc, sym.u.symbol->length == 15);
+    TEST_ASSERT(tc, sym.u.symbol->data[15] == '\0');
+    /* a prefix is a different symbol */
+    TEST_ASSERT(tc, !rt_any_equals(sym, rt_get_symbol_n("interned-symbol", 8)));
+    TEST_ASSERT(tc, rt_any_equals(rt_read(&data->task, "interned-symbol"), sym));
+}
+
+static void expect_location(struct test_context *tc, struct rt_module *mod, struct rt_any cons, u32 line, u32 col) {
+    u32 offset;
+    TEST_ASSERT(tc, rt_module_find_location(mod, cons.u.cons, &offset));
+    struct rt_sourceloc loc = rt_module_sourceloc(mod, offset);
+    TEST_ASSERT(tc, loc.line == line && loc.col == col);
+}
+
+static void require_that_locations_are_tracked_for_the_current_module(struct test_context *tc) {
+    struct suite_data *data = tc->suite_data;
+    struct rt_module *mod = &data->mod;
+    data->task.current_module = mod;
+    struct rt_any form = rt_read(&data->task, "(a\n  (b  c)\r\n d)");
+    expect_location(tc, mod, form, 0, 1);
+    expect_location(tc, mod, rt_car(rt_cdr(form)), 1, 3);
+    expect_location(tc, mod, rt_cdr(rt_car(rt_cdr(form))), 1, 6);
+    expect_location(tc, mod, rt_cdr(rt_cdr(form)), 2, 1);
+    /* the next input starts on a line of its own */
+    form = rt_read(&data->task, "(e)");
+    expect_location(tc, mod, form, 3, 1);
+
+    /* the locations of conses go when they do, looked up yet or not */
+    struct rt_type *types[] = { rt_types.any, NULL };
+    void *roots[] = { data->task.roots, types, &form };
+    data->task.roots = roots;
+    rt_read(&data->task, "(g h)");
+    rt_gc_run(&data->task);
+    TEST_ASSERT(tc, mod->sourcemap.used == 1 && mod->pending_offset_count == 0);
+    expect_location(tc, mod, form, 3, 1);
+    data->task.roots = roots[0];
+
+    struct rt_reader reader;
+    rt_reader_init_string(&reader, &data->task, "(f)", 3);
+    reader.mod = NULL;
+    TEST_ASSERT(tc, rt_reader_next(&reader, &form));
+    rt_reader_close(&reader);
+    u32 offset;
+    TEST_ASSERT(tc, !rt_module_find_location(mod, form.u.cons, &offset));
+    /* nothing is recorded either, so the line after "(g h)" is the last */
+    TEST_ASSERT(tc, mod->line_count == 5);
+}
+
+TEST_SUITE_BEGIN(read_test_suite, setup, teardown)
+{
+    rt_init();
+    tc->suite_data = calloc(1, sizeof(struct suite_data));
+}
+TEST_SUITE_TEST(require_that_files_are_read_form_by_form)
+TEST_SUITE_TEST(require_that_whole_files_are_read_into_a_list)
+TEST_SUITE_TEST(require_that_pipes_are_streamed)
+TEST_SUITE_TEST(require_that_scanners_agree)
+TEST_SUITE_TEST(require_that_long_runs_are_read)
+TEST_SUITE_TEST(require_that_strings_and_symbols_have_no_length_limit)
+TEST_SUITE_TEST(require_that_symbols_are_interned_from_slices)
+TEST_SUITE_TEST(require_that_locations_are_tracked_for_the_current_module)
+{
+    free(tc->suite_data);
+    rt_cleanup();
+}
+TEST_SUITE_END()